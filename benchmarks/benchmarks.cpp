@@ -0,0 +1,536 @@
+#include "dot.h"
+#include "engine.h"
+#include "expr.h"
+#include "kernels.h"
+#include "nn.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+// Usage: benchmarks [--json] [filter]
+// Runs every benchmark whose name contains filter and prints, per unit of work, the best time out of a few runs, the
+// number of heap allocations and the peak heap growth during a run. With --json the results are written to stdout
+// as a JSON document instead of a table, for tracking across releases. Build with -DCMAKE_BUILD_TYPE=Release.
+
+namespace {
+// Heap accounting through the replaced global operator new/delete below. Every block carries its size and its
+// offset from the start of the underlying allocation in a header, so delete knows how much was released.
+std::atomic<size_t> allocations;
+std::atomic<size_t> liveBytes;
+std::atomic<size_t> peakBytes;
+
+void *allocate(size_t size, size_t alignment)
+{
+  const size_t offset = std::max(alignment, 2 * sizeof(size_t));
+  void *base = nullptr;
+  if (alignment > alignof(std::max_align_t)) {
+    base = std::aligned_alloc(alignment, (size + offset + alignment - 1) / alignment * alignment);
+  } else {
+    base = std::malloc(size + offset);
+  }
+  if (base == nullptr) { return nullptr; }
+  auto *p = static_cast<char *>(base) + offset;
+  reinterpret_cast<size_t *>(p)[-1] = size;
+  reinterpret_cast<size_t *>(p)[-2] = offset;
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  const size_t live = liveBytes.fetch_add(size, std::memory_order_relaxed) + size;
+  size_t peak = peakBytes.load(std::memory_order_relaxed);
+  while (live > peak && !peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+  return p;
+}
+
+void *allocateOrThrow(size_t size, size_t alignment)
+{
+  void *p = allocate(size, alignment);
+  if (p == nullptr) { throw std::bad_alloc(); }
+  return p;
+}
+
+void release(void *p) noexcept
+{
+  if (p == nullptr) { return; }
+  auto *q = static_cast<char *>(p);
+  liveBytes.fetch_sub(reinterpret_cast<size_t *>(q)[-1], std::memory_order_relaxed);
+  std::free(q - reinterpret_cast<size_t *>(q)[-2]);
+}
+} // namespace
+
+void *operator new(size_t size) { return allocateOrThrow(size, alignof(std::max_align_t)); }
+void *operator new[](size_t size) { return allocateOrThrow(size, alignof(std::max_align_t)); }
+void *operator new(size_t size, std::align_val_t a) { return allocateOrThrow(size, static_cast<size_t>(a)); }
+void *operator new[](size_t size, std::align_val_t a) { return allocateOrThrow(size, static_cast<size_t>(a)); }
+void *operator new(size_t size, const std::nothrow_t & /*tag*/) noexcept
+{
+  return allocate(size, alignof(std::max_align_t));
+}
+void *operator new[](size_t size, const std::nothrow_t & /*tag*/) noexcept
+{
+  return allocate(size, alignof(std::max_align_t));
+}
+void operator delete(void *p) noexcept { release(p); }
+void operator delete[](void *p) noexcept { release(p); }
+void operator delete(void *p, size_t /*size*/) noexcept { release(p); }
+void operator delete[](void *p, size_t /*size*/) noexcept { release(p); }
+void operator delete(void *p, std::align_val_t /*a*/) noexcept { release(p); }
+void operator delete[](void *p, std::align_val_t /*a*/) noexcept { release(p); }
+void operator delete(void *p, size_t /*size*/, std::align_val_t /*a*/) noexcept { release(p); }
+void operator delete[](void *p, size_t /*size*/, std::align_val_t /*a*/) noexcept { release(p); }
+
+namespace {
+volatile double sink;
+
+struct Result
+{
+  std::string name;
+  std::string unit;
+  size_t items;
+  double ns;
+  double allocations;
+  size_t peakBytes;
+};
+
+class Suite
+{
+private:
+  std::string_view _filter;
+  bool _json;
+  std::vector<Result> _results;
+
+public:
+  Suite(std::string_view filter, bool json) : _filter(filter), _json(json) {}
+
+  // Runs f, which processes items units of work, a few times and records the fastest run; allocations and peak heap
+  // growth are the largest seen over the runs.
+  void run(const std::string &name, std::string unit, size_t items, const std::function<void()> &f)
+  {
+    if (name.find(_filter) == std::string::npos) { return; }
+    Result r{ name, std::move(unit), items, 1e300, 0, 0 };
+    for (int rep = 0; rep < 5; rep++) {
+      const size_t allocsBefore = allocations.load();
+      const size_t liveBefore = liveBytes.load();
+      peakBytes.store(liveBefore);
+      auto start = std::chrono::steady_clock::now();
+      f();
+      std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      r.ns = std::min(r.ns, elapsed.count() / static_cast<double>(items));
+      r.allocations =
+        std::max(r.allocations, static_cast<double>(allocations.load() - allocsBefore) / static_cast<double>(items));
+      r.peakBytes = std::max(r.peakBytes, peakBytes.load() - liveBefore);
+    }
+    if (!_json) {
+      std::cout << std::format("{:<36} {:>12.3f} ns/{:<6} {:>14.0f} {}/s {:>10.2f} allocs/{:<6} {:>10} peak bytes\n",
+        r.name,
+        r.ns,
+        r.unit,
+        1e9 / r.ns,
+        r.unit,
+        r.allocations,
+        r.unit,
+        r.peakBytes);
+    }
+    _results.push_back(std::move(r));
+  }
+
+  void printJson(std::ostream &os) const
+  {
+    os << "{\n  \"isa\": \"" << kernels::isaName(kernels::detectIsa()) << "\",\n  \"benchmarks\": [";
+    for (size_t i = 0; i < _results.size(); i++) {
+      const auto &r = _results[i];
+      os << (i == 0 ? "\n" : ",\n")
+         << std::format(R"(    {{"name": "{}", "unit": "{}", "items": {}, "ns_per_item": {:.3f}, )"
+                        R"("items_per_second": {:.1f}, "allocations_per_item": {:.3f}, "peak_bytes": {}}})",
+              r.name,
+              r.unit,
+              r.items,
+              r.ns,
+              1e9 / r.ns,
+              r.allocations,
+              r.peakBytes);
+    }
+    os << "\n  ]\n}\n";
+  }
+};
+
+std::vector<double> randomVector(size_t n, std::mt19937 &gen)
+{
+  std::uniform_real_distribution<> dis(-5.0, 5.0);
+  std::vector<double> v(n);
+  std::ranges::generate(v, [&] { return dis(gen); });
+  return v;
+}
+
+// Pairwise sum of terms, so that every level of the resulting graph is wide.
+ValuePtr reduce(std::vector<ValuePtr> terms)
+{
+  while (terms.size() > 1) {
+    std::vector<ValuePtr> next;
+    for (size_t i = 0; i + 1 < terms.size(); i += 2) { next.push_back(terms[i] + terms[i + 1]); }
+    if (terms.size() % 2 == 1) { next.push_back(terms.back()); }
+    terms = std::move(next);
+  }
+  return terms[0];
+}
+
+void kernelBenchmarks(Suite &suite, std::mt19937 &gen)
+{
+  const size_t n = 1 << 20;
+  auto x = randomVector(n, gen);
+  auto w = randomVector(n, gen);
+  std::vector<double> y(n);
+  std::vector<float> xf(x.begin(), x.end());
+  std::vector<float> wf(w.begin(), w.end());
+  std::vector<float> yf(n);
+  suite.run("std::exp", "elem", n, [&] {
+    for (size_t i = 0; i < n; i++) { y[i] = std::exp(x[i]); }
+  });
+  suite.run("std::tanh", "elem", n, [&] {
+    for (size_t i = 0; i < n; i++) { y[i] = std::tanh(x[i]); }
+  });
+  suite.run("loop dot", "elem", n, [&] {
+    double acc = 0;
+    for (size_t i = 0; i < n; i++) { acc += x[i] * w[i]; }
+    sink = acc;
+  });
+  for (auto isa : { kernels::Isa::SCALAR, kernels::Isa::AVX2, kernels::Isa::AVX512 }) {
+    kernels::setIsa(isa);
+    if (kernels::activeIsa() != isa) { continue; }
+    std::string name(kernels::isaName(isa));
+    suite.run(name + " exp", "elem", n, [&] { kernels::exp(x.data(), y.data(), n); });
+    suite.run(name + " tanh", "elem", n, [&] { kernels::tanh(x.data(), y.data(), n); });
+    suite.run(name + " tanh backward", "elem", n, [&] { kernels::tanhBackward(x.data(), w.data(), y.data(), n); });
+    suite.run(name + " relu", "elem", n, [&] { kernels::relu(x.data(), y.data(), n); });
+    suite.run(name + " dot", "elem", n, [&] { sink = kernels::dot(x.data(), w.data(), n); });
+    suite.run(name + " exp f32", "elem", n, [&] { kernels::exp(xf.data(), yf.data(), n); });
+    suite.run(name + " tanh f32", "elem", n, [&] { kernels::tanh(xf.data(), yf.data(), n); });
+    suite.run(name + " dot f32", "elem", n, [&] { sink = kernels::dot(xf.data(), wf.data(), n); });
+  }
+  kernels::setIsa(kernels::detectIsa());
+}
+
+// Creation of one node per op, including its release.
+void opBenchmarks(Suite &suite)
+{
+  const size_t n = 10000;
+  auto a = std::make_shared<Value>(0.7);
+  auto b = std::make_shared<Value>(1.3);
+  std::vector<ValuePtr> out(n);
+  auto op = [&](const std::string &name, const std::function<ValuePtr()> &make) {
+    suite.run("op " + name, "node", n, [&] {
+      for (auto &o : out) { o = make(); }
+      for (auto &o : out) { o.reset(); }
+    });
+  };
+  op("+", [&] { return a + b; });
+  op("-", [&] { return a - b; });
+  op("*", [&] { return a * b; });
+  op("/", [&] { return a / b; });
+  op("neg", [&] { return -a; });
+  op("exp", [&] { return exp(a); });
+  op("tanh", [&] { return tanh(a); });
+  op("relu", [&] { return relu(a); });
+  op("pow", [&] { return pow(a, b); });
+  op("+ constant", [&] { return a + 2.0; });
+  op("constant -", [&] { return 1.0 - a; });
+  op("pow constant", [&] { return pow(a, 2.0); });
+  // The squared error of loss(), pow(t - y, 2) per output, with both literals.
+  std::vector<double> target(n, 1.0);
+  std::vector<std::vector<ValuePtr>> y(1, std::vector<ValuePtr>(n, a));
+  suite.run("loss forward+backward", "output", n, [&] { loss(target, y)->backward(); });
+  suite.run("op * no-grad", "node", n, [&] {
+    NoGradGuard guard;
+    for (auto &o : out) { o = a * b; }
+    for (auto &o : out) { o.reset(); }
+  });
+  Tape tape;
+  suite.run("op * on tape", "node", n, [&] {
+    {
+      Tape::Scope scope(tape);
+      for (auto &o : out) { o = a * b; }
+      for (auto &o : out) { o.reset(); }
+    }
+    tape.clear();
+  });
+}
+
+void backwardBenchmarks(Suite &suite, ThreadPool &pool)
+{
+  // A chain deep enough to overflow a recursive sort.
+  const size_t depth = 100000;
+  auto leaf = std::make_shared<Value>(0.5);
+  ValuePtr chain = leaf;
+  for (size_t i = 0; i < depth; i++) { chain = chain * 0.999 + leaf; }
+  const size_t chainNodes = 3 * depth + 1;
+  suite.run("backward deep", "node", chainNodes, [&] { chain->backward(); });
+  suite.run("backward deep cached", "node", chainNodes, [&] { chain->backward(true); });
+
+  // Independent terms reduced pairwise.
+  std::vector<ValuePtr> leaves;
+  for (size_t i = 0; i < 64; i++) { leaves.push_back(std::make_shared<Value>(0.01 * static_cast<double>(i))); }
+  std::vector<ValuePtr> terms;
+  for (size_t i = 0; i < (1 << 16); i++) { terms.push_back(tanh(leaves[i % 64] * leaves[(i * 7) % 64])); }
+  ValuePtr wide = reduce(terms);
+  terms.clear();
+  const size_t wideNodes = 3 * (1 << 16) + 64;
+  suite.run("backward wide", "node", wideNodes, [&] { wide->backward(true); });
+  suite.run(std::format("backward wide parallel ({})", pool.size()), "node", wideNodes, [&] {
+    wide->backward(pool, true);
+  });
+
+  auto path = std::filesystem::temp_directory_path() / "micrograd_benchmark.dot";
+  std::vector<ValuePtr> small(leaves.begin(), leaves.begin() + 16);
+  for (size_t i = 0; i < 5000; i++) { small.push_back(tanh(leaves[i % 64] * leaves[(i * 3) % 64])); }
+  ValuePtr dotRoot = reduce(small);
+  suite.run("writeDot", "node", 3 * 5000 + 16 + 64, [&] { sink = writeDot(path.string(), *dotRoot) ? 1 : 0; });
+  std::filesystem::remove(path);
+}
+
+void mlpBenchmarks(Suite &suite, ThreadPool &pool, std::mt19937 &gen)
+{
+  for (const auto &sizes : std::vector<std::vector<size_t>>{ { 16, 32, 32, 4 }, { 64, 128, 128, 10 }, { 256, 512, 10 } }) {
+    MLP mlp(sizes);
+    mlp.randomize(gen);
+    auto sample = randomVector(sizes.front(), gen);
+    std::vector<double> target(sizes.back(), 1.0);
+    std::string shape;
+    for (auto s : sizes) { shape += (shape.empty() ? "" : "-") + std::to_string(s); }
+    const size_t steps = 200;
+
+    suite.run("mlp " + shape + " forward", "sample", steps, [&] {
+      for (size_t s = 0; s < steps; s++) { sink = mlp(sample)[0]->data(); }
+    });
+    suite.run("mlp " + shape + " forward+backward", "sample", steps, [&] {
+      for (size_t s = 0; s < steps; s++) { loss(target, { mlp(sample) })->backward(); }
+    });
+    auto input = Value::makeTensor({ sizes.front() }, sample);
+    input->setRequiresGrad(false);
+    Plan plan(loss(target, { unstack(mlp(input)) }));
+    suite.run("mlp " + shape + " plan replay", "sample", steps, [&] {
+      for (size_t s = 0; s < steps; s++) {
+        plan.forward();
+        plan.backward();
+      }
+    });
+    suite.run("mlp " + shape + " no-grad forward", "sample", steps, [&] {
+      NoGradGuard guard;
+      for (size_t s = 0; s < steps; s++) { sink = mlp(sample)[0]->data(); }
+    });
+    suite.run("mlp " + shape + " predict", "sample", steps, [&] {
+      for (size_t s = 0; s < steps; s++) { sink = mlp.predict(sample)[0]; }
+    });
+
+    const size_t rows = 1 << 14;
+    auto batch = randomVector(rows * sizes.front(), gen);
+    std::vector<double> outputs(rows * sizes.back());
+    suite.run("mlp " + shape + " predictBatch", "row", rows, [&] { mlp.predictBatch(batch, outputs); });
+    suite.run(std::format("mlp {} predictBatch ({})", shape, pool.size()), "row", rows, [&] {
+      mlp.predictBatch(batch, outputs, &pool);
+    });
+
+    // The same model in float.
+    BasicMLP<float> mlpF(sizes);
+    auto params = mlp.parameters();
+    auto paramsF = mlpF.parameters();
+    for (size_t i = 0; i < params.size(); i++) { std::ranges::copy(params[i]->values(), paramsF[i]->values().begin()); }
+    auto inputF = BasicValue<float>::makeTensor({ sizes.front() });
+    std::ranges::copy(sample, inputF->values().begin());
+    inputF->setRequiresGrad(false);
+    BasicPlan<float> planF(loss(target, std::vector<std::vector<BasicValuePtr<float>>>{ unstack(mlpF(inputF)) }));
+    suite.run("mlp " + shape + " plan replay f32", "sample", steps, [&] {
+      for (size_t s = 0; s < steps; s++) {
+        planF.forward();
+        planF.backward();
+      }
+    });
+    std::vector<float> batchF(batch.begin(), batch.end());
+    std::vector<float> outputsF(outputs.size());
+    suite.run("mlp " + shape + " predictBatch f32", "row", rows, [&] { mlpF.predictBatch(batchF, outputsF); });
+  }
+}
+
+// Forward and backward over a batch of deep MLPs, recording every layer or with checkpointed segments of
+// sqrt(depth) layers. The peak heap growth is the memory the graph keeps alive, as the parameters exist beforehand.
+void checkpointBenchmarks(Suite &suite, std::mt19937 &gen)
+{
+  const size_t width = 256;
+  const size_t batch = 8;
+  for (size_t depth : { 16, 64, 256 }) {
+    std::vector<size_t> sizes(depth + 1, width);
+    MLP mlp(sizes);
+    mlp.randomize(gen);
+    std::vector<std::vector<double>> samples;
+    for (size_t i = 0; i < batch; i++) { samples.push_back(randomVector(width, gen)); }
+    std::vector<double> target(width, 0.5);
+    const auto segment = static_cast<size_t>(std::lround(std::sqrt(static_cast<double>(depth))));
+    for (size_t layersPerSegment : { size_t{ 0 }, segment }) {
+      mlp.setCheckpointing(layersPerSegment);
+      auto name = std::format("deep mlp {}x{}", depth, width);
+      if (layersPerSegment > 0) { name += std::format(" checkpoint {}", layersPerSegment); }
+      suite.run(name, "sample", batch, [&] {
+        std::vector<std::vector<ValuePtr>> y;
+        for (const auto &x : samples) { y.push_back(mlp(x)); }
+        loss(target, y)->backward();
+      });
+    }
+  }
+}
+
+// Backward over a captured batch whose inputs are normalized in the graph, once with the inputs requiring a gradient
+// and once as plain data, in which case the normalization and the input side of the first layer drop out.
+void requiresGradBenchmarks(Suite &suite, std::mt19937 &gen)
+{
+  const std::vector<size_t> sizes = { 256, 512, 10 };
+  const size_t batch = 16;
+  MLP mlp(sizes);
+  mlp.randomize(gen);
+  auto capture = [&](bool inputGrad) {
+    std::vector<std::vector<ValuePtr>> y;
+    for (size_t i = 0; i < batch; i++) {
+      auto x = Value::makeTensor({ sizes.front() }, randomVector(sizes.front(), gen));
+      x->setRequiresGrad(inputGrad);
+      y.push_back(unstack(mlp((x - 0.5) * 2.0)));
+    }
+    return Plan(loss(std::vector<double>(sizes.back(), 0.5), y));
+  };
+  Plan withInputGrad = capture(true);
+  Plan withoutInputGrad = capture(false);
+  suite.run("plan backward input grad", "sample", batch, [&] { withInputGrad.backward(); });
+  suite.run("plan backward no input grad", "sample", batch, [&] { withoutInputGrad.backward(); });
+}
+
+// Saving and mapping a model of about 40 MB; load alone does not touch the weights, load+predict reads them all.
+void modelFileBenchmarks(Suite &suite, std::mt19937 &gen)
+{
+  MLP mlp({ 512, 2048, 2048, 10 });
+  mlp.randomize(gen);
+  auto sample = randomVector(512, gen);
+  auto path = (std::filesystem::temp_directory_path() / "micrograd_benchmark.model").string();
+  if (!mlp.save(path)) { return; }
+  suite.run("model 512-2048-2048-10 save", "model", 1, [&] { sink = mlp.save(path) ? 1 : 0; });
+  suite.run("model 512-2048-2048-10 load", "model", 1, [&] { sink = MLP::load(path)->parameters().size(); });
+  suite.run("model 512-2048-2048-10 load+predict", "model", 1, [&] { sink = MLP::load(path)->predict(sample)[0]; });
+  std::filesystem::remove(path);
+}
+
+void trainingBenchmarks(Suite &suite, std::mt19937 &gen)
+{
+  std::vector<std::vector<double>> inputs;
+  for (size_t i = 0; i < 256; i++) { inputs.push_back(randomVector(8, gen)); }
+  std::vector<double> target = { 1, -1 };
+  const size_t batchSize = 32;
+  const int epochs = 4;
+  const size_t steps = inputs.size() / batchSize * epochs;
+  for (size_t threads : { size_t{ 1 }, size_t{ 4 } }) {
+    TrainOptions options{
+      .niter = epochs, .batchSize = batchSize, .seed = 1, .threads = threads, .deterministic = true, .verbose = false
+    };
+    suite.run(std::format("gradientDescent 8-32-32-2 ({} threads)", threads), "step", steps, [&] {
+      sink = gradientDescent({ 32, 32 }, inputs, target, options).parameters()[0]->values()[0];
+    });
+  }
+  // One batch of the whole set, captured as a single graph or as graphs of 16 samples whose gradients are summed.
+  for (size_t micro : { size_t{ 0 }, size_t{ 16 } }) {
+    TrainOptions options{
+      .niter = epochs, .batchSize = inputs.size(), .microBatchSize = micro, .seed = 1, .verbose = false
+    };
+    suite.run(std::format("gradientDescent 8-32-32-2 batch 256 micro {}", micro), "step", epochs, [&] {
+      sink = gradientDescent({ 32, 32 }, inputs, target, options).parameters()[0]->values()[0];
+    });
+  }
+}
+
+// Parameter updates over a model of about 5M parameters: the per-tensor loop training used before the parameters
+// moved into one buffer, against the optimizers' single pass over it.
+void optimizerBenchmarks(Suite &suite, std::mt19937 &gen)
+{
+  MLP mlp({ 512, 2048, 2048, 10 });
+  const auto &buffer = mlp.parameterBuffer();
+  auto grads = randomVector(buffer->size(), gen);
+  std::ranges::copy(grads, buffer->grads().begin());
+  auto params = mlp.parameters();
+  const double lr = 1e-6;
+  suite.run("update per tensor", "param", buffer->size(), [&] {
+    for (const auto &p : params) {
+      auto v = p->values();
+      auto g = p->grads();
+      for (size_t j = 0; j < v.size(); j++) { v[j] -= lr * g[j]; }
+    }
+  });
+  for (auto [name, type, momentum] : { std::tuple{ "sgd", OptimizerType::SGD, 0.0 },
+         std::tuple{ "sgd momentum", OptimizerType::SGD, 0.9 },
+         std::tuple{ "adam", OptimizerType::ADAM, 0.0 },
+         std::tuple{ "adamw", OptimizerType::ADAMW, 0.0 } }) {
+    const OptimizerOptions options{ .type = type, .lr = lr, .momentum = momentum, .weightDecay = 1e-4 };
+    auto optimizer = makeOptimizer<double>(buffer, options);
+    suite.run(std::format("update {}", name), "param", buffer->size(), [&] { optimizer->step(); });
+  }
+}
+
+void exprBenchmarks(Suite &suite)
+{
+  const size_t steps = 10000;
+  auto a = std::make_shared<Value>(0.3);
+  auto b = std::make_shared<Value>(-1.2);
+  auto c = std::make_shared<Value>(0.8);
+  suite.run("graph a * b + exp(c) gradient", "eval", steps, [&] {
+    for (size_t s = 0; s < steps; s++) {
+      auto y = a * b + exp(c);
+      y->backward();
+      sink = a->grad();
+    }
+  });
+  expr::Var<0> ea;
+  expr::Var<1> eb;
+  expr::Var<2> ec;
+  auto f = ea * eb + exp(ec);
+  std::array<double, 3> at = { 0.3, -1.2, 0.8 };
+  suite.run("expr a * b + exp(c) gradient", "eval", steps, [&] {
+    for (size_t s = 0; s < steps; s++) {
+      at[0] = sink;
+      sink = expr::derivatives(f, at).d[0];
+    }
+  });
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+  bool json = false;
+  std::string_view filter;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (arg == "--json") {
+      json = true;
+    } else {
+      filter = arg;
+    }
+  }
+  Suite suite(filter, json);
+  std::mt19937 gen(42);
+  ThreadPool pool;
+  kernelBenchmarks(suite, gen);
+  opBenchmarks(suite);
+  backwardBenchmarks(suite, pool);
+  mlpBenchmarks(suite, pool, gen);
+  checkpointBenchmarks(suite, gen);
+  requiresGradBenchmarks(suite, gen);
+  modelFileBenchmarks(suite, gen);
+  trainingBenchmarks(suite, gen);
+  optimizerBenchmarks(suite, gen);
+  exprBenchmarks(suite);
+  if (json) { suite.printJson(std::cout); }
+  return 0;
+}
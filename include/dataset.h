@@ -0,0 +1,78 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Training data read in mini-batches instead of being loaded up front, so memory use does not depend on the size of
+// the dataset. Every row holds nin input values followed by nout target values.
+//
+//   auto data = openCsvDataset("train.csv", 1); // the last column is the target
+//   MLP mlp = gradientDescent({ 16, 16 }, *data, options);
+
+// Rows of a dataset as two row-major matrices, inputs of rows x nin and targets of rows x nout.
+struct Batch
+{
+  size_t rows{};
+  std::vector<double> inputs;
+  std::vector<double> targets;
+};
+
+class Dataset
+{
+public:
+  virtual ~Dataset() = default;
+  [[nodiscard]] virtual size_t nin() const = 0;
+  [[nodiscard]] virtual size_t nout() const = 0;
+  // Starts over from the first row.
+  virtual void rewind() = 0;
+  // Reads up to rows next rows into batch, reusing its buffers. Returns the number of rows read, 0 at the end.
+  virtual size_t read(Batch &batch, size_t rows) = 0;
+};
+
+// A CSV file of numbers whose last nout columns are the targets. A first line that does not parse as numbers is taken
+// as a header and skipped. Every row is checked when the file is opened. Returns nullptr, with an error message
+// giving the line of the first malformed row, if the file cannot be opened, has no more than nout columns or has a
+// row that is not nin + nout numbers.
+std::unique_ptr<Dataset> openCsvDataset(const std::string &fileName, size_t nout);
+
+// A packed binary dataset as written by writeBinaryDataset: a 64 byte header followed by the rows as doubles. The
+// file is mapped into memory and rows are copied out of the mapping, so pages are only read as batches reach them.
+// Returns nullptr if the file is missing or malformed.
+std::unique_ptr<Dataset> openBinaryDataset(const std::string &fileName);
+
+// Converts any dataset, e.g. a CSV file, to the packed binary format. Streams through data from its first row, so
+// memory use stays constant. Returns false on failure.
+bool writeBinaryDataset(const std::string &fileName, Dataset &data);
+
+// Reads the batches of one pass over a dataset on a background thread, staying one batch ahead of the consumer so
+// that reading overlaps training. Buffers circulate between the consumer and the thread, so a pass allocates
+// nothing after the first few batches.
+class Prefetcher
+{
+private:
+  Dataset &_data;
+  size_t _batchSize;
+  std::mutex _mutex;
+  std::condition_variable _changed;
+  Batch _ready;
+  bool _full{};
+  bool _end{};
+  bool _stop{};
+  std::thread _thread;
+
+  void run();
+
+public:
+  // Rewinds data and starts reading batches of batchSize rows; the last one may be shorter.
+  Prefetcher(Dataset &data, size_t batchSize);
+  Prefetcher(const Prefetcher &) = delete;
+  Prefetcher &operator=(const Prefetcher &) = delete;
+  ~Prefetcher();
+  // Swaps the next batch into batch, whose old buffers are used to read ahead. Returns false once the data is
+  // exhausted.
+  bool next(Batch &batch);
+};
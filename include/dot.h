@@ -0,0 +1,43 @@
+#pragma once
+#include "engine.h"
+#include <string>
+
+struct DotOptions
+{
+  // Nodes farther than this from the root are left out, and nodes whose operands were cut are drawn dashed; 0 draws
+  // the whole graph.
+  size_t maxDepth = 0;
+  // Ops with more operands than this draw the first ones and one node standing for the rest, e.g. for the sum over a
+  // batch; 0 draws all of them.
+  size_t maxOperands = 0;
+  // Draws the nodes that share a label as one cluster, e.g. the nodes of each layer of an MLP, which labels them by
+  // layer, or those of a Neuron or Layer given a label with setLabel.
+  bool clusterLabels = true;
+};
+
+// Writes computation graphs in Graphviz DOT format to a file descriptor. Every node and op is written once however
+// many consumers it has, and text is formatted straight into a fixed buffer that is written out whenever it fills
+// up, so the output never has to be held in memory as a whole. The traversal still keeps a queue entry per node,
+// and a pointer per labeled node for the clusters.
+class DotWriter
+{
+private:
+  int _fd;
+  DotOptions _options;
+  std::string _buffer;
+  bool _ok{ true };
+
+  template<class... Args> void print(std::format_string<Args...> fmt, Args &&...args);
+  void flush();
+
+public:
+  explicit DotWriter(int fd, DotOptions options = {});
+  DotWriter(const DotWriter &) = delete;
+  DotWriter &operator=(const DotWriter &) = delete;
+  ~DotWriter() { flush(); }
+  // Writes the graph of root as one digraph. Returns false if writing to the descriptor failed.
+  template<class T> bool write(BasicValue<T> &root);
+};
+
+// Writes the graph of root to fileName. Returns false if the file cannot be written.
+template<class T> bool writeDot(const std::string &fileName, BasicValue<T> &root, const DotOptions &options = {});
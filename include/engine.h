@@ -1,141 +1,279 @@
 #pragma once
+#include <atomic>
+#include <cassert>
+#include <cstdint>
 #include <format>
 #include <fstream>
-#include <functional>
 #include <iostream>
 #include <memory>
+#include <memory_resource>
 #include <ranges>
-#include <set>
+#include <span>
 #include <string>
+#include <type_traits>
 #include <vector>
-enum OpType { NONE, ADD, MUL, EXP, POW, RELU, SUB, DIV, TANH };
+// OPTYPE_COUNT is not an op but the number of them, for tables indexed by op.
+enum OpType {
+  NONE,
+  ADD,
+  MUL,
+  EXP,
+  POW,
+  RELU,
+  SUB,
+  DIV,
+  TANH,
+  MATVEC,
+  ELEMENT,
+  STACK,
+  SUM,
+  DOT,
+  NEG,
+  FUSED,
+  CHECKPOINT,
+  // x op c for a constant c stored in the node rather than as an operand; R marks c on the left-hand side, so
+  // RSUB_SCALAR is c - x. x - c is ADD_SCALAR with -c.
+  ADD_SCALAR,
+  MUL_SCALAR,
+  DIV_SCALAR,
+  RSUB_SCALAR,
+  RDIV_SCALAR,
+  POW_SCALAR,
+  RPOW_SCALAR,
+  OPTYPE_COUNT
+};
 std::string opToString(OpType op);
+bool isScalarOp(OpType op);
 std::pair<std::string, std::string> opDot(OpType *op);
 
-class Value
+// A scalar function of n scalars that also reports its partial derivatives, evaluated by a FUSED node. expr.h
+// implements it for expression templates.
+class FusedFunction
 {
-private:
-  double _grad{};
-  std::function<void()> _backward{ []() {} };
-  std::string _label{};
-  std::string _topology_dot_repr{};
-  std::vector<std::shared_ptr<Value>> _prev;
-  OpType op{};
+public:
+  virtual ~FusedFunction() = default;
+  // Writes f(x) to value and df/dx[i] to partials[i].
+  virtual void evaluate(std::span<const double> x, double &value, std::span<double> partials) const = 0;
+};
 
-  [[nodiscard]] std::vector<Value *> topo();
-  static void buildTopo(Value *v, std::vector<Value *> &topo, std::set<Value *> &seen);
+class DotWriter;
+template<class T> class BasicPlan;
+template<class T> class BasicTape;
+template<class T> class BasicValue;
+class ThreadPool;
 
+template<class T> using BasicValuePtr = std::shared_ptr<BasicValue<T>>;
 
+// A function of one tensor built from the operators below, evaluated by a CHECKPOINT node. The node keeps only the
+// result: f runs without recording a graph, and backward runs it again, recording this time, to backpropagate
+// through it. f must give the same result for the same input each time.
+template<class T> class CheckpointFunction
+{
 public:
-  using ValuePtr = std::shared_ptr<Value>;
-  double _data{};
-  Value() = default;
-  explicit Value(double data) : _data(data) {}
-  explicit Value(double data, std::string label) : _data(data), _label(std::move(label)) {}
-  [[nodiscard]] double data() const { return _data; }
-  [[nodiscard]] double grad() const { return _grad; }
-  [[nodiscard]] const std::string &label() const { return _label; }
-  void backward();
-  static void printDOT(const std::string &filename, Value *value);
-  void printDOT(const std::string &filename);
+  virtual ~CheckpointFunction() = default;
+  virtual BasicValuePtr<T> operator()(const BasicValuePtr<T> &x) const = 0;
+};
 
-  friend ValuePtr operator+(const ValuePtr &lhs, const ValuePtr &rhs)
+// A node of the computation graph over scalars of type T, float or double. Nodes of different scalar types cannot be
+// mixed in one graph; Value is the double version.
+template<class T> class BasicValue
+{
+  static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>);
+
+public:
+  using scalar = T;
+  using ValuePtr = std::shared_ptr<BasicValue>;
+
+private:
+  friend class DotWriter;
+  friend class BasicPlan<T>;
+  friend class BasicTape<T>;
+  // Payload of tensor-valued nodes: contiguous row-major values and gradients. Buffers that are not supplied from
+  // outside are allocated from the same memory resource as the node, so tensors recorded on a Tape live in its arena
+  // too. owner keeps outside buffers alive when they belong to something reference counted.
+  struct Tensor
   {
-    ValuePtr out = std::make_shared<Value>();
-    out->_data = lhs->_data + rhs->_data;
-    out->_prev.push_back(lhs);
-    out->_prev.push_back(rhs);
-    out->op = ADD;
-    out->_backward = [lhs, rhs, out]() {
-      lhs->_grad += out->_grad;
-      rhs->_grad += out->_grad;
-    };
-    return out;
+    std::pmr::vector<size_t> shape;
+    std::pmr::vector<T> storage;
+    T *data{};
+    T *grad{};
+    size_t size{};
+    std::shared_ptr<const void> owner;
+    Tensor(std::span<const size_t> shape, std::pmr::memory_resource *resource, T *data, T *grad);
+  };
+
+  T _grad{};
+  std::string _label{};
+  std::pmr::vector<ValuePtr> _prev;
+  std::unique_ptr<std::vector<BasicValue *>> _topoCache;
+  Tensor *_tensor{};
+  std::uint64_t _visit{};
+  OpType op{};
+  std::uint32_t _index{};
+  // Longest distance from the root of the last parallel backward pass.
+  std::uint32_t _level{};
+  bool _constant{};
+  bool _requiresGrad{ true };
+  // The constant operand of the *_SCALAR ops.
+  T _aux{};
+  static std::atomic<std::uint64_t> _epoch;
+
+  // With pruned set, nodes that require no gradient are left out, which is the order backward needs.
+  [[nodiscard]] std::vector<BasicValue *> topo(bool pruned = true);
+  static void buildTopo(BasicValue *root, std::vector<BasicValue *> &topo, bool pruned);
+  [[nodiscard]] const std::vector<BasicValue *> &topoOrder(bool cacheTopo, std::vector<BasicValue *> &fresh);
+  // Accumulates this node's gradient into its operands according to op. With concurrent set, other threads may be
+  // accumulating into the same operands, so every operand is locked while it is written.
+  void backwardStep(bool concurrent = false);
+  // Computes this node's value from the operands in according to op; a no-op for leaves. forward() without
+  // arguments reads the recorded operands, which is how a Plan replays a captured graph.
+  void forward(std::span<const ValuePtr> in);
+  void forward() { forward(_prev); }
+  void forwardTensor(std::span<const ValuePtr> in);
+  // Finishes a node created by an operator: computes its value from the operands and records them, unless a
+  // NoGradGuard is active on the thread, in which case the node is left a leaf that only holds its value.
+  static ValuePtr makeOp(OpType op, ValuePtr out, std::span<const ValuePtr> in);
+  static ValuePtr makeOp(OpType op, ValuePtr out, std::initializer_list<ValuePtr> in)
+  {
+    return makeOp(op, std::move(out), std::span<const ValuePtr>(in.begin(), in.size()));
   }
+  void backwardTensor(bool concurrent);
+  void fillGrad(T g);
+  [[nodiscard]] T *vals() { return _tensor != nullptr ? _tensor->data : &_data; }
+  [[nodiscard]] T *grds() { return _tensor != nullptr ? _tensor->grad : &_grad; }
+  // Result node of an elementwise op: a scalar if both operands are scalars, otherwise a tensor shaped like the
+  // tensor operand. A scalar operand is broadcast over the other one.
+  static ValuePtr makeLike(const ValuePtr &lhs, const ValuePtr &rhs);
+  // x op c with c held by the node.
+  static ValuePtr makeScalarOp(OpType op, const ValuePtr &x, T c);
+  // lhs op rhs for ADD, SUB, MUL, DIV and POW. A scalar constant operand is turned into the c of the matching
+  // *_SCALAR op, so constants never become operands.
+  static ValuePtr makeBinary(OpType op, const ValuePtr &lhs, const ValuePtr &rhs);
+  // f(x) without recording a graph or placing nodes on the active Tape, so nothing but the result stays alive.
+  static ValuePtr evaluateUnrecorded(const CheckpointFunction<T> &f, const ValuePtr &x);
+  void backwardCheckpoint(bool concurrent);
 
-  friend ValuePtr operator-(const ValuePtr &lhs, const ValuePtr &rhs) { return lhs + (-rhs); }
 
-  friend ValuePtr operator*(const ValuePtr &lhs, const ValuePtr &rhs)
+public:
+  T _data{};
+  BasicValue() = default;
+  BasicValue(const BasicValue &) = delete;
+  BasicValue &operator=(const BasicValue &) = delete;
+  BasicValue(BasicValue &&) = delete;
+  BasicValue &operator=(BasicValue &&) = delete;
+  ~BasicValue();
+  explicit BasicValue(T data) : _data(data) {}
+  explicit BasicValue(T data, std::string label) : _label(std::move(label)), _data(data) {}
+  // Used by make() to place the operand list in the same arena as the node itself.
+  BasicValue(std::allocator_arg_t /*tag*/, std::pmr::memory_resource *resource, T data) : _prev(resource), _data(data)
+  {}
+  // Allocates a node on the active Tape if there is one, on the heap otherwise.
+  static ValuePtr make(T data = 0);
+  // A leaf holding a fixed value that takes no gradient. Operators store it in the nodes that use it instead of
+  // recording it as an operand, and ops whose operands are all constants are evaluated at once into a constant, so
+  // constants never reach the topological sort or backward. Literals such as the 2 in x * 2 are handled this way
+  // without creating a node at all.
+  static ValuePtr constant(T value);
+  // Same as make() for a tensor node; data is copied in when given, the tensor is zero-filled otherwise.
+  static ValuePtr makeTensor(std::span<const size_t> shape, std::span<const T> data = {});
+  static ValuePtr makeTensor(std::initializer_list<size_t> shape, std::span<const T> data = {})
   {
-    ValuePtr out = std::make_shared<Value>();
-    out->_data = lhs->_data * rhs->_data;
-    out->_prev.push_back(lhs);
-    out->_prev.push_back(rhs);
-    out->op = MUL;
-    out->_backward = [lhs, rhs, out]() {
-      lhs->_grad += out->_grad * rhs->_data;
-      rhs->_grad += out->_grad * lhs->_data;
-    };
-    return out;
+    return makeTensor(std::span<const size_t>(shape.begin(), shape.size()), data);
   }
-
-  friend ValuePtr exp(const ValuePtr &v)
+  // A leaf tensor over buffers owned by someone else: data holds the values, grad the gradients or nullptr for a
+  // zeroed buffer of the node's own. owner, if set, is kept alive as long as the node.
+  static ValuePtr makeTensorView(std::span<const size_t> shape,
+    T *data,
+    T *grad = nullptr,
+    std::shared_ptr<const void> owner = nullptr);
+  // A view sharing the values of tensor t but with separate gradients, e.g. one per training thread.
+  static ValuePtr shareValues(const ValuePtr &t) { return makeTensorView(t->shape(), t->vals(), nullptr, t); }
+  [[nodiscard]] T data() const { return _data; }
+  [[nodiscard]] T grad() const { return _grad; }
+  [[nodiscard]] bool isTensor() const { return _tensor != nullptr; }
+  [[nodiscard]] bool isConstant() const { return _constant; }
+  // Whether backward computes a gradient for this node. Leaves are created with it set and an op requires a gradient
+  // if any of its operands does; nodes that do not are left out of backward altogether, so inputs and targets should
+  // have it cleared. Unlike a constant, such a leaf can still be changed, e.g. as the input of a Plan.
+  [[nodiscard]] bool requiresGrad() const { return _requiresGrad; }
+  // Only for leaves, before they are used; the flag of an op node follows from its operands when it is created.
+  void setRequiresGrad(bool requiresGrad) { _requiresGrad = requiresGrad; }
+  [[nodiscard]] std::span<const size_t> shape() const
   {
-    ValuePtr out = std::make_shared<Value>();
-    out->_data = std::exp(v->_data);
-    out->_prev.push_back(v);
-    out->op = EXP;
-    out->_backward = [v, out]() { v->_grad += out->_grad * std::exp(v->_data); };
-    return out;
+    return _tensor != nullptr ? std::span<const size_t>(_tensor->shape) : std::span<const size_t>();
   }
+  [[nodiscard]] size_t size() const { return _tensor != nullptr ? _tensor->size : 1; }
+  // Values and gradients as flat spans; a scalar node is a span of one element.
+  [[nodiscard]] std::span<T> values() { return { vals(), size() }; }
+  [[nodiscard]] std::span<const T> values() const { return const_cast<BasicValue *>(this)->values(); }
+  [[nodiscard]] std::span<T> grads() { return { grds(), size() }; }
+  [[nodiscard]] std::span<const T> grads() const { return const_cast<BasicValue *>(this)->grads(); }
+  [[nodiscard]] const std::string &label() const { return _label; }
+  void setLabel(std::string label) { _label = std::move(label); }
+  // Adds the gradient of this node to the gradients of the leaves it depends on; those of the nodes in between are
+  // recomputed. Leaf gradients thus accumulate over several calls, e.g. the micro-batches of one update, until they
+  // are reset with zeroGrad() here or on the model or optimizer. With cacheTopo the topological order is kept on this
+  // node, so later calls on the same graph skip the sort.
+  void backward(bool cacheTopo = false);
+  // Same as backward() but runs the independent nodes of each dependency level on the pool, or serially for a pool of
+  // size one. Gradients that several nodes accumulate into are summed in whatever order the threads get there, so
+  // results may differ from the serial pass by floating-point reassociation.
+  void backward(ThreadPool &pool, bool cacheTopo = false);
+  void zeroGrad() { fillGrad(0); }
+  // Writes the graph in DOT format and reports the file on stdout; see dot.h for options and streaming.
+  static void printDOT(const std::string &filename, BasicValue *value);
+  void printDOT(const std::string &filename);
+
+  friend ValuePtr operator+(const ValuePtr &lhs, const ValuePtr &rhs) { return makeBinary(ADD, lhs, rhs); }
+
+  friend ValuePtr operator-(const ValuePtr &lhs, const ValuePtr &rhs) { return makeBinary(SUB, lhs, rhs); }
+
+  friend ValuePtr operator*(const ValuePtr &lhs, const ValuePtr &rhs) { return makeBinary(MUL, lhs, rhs); }
+
+  // Elementwise on tensors through kernels::exp, which underflows to 0 and overflows to infinity like std::exp.
+  friend ValuePtr exp(const ValuePtr &v) { return makeOp(EXP, makeLike(v, v), { v }); }
 
   friend ValuePtr pow(const ValuePtr &x, const ValuePtr &a)
   {
-    ValuePtr out = std::make_shared<Value>();
-    out->_data = std::pow(x->_data, a->_data);
-    out->_prev.push_back(x);
-    out->_prev.push_back(a);
-    out->op = POW;
-    out->_backward = [x, a, out]() {
-      x->_grad += out->_grad * a->_data * std::pow(x->_data, a->_data - 1);
-      a->_grad += out->_grad * std::log(x->_data) * std::pow(x->_data, a->_data);
-    };
-    return out;
+    assert(!x->isTensor() && !a->isTensor());
+    return makeBinary(POW, x, a);
   }
 
-  friend ValuePtr relu(const ValuePtr &v)
-  {
-    ValuePtr out = std::make_shared<Value>();
-    out->_data = std::max(0.0, v->_data);
-    out->_prev.push_back(v);
-    out->op = RELU;
-    out->_backward = [v, out]() { v->_grad += out->_grad * (v->_data > 0 ? 1 : 0); };
-    return out;
-  }
+  friend ValuePtr relu(const ValuePtr &v) { return makeOp(RELU, makeLike(v, v), { v }); }
 
-  friend ValuePtr operator/(const ValuePtr &lhs, const ValuePtr &rhs) { return lhs * pow(rhs, -1); }
+  friend ValuePtr operator/(const ValuePtr &lhs, const ValuePtr &rhs) { return makeBinary(DIV, lhs, rhs); }
 
-  template<typename T> friend ValuePtr operator+(const T &lhs, const ValuePtr &rhs)
+  template<typename U> friend ValuePtr operator+(const U &lhs, const ValuePtr &rhs)
   {
-    return std::make_shared<Value>(lhs) + rhs;
+    return makeScalarOp(ADD_SCALAR, rhs, static_cast<T>(lhs));
   }
 
-  template<typename T> friend ValuePtr operator+(const ValuePtr &lhs, const T &rhs)
+  template<typename U> friend ValuePtr operator+(const ValuePtr &lhs, const U &rhs)
   {
-    return lhs + std::make_shared<Value>(rhs);
+    return makeScalarOp(ADD_SCALAR, lhs, static_cast<T>(rhs));
   }
 
-  template<typename T> friend ValuePtr operator*(const T &lhs, const ValuePtr &rhs)
+  template<typename U> friend ValuePtr operator*(const U &lhs, const ValuePtr &rhs)
   {
-    return std::make_shared<Value>(lhs) * rhs;
+    return makeScalarOp(MUL_SCALAR, rhs, static_cast<T>(lhs));
   }
 
-  template<typename T> friend ValuePtr operator*(const ValuePtr &lhs, const T &rhs)
+  template<typename U> friend ValuePtr operator*(const ValuePtr &lhs, const U &rhs)
   {
-    return lhs * std::make_shared<Value>(rhs);
+    return makeScalarOp(MUL_SCALAR, lhs, static_cast<T>(rhs));
   }
 
-  friend ValuePtr operator-(const ValuePtr &rhs) { return -1.0 * rhs; }
+  friend ValuePtr operator-(const ValuePtr &v) { return makeOp(NEG, makeLike(v, v), { v }); }
 
 
-  template<typename T> friend ValuePtr operator-(const T &lhs, const ValuePtr &rhs)
+  template<typename U> friend ValuePtr operator-(const U &lhs, const ValuePtr &rhs)
   {
-    return std::make_shared<Value>(lhs) - rhs;
+    return makeScalarOp(RSUB_SCALAR, rhs, static_cast<T>(lhs));
   }
 
-  template<typename T> friend ValuePtr operator-(const ValuePtr &lhs, const T &rhs)
+  template<typename U> friend ValuePtr operator-(const ValuePtr &lhs, const U &rhs)
   {
-    return lhs - std::make_shared<Value>(rhs);
+    return makeScalarOp(ADD_SCALAR, lhs, -static_cast<T>(rhs));
   }
 
   friend std::ostream &operator<<(std::ostream &ostr, const ValuePtr &value)
@@ -144,37 +282,49 @@ public:
     return ostr;
   }
 
-  template<typename T> friend ValuePtr pow(const T &x, const ValuePtr &a) { return pow(std::make_shared<Value>(x), a); }
-
-  template<typename T> friend ValuePtr pow(const ValuePtr &x, const T &a) { return pow(x, std::make_shared<Value>(a)); }
+  template<typename U> friend ValuePtr pow(const U &x, const ValuePtr &a)
+  {
+    assert(!a->isTensor());
+    return makeScalarOp(RPOW_SCALAR, a, static_cast<T>(x));
+  }
 
-  template<typename T> friend ValuePtr operator/(const T &lhs, const ValuePtr &rhs)
+  template<typename U> friend ValuePtr pow(const ValuePtr &x, const U &a)
   {
-    return std::make_shared<Value>(lhs) / rhs;
+    assert(!x->isTensor());
+    return makeScalarOp(POW_SCALAR, x, static_cast<T>(a));
   }
 
-  template<typename T> friend ValuePtr operator/(const ValuePtr &lhs, const T &rhs)
+  template<typename U> friend ValuePtr operator/(const U &lhs, const ValuePtr &rhs)
   {
-    return lhs / std::make_shared<Value>(rhs);
+    return makeScalarOp(RDIV_SCALAR, rhs, static_cast<T>(lhs));
   }
 
-  friend ValuePtr tanh(const ValuePtr &v)
+  template<typename U> friend ValuePtr operator/(const ValuePtr &lhs, const U &rhs)
   {
-    ValuePtr out = std::make_shared<Value>();
-    out->_data = std::tanh(v->_data);
-    out->_prev.push_back(v);
-    out->op = TANH;
-    out->_backward = [v, out]() { v->_grad += out->_grad * (1.0 - std::tanh(v->_data) * std::tanh(v->_data)); };
-    return out;
+    return makeScalarOp(DIV_SCALAR, lhs, static_cast<T>(rhs));
   }
 
+  friend ValuePtr tanh(const ValuePtr &v) { return makeOp(TANH, makeLike(v, v), { v }); }
+
+  template<class U> friend BasicValuePtr<U> matvec(const BasicValuePtr<U> &W, const BasicValuePtr<U> &x);
+  template<class U> friend BasicValuePtr<U> element(const BasicValuePtr<U> &t, size_t i);
+  template<class U> friend BasicValuePtr<U> stack(const std::vector<BasicValuePtr<U>> &xs);
+  template<class U> friend BasicValuePtr<U> sum(const std::vector<BasicValuePtr<U>> &xs);
+  template<class U> friend BasicValuePtr<U> dot(const std::vector<BasicValuePtr<U>> &xs,
+    const std::vector<BasicValuePtr<U>> &ws);
+  template<class U> friend BasicValuePtr<U> fused(std::shared_ptr<const FusedFunction> f,
+    const std::vector<BasicValuePtr<U>> &xs);
+  template<class U> friend BasicValuePtr<U> checkpoint(std::shared_ptr<const CheckpointFunction<U>> f,
+    const BasicValuePtr<U> &x,
+    const std::vector<BasicValuePtr<U>> &params);
+
   friend ValuePtr operator+=(ValuePtr &lhs, const ValuePtr &rhs)
   {
     lhs = lhs + rhs;
     return lhs;
   }
 
-  template<typename T> friend ValuePtr operator+=(ValuePtr &lhs, const T &rhs)
+  template<typename U> friend ValuePtr operator+=(ValuePtr &lhs, const U &rhs)
   {
     lhs = lhs + rhs;
     return lhs;
@@ -186,7 +336,7 @@ public:
     return lhs;
   }
 
-  template<typename T> friend ValuePtr operator-=(ValuePtr &lhs, const T &rhs)
+  template<typename U> friend ValuePtr operator-=(ValuePtr &lhs, const U &rhs)
   {
     lhs = lhs - rhs;
     return lhs;
@@ -198,7 +348,7 @@ public:
     return lhs;
   }
 
-  template<typename T> friend ValuePtr operator*=(ValuePtr &lhs, const T &rhs)
+  template<typename U> friend ValuePtr operator*=(ValuePtr &lhs, const U &rhs)
   {
     lhs = lhs * rhs;
     return lhs;
@@ -210,11 +360,149 @@ public:
     return lhs;
   }
 
-  template<typename T> friend ValuePtr operator/=(ValuePtr &lhs, const T &rhs)
+  template<typename U> friend ValuePtr operator/=(ValuePtr &lhs, const U &rhs)
   {
     lhs = lhs / rhs;
     return lhs;
   }
 };
 
-using ValuePtr = std::shared_ptr<Value>;
\ No newline at end of file
+using Value = BasicValue<double>;
+using ValuePtr = BasicValuePtr<double>;
+
+// W (m x n) times x (n) as a single node of shape {m}.
+template<class T> BasicValuePtr<T> matvec(const BasicValuePtr<T> &W, const BasicValuePtr<T> &x);
+// Scalar view of element i of a tensor.
+template<class T> BasicValuePtr<T> element(const BasicValuePtr<T> &t, size_t i);
+// Gathers scalars into a tensor of shape {n}.
+template<class T> BasicValuePtr<T> stack(const std::vector<BasicValuePtr<T>> &xs);
+// One element node per entry of t.
+template<class T> std::vector<BasicValuePtr<T>> unstack(const BasicValuePtr<T> &t);
+// Sum of any number of scalars as a single node.
+template<class T> BasicValuePtr<T> sum(const std::vector<BasicValuePtr<T>> &xs);
+// Inner product of two equally long lists of scalars as a single node.
+template<class T>
+BasicValuePtr<T> dot(const std::vector<BasicValuePtr<T>> &xs, const std::vector<BasicValuePtr<T>> &ws);
+// f over the scalars xs as a single node, whose backward scales the output gradient by the partials f reported. f
+// is evaluated in double whatever the scalar type of the graph.
+template<class T>
+BasicValuePtr<T> fused(std::shared_ptr<const FusedFunction> f, const std::vector<BasicValuePtr<T>> &xs);
+// f(x) as a single node that keeps neither the graph of f nor its intermediate values, for gradient checkpointing:
+// backward rebuilds the graph from x, which costs a second evaluation of f. params are the leaves f reads besides x,
+// e.g. the weights of the layers it applies; they become operands of the node so that backward accumulates into
+// them. x must be a tensor.
+template<class T>
+BasicValuePtr<T> checkpoint(std::shared_ptr<const CheckpointFunction<T>> f,
+  const BasicValuePtr<T> &x,
+  const std::vector<BasicValuePtr<T>> &params);
+
+// A Wengert list: while a Tape::Scope is active on the current thread every node created by the operators above is
+// placed in the tape's arena and appended to the tape in creation order, which is already a topological order. The
+// whole graph is released in one shot by clear(), and the arena is reused by the next graph without going back to
+// the heap once it has grown to the size of the largest graph seen.
+//
+// Nodes created outside of a scope (e.g. model parameters) are not owned by the tape and may be referenced freely.
+// Every ValuePtr to a node on the tape must be dropped before clear() is called.
+template<class T> class BasicTape
+{
+private:
+  friend class BasicValue<T>;
+  // Forwards to the default resource and remembers how much the arena had to request beyond its initial buffer.
+  class Upstream : public std::pmr::memory_resource
+  {
+  public:
+    size_t overflow{};
+
+  private:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+    [[nodiscard]] bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+  };
+
+  std::vector<std::byte> _buffer;
+  Upstream _upstream;
+  std::pmr::monotonic_buffer_resource _arena;
+  std::vector<BasicValuePtr<T>> _nodes;
+  inline static thread_local BasicTape *_active = nullptr;
+  void releaseNodes();
+
+public:
+  explicit BasicTape(size_t initialBytes = 1 << 16);
+  BasicTape(const BasicTape &) = delete;
+  BasicTape &operator=(const BasicTape &) = delete;
+  BasicTape(BasicTape &&) = delete;
+  BasicTape &operator=(BasicTape &&) = delete;
+  ~BasicTape();
+
+  // Makes the tape the recording target of the current thread for the lifetime of the scope.
+  class Scope
+  {
+  private:
+    BasicTape *_previous;
+
+  public:
+    explicit Scope(BasicTape &tape);
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+    Scope(Scope &&) = delete;
+    Scope &operator=(Scope &&) = delete;
+    ~Scope();
+  };
+
+  [[nodiscard]] static BasicTape *active() { return _active; }
+  [[nodiscard]] size_t size() const { return _nodes.size(); }
+  [[nodiscard]] size_t capacity() const { return _buffer.size(); }
+  BasicValuePtr<T> record(T data);
+  // Backpropagates from root by walking the list in reverse, without building a topological order. Accumulates into
+  // leaf gradients like BasicValue::backward.
+  void backward(const BasicValuePtr<T> &root);
+  void clear();
+};
+using Tape = BasicTape<double>;
+
+// While a guard is alive on the current thread, operators compute their results without recording their operands,
+// so no graph is built and results are leaves that only hold their values. Nodes are not placed on the active Tape
+// but taken from a pool that reuses the memory of released ones. Meant for inference, where backward() is never
+// called.
+class NoGradGuard
+{
+private:
+  bool _previous;
+  static thread_local bool _enabled;
+
+public:
+  NoGradGuard();
+  NoGradGuard(const NoGradGuard &) = delete;
+  NoGradGuard &operator=(const NoGradGuard &) = delete;
+  NoGradGuard(NoGradGuard &&) = delete;
+  NoGradGuard &operator=(NoGradGuard &&) = delete;
+  ~NoGradGuard();
+  [[nodiscard]] static bool enabled() { return _enabled; }
+};
+
+// A graph of fixed structure captured once and replayed in place. forward() recomputes every node from its
+// operands after leaves have been changed, e.g. new values written into an input tensor or parameters updated by
+// an optimizer step, and backward() backpropagates from the root over the nodes that require a gradient, in the
+// order sorted at capture, adding to the gradients of the leaves. Neither allocates, so a training loop over a model
+// of fixed shape can build its graph a single time.
+//
+// The plan keeps the graph alive through its root. It must not be captured from nodes on a Tape, which would be
+// released by the next clear().
+template<class T> class BasicPlan
+{
+private:
+  BasicValuePtr<T> _root;
+  // All nodes in topological order, the subset that has operands and is recomputed by forward(), and the subset
+  // that requires a gradient and is visited by backward().
+  std::vector<BasicValue<T> *> _order;
+  std::vector<BasicValue<T> *> _ops;
+  std::vector<BasicValue<T> *> _grads;
+
+public:
+  explicit BasicPlan(BasicValuePtr<T> root);
+  [[nodiscard]] const BasicValuePtr<T> &root() const { return _root; }
+  [[nodiscard]] size_t size() const { return _order.size(); }
+  void forward();
+  void backward();
+};
+using Plan = BasicPlan<double>;
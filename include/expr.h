@@ -0,0 +1,261 @@
+#pragma once
+#include "engine.h"
+#include <array>
+#include <cmath>
+#include <concepts>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+// Expression templates for small fixed formulas. Operators on Var<I> and numbers build an expression type instead
+// of graph nodes, e.g. a * b + exp(c) is Binary<AddOp, Binary<MulOp, Var<0>, Var<1>>, Unary<ExpOp, Var<2>>>, and
+// evaluating it is inlined code without allocation. Gradients come from the same code run in forward mode on
+// Dual<N> numbers, which carry the partial derivatives with respect to all N variables along with the value; for the
+// handful of variables these formulas have that is cheaper than recording a tape.
+//
+//   expr::Var<0> a; expr::Var<1> b; expr::Var<2> c;
+//   auto f = a * b + exp(c);
+//   double y = expr::value(f, std::array{ 1.0, 2.0, 3.0 });
+//   auto [v, d] = expr::derivatives(f, std::array{ 1.0, 2.0, 3.0 });
+//   ValuePtr node = expr::fuse(f, std::array{ x0, x1, x2 }); // one node in a dynamic graph
+namespace expr {
+// A value together with its partial derivatives with respect to N variables.
+template<size_t N> struct Dual
+{
+  double v{};
+  std::array<double, N> d{};
+  Dual() = default;
+  Dual(double v) : v(v) {}
+};
+
+template<size_t N> Dual<N> operator+(const Dual<N> &a, const Dual<N> &b)
+{
+  Dual<N> r(a.v + b.v);
+  for (size_t i = 0; i < N; i++) { r.d[i] = a.d[i] + b.d[i]; }
+  return r;
+}
+
+template<size_t N> Dual<N> operator-(const Dual<N> &a, const Dual<N> &b)
+{
+  Dual<N> r(a.v - b.v);
+  for (size_t i = 0; i < N; i++) { r.d[i] = a.d[i] - b.d[i]; }
+  return r;
+}
+
+template<size_t N> Dual<N> operator*(const Dual<N> &a, const Dual<N> &b)
+{
+  Dual<N> r(a.v * b.v);
+  for (size_t i = 0; i < N; i++) { r.d[i] = a.d[i] * b.v + b.d[i] * a.v; }
+  return r;
+}
+
+template<size_t N> Dual<N> operator/(const Dual<N> &a, const Dual<N> &b)
+{
+  Dual<N> r(a.v / b.v);
+  for (size_t i = 0; i < N; i++) { r.d[i] = (a.d[i] - r.v * b.d[i]) / b.v; }
+  return r;
+}
+
+// Elementary functions as f and its derivative df, the latter given both the argument x and the result y.
+struct ExpOp
+{
+  static double f(double x) { return std::exp(x); }
+  static double df(double /*x*/, double y) { return y; }
+};
+
+struct LogOp
+{
+  static double f(double x) { return std::log(x); }
+  static double df(double x, double /*y*/) { return 1.0 / x; }
+};
+
+struct TanhOp
+{
+  static double f(double x) { return std::tanh(x); }
+  static double df(double /*x*/, double y) { return 1.0 - y * y; }
+};
+
+struct ReluOp
+{
+  static double f(double x) { return x > 0 ? x : 0.0; }
+  static double df(double x, double /*y*/) { return x > 0 ? 1.0 : 0.0; }
+};
+
+struct NegOp
+{
+  static double f(double x) { return -x; }
+  static double df(double /*x*/, double /*y*/) { return -1.0; }
+};
+
+template<class Op> double apply(double x) { return Op::f(x); }
+
+template<class Op, size_t N> Dual<N> apply(const Dual<N> &x)
+{
+  Dual<N> r(Op::f(x.v));
+  const double s = Op::df(x.v, r.v);
+  for (size_t i = 0; i < N; i++) { r.d[i] = s * x.d[i]; }
+  return r;
+}
+
+struct AddOp
+{
+  template<class T> static T apply(const T &a, const T &b) { return a + b; }
+};
+
+struct SubOp
+{
+  template<class T> static T apply(const T &a, const T &b) { return a - b; }
+};
+
+struct MulOp
+{
+  template<class T> static T apply(const T &a, const T &b) { return a * b; }
+};
+
+struct DivOp
+{
+  template<class T> static T apply(const T &a, const T &b) { return a / b; }
+};
+
+struct ExprBase
+{};
+
+template<class E> concept Expression = std::derived_from<E, ExprBase>;
+template<class T> concept Operand = Expression<T> || std::is_arithmetic_v<T>;
+
+// The I-th variable. Every expression node evaluates on an array of variables, of doubles for values or of Dual
+// numbers for derivatives.
+template<size_t I> struct Var : ExprBase
+{
+  template<class T, size_t N> T eval(const std::array<T, N> &x) const { return std::get<I>(x); }
+};
+
+struct Const : ExprBase
+{
+  double c;
+  explicit Const(double c) : c(c) {}
+  template<class T, size_t N> T eval(const std::array<T, N> & /*x*/) const { return T(c); }
+};
+
+template<class Op, Expression A> struct Unary : ExprBase
+{
+  A a;
+  explicit Unary(A a) : a(a) {}
+  template<class T, size_t N> T eval(const std::array<T, N> &x) const { return expr::apply<Op>(a.eval(x)); }
+};
+
+template<class Op, Expression A, Expression B> struct Binary : ExprBase
+{
+  A a;
+  B b;
+  Binary(A a, B b) : a(a), b(b) {}
+  template<class T, size_t N> T eval(const std::array<T, N> &x) const { return Op::apply(a.eval(x), b.eval(x)); }
+};
+
+// a raised to a constant power.
+template<Expression A> struct Pow : ExprBase
+{
+  A a;
+  double p;
+  Pow(A a, double p) : a(a), p(p) {}
+  template<class T, size_t N> T eval(const std::array<T, N> &x) const
+  {
+    T u = a.eval(x);
+    if constexpr (std::is_same_v<T, double>) {
+      return std::pow(u, p);
+    } else {
+      T r(std::pow(u.v, p));
+      const double s = p * std::pow(u.v, p - 1);
+      for (size_t i = 0; i < N; i++) { r.d[i] = s * u.d[i]; }
+      return r;
+    }
+  }
+};
+
+template<Operand T> auto wrap(const T &t)
+{
+  if constexpr (Expression<T>) {
+    return t;
+  } else {
+    return Const(static_cast<double>(t));
+  }
+}
+
+template<class Op, Operand A, Operand B> auto binary(const A &a, const B &b)
+{
+  return Binary<Op, decltype(wrap(a)), decltype(wrap(b))>(wrap(a), wrap(b));
+}
+
+template<Operand A, Operand B>
+  requires(Expression<A> || Expression<B>)
+auto operator+(const A &a, const B &b)
+{
+  return binary<AddOp>(a, b);
+}
+
+template<Operand A, Operand B>
+  requires(Expression<A> || Expression<B>)
+auto operator-(const A &a, const B &b)
+{
+  return binary<SubOp>(a, b);
+}
+
+template<Operand A, Operand B>
+  requires(Expression<A> || Expression<B>)
+auto operator*(const A &a, const B &b)
+{
+  return binary<MulOp>(a, b);
+}
+
+template<Operand A, Operand B>
+  requires(Expression<A> || Expression<B>)
+auto operator/(const A &a, const B &b)
+{
+  return binary<DivOp>(a, b);
+}
+
+template<Expression A> auto operator-(const A &a) { return Unary<NegOp, A>(a); }
+template<Expression A> auto exp(const A &a) { return Unary<ExpOp, A>(a); }
+template<Expression A> auto log(const A &a) { return Unary<LogOp, A>(a); }
+template<Expression A> auto tanh(const A &a) { return Unary<TanhOp, A>(a); }
+template<Expression A> auto relu(const A &a) { return Unary<ReluOp, A>(a); }
+template<Expression A> auto pow(const A &a, double p) { return Pow<A>(a, p); }
+
+// Value of e at x.
+template<Expression E, size_t N> double value(const E &e, const std::array<double, N> &x) { return e.eval(x); }
+
+// Value of e at x along with its partial derivatives with respect to every variable.
+template<Expression E, size_t N> Dual<N> derivatives(const E &e, const std::array<double, N> &x)
+{
+  std::array<Dual<N>, N> seeded;
+  for (size_t i = 0; i < N; i++) {
+    seeded[i].v = x[i];
+    seeded[i].d[i] = 1.0;
+  }
+  return e.eval(seeded);
+}
+
+template<Expression E, size_t N> class FusedExpression final : public FusedFunction
+{
+private:
+  E _e;
+
+public:
+  explicit FusedExpression(E e) : _e(e) {}
+  void evaluate(std::span<const double> x, double &value, std::span<double> partials) const override
+  {
+    std::array<double, N> in;
+    std::ranges::copy(x, in.begin());
+    auto r = derivatives(_e, in);
+    value = r.v;
+    std::ranges::copy(r.d, partials.begin());
+  }
+};
+
+// Inserts e into a dynamic graph as a single node over xs, with Var<I> bound to xs[I].
+template<Expression E, class T, size_t N> BasicValuePtr<T> fuse(const E &e, const std::array<BasicValuePtr<T>, N> &xs)
+{
+  return fused(std::make_shared<const FusedExpression<E, N>>(e), std::vector<BasicValuePtr<T>>(xs.begin(), xs.end()));
+}
+} // namespace expr
@@ -1,87 +1,285 @@
 #pragma once
 #include "engine.h"
+#include "optim.h"
 #include <functional>
+#include <memory>
 #include <iostream>
+#include <optional>
 #include <ostream>
 #include <random>
+#include <span>
+#include <string>
 
-using ActFun = std::function<ValuePtr(const ValuePtr &)>;
-class Neuron
+class Dataset;
+
+template<class T> using BasicActFun = std::function<BasicValuePtr<T>(const BasicValuePtr<T> &)>;
+using ActFun = BasicActFun<double>;
+
+// Neuron, Layer and MLP are templated on the scalar type of their parameters and graphs, float or double; the
+// unprefixed names are the double versions. A float model holds half the bytes and its kernels process twice as many
+// values per instruction, at about 7 significant digits instead of 16.
+template<class T> class BasicNeuron
 {
 private:
+  using ValuePtr = BasicValuePtr<T>;
   std::vector<ValuePtr> _weights{};
   ValuePtr _bias;
-  ActFun act{ [](const ValuePtr &x) { return tanh(x); } };
+  BasicActFun<T> act{ [](const ValuePtr &x) { return tanh(x); } };
+  std::string _label;
   void randomWeightsAndBias();
+  ValuePtr apply(const std::vector<ValuePtr> &xs) const;
 
 public:
-  explicit Neuron(
+  explicit BasicNeuron(
     size_t nin,
-    ActFun act = [](const ValuePtr &x) { return tanh(x); });
-  template<typename T> ValuePtr operator()(const std::vector<T> &x)
+    BasicActFun<T> act = [](const ValuePtr &x) { return tanh(x); });
+  template<typename X> ValuePtr operator()(const std::vector<X> &x)
   {
-    ValuePtr sum = _bias;
-    for (int i = 0; i < x.size(); i++) { sum += x[i] * _weights[i]; }
-    return act(sum);
+    if constexpr (std::is_same_v<X, ValuePtr>) {
+      return apply(x);
+    } else {
+      std::vector<ValuePtr> xs;
+      xs.reserve(x.size());
+      for (const auto &xi : x) {
+        xs.push_back(BasicValue<T>::make(static_cast<T>(xi)));
+        xs.back()->setRequiresGrad(false);
+      }
+      return apply(xs);
+    }
   }
-  friend std::ostream &operator<<(std::ostream &os, const Neuron &n);
+  // Labels the nodes the neuron creates, which the DOT writer then draws as one cluster.
+  void setLabel(std::string label) { _label = std::move(label); }
+  [[nodiscard]] const std::string &label() const { return _label; }
+  template<class U> friend std::ostream &operator<<(std::ostream &os, const BasicNeuron<U> &n);
   [[nodiscard]] std::vector<ValuePtr> parameters() const;
 };
+using Neuron = BasicNeuron<double>;
+
+// Converts a sample to a tensor node of shape {n}: scalars are gathered with stack, numbers are copied into a leaf
+// that requires no gradient.
+template<class T, typename X> BasicValuePtr<T> toTensor(const std::vector<X> &x)
+{
+  if constexpr (std::is_same_v<X, BasicValuePtr<T>>) {
+    return stack(x);
+  } else {
+    BasicValuePtr<T> t;
+    if constexpr (std::is_same_v<X, T>) {
+      t = BasicValue<T>::makeTensor({ x.size() }, x);
+    } else {
+      std::vector<T> d(x.begin(), x.end());
+      t = BasicValue<T>::makeTensor({ x.size() }, d);
+    }
+    t->setRequiresGrad(false);
+    return t;
+  }
+}
 
-class Layer
+// Activations a layer can also apply to plain numbers. A layer built from any other ActFun is CUSTOM, and its
+// predict() evaluates the function on a node under a NoGradGuard.
+enum class Activation { TANH, RELU, LINEAR, CUSTOM };
+template<class T = double> BasicActFun<T> activationFunction(Activation activation);
+
+// A fully connected layer stored as a nout x nin weight tensor and a bias tensor, so a forward pass adds three nodes
+// to the graph (matvec, bias add, activation) whatever the width of the layer.
+template<class T> class BasicLayer
 {
 private:
-  std::vector<Neuron> _neurons{};
+  using ValuePtr = BasicValuePtr<T>;
+  ValuePtr _weights;
+  ValuePtr _bias;
+  BasicActFun<T> act;
+  Activation _activation;
+  std::string _label;
 
 public:
-  explicit Layer(
-    size_t nin,
-    size_t nout,
-    const ActFun &act = [](const ValuePtr &x) { return tanh(x); });
-  template<typename T> std::vector<ValuePtr> operator()(const std::vector<T> &x)
+  explicit BasicLayer(size_t nin, size_t nout, Activation activation = Activation::TANH);
+  BasicLayer(size_t nin, size_t nout, const BasicActFun<T> &act);
+  // A layer over existing tensors: weights of shape {nout, nin} and bias of shape {nout}.
+  BasicLayer(ValuePtr weights, ValuePtr bias, Activation activation);
+  BasicLayer(ValuePtr weights, ValuePtr bias, const BasicActFun<T> &act);
+  ValuePtr operator()(const ValuePtr &x) const;
+  template<typename X> std::vector<ValuePtr> operator()(const std::vector<X> &x) const
   {
-    std::vector<ValuePtr> y(_neurons.size());
-    for (int i = 0; i < _neurons.size(); i++) { y[i] = _neurons[i](x); }
-    return y;
+    return unstack((*this)(toTensor<T>(x)));
   }
-  friend std::ostream &operator<<(std::ostream &os, const Layer &l);
+  // out = act(W x + b) computed on plain numbers for every row of the row-major batch x, without creating any node
+  // unless the activation is CUSTOM.
+  void predict(std::span<const T> x, std::span<T> out) const;
+  // Draws weights and biases uniformly from [-1, 1].
+  void randomize(std::mt19937 &gen);
+  [[nodiscard]] size_t nin() const { return _weights->shape()[1]; }
+  [[nodiscard]] size_t nout() const { return _weights->shape()[0]; }
+  [[nodiscard]] Activation activation() const { return _activation; }
+  // Labels the product, bias and activation nodes the layer creates, which the DOT writer then draws as one cluster.
+  // An MLP labels its layers "layer 0", "layer 1" and so on.
+  void setLabel(std::string label) { _label = std::move(label); }
+  [[nodiscard]] const std::string &label() const { return _label; }
+  template<class U> friend std::ostream &operator<<(std::ostream &os, const BasicLayer<U> &l);
   [[nodiscard]] std::vector<ValuePtr> parameters() const;
+  // A layer sharing this layer's weight values but accumulating gradients into buffers of its own.
+  [[nodiscard]] BasicLayer replica() const;
+  // The same layer over other tensors of the same shapes.
+  [[nodiscard]] BasicLayer withParameters(ValuePtr weights, ValuePtr bias) const;
+  [[nodiscard]] const ValuePtr &weights() const { return _weights; }
+  [[nodiscard]] const ValuePtr &bias() const { return _bias; }
 };
+using Layer = BasicLayer<double>;
 
-class MLP
+// A stack of layers whose parameters are views into one ParameterBuffer, in layer order, weights before bias.
+template<class T> class BasicMLP
 {
 private:
-  std::vector<Layer> _layers{};
+  using ValuePtr = BasicValuePtr<T>;
+  // Consecutive layers evaluated as one checkpoint node, and the parameters they read.
+  struct Segment
+  {
+    std::shared_ptr<const CheckpointFunction<T>> function;
+    std::vector<ValuePtr> parameters;
+  };
+  std::vector<BasicLayer<T>> _layers{};
+  std::shared_ptr<BasicParameterBuffer<T>> _parameters;
+  size_t _layersPerSegment{};
+  std::vector<Segment> _segments;
+  BasicMLP(std::vector<BasicLayer<T>> layers, std::shared_ptr<BasicParameterBuffer<T>> parameters)
+    : _layers(std::move(layers)), _parameters(std::move(parameters))
+  {
+    labelLayers();
+  }
+  void labelLayers();
+  // Lays out the parameters of layers of the given sizes in a new buffer, adds makeLayer(weights, bias) for each and
+  // draws the parameters from gen.
+  template<typename MakeLayer> void build(const std::vector<size_t> &sizes, MakeLayer makeLayer, std::mt19937 &gen);
 
 public:
-  explicit MLP(
-    const std::vector<size_t> &sizes,
-    const ActFun &act = [](const ValuePtr &x) { return tanh(x); });
-  template<typename T> std::vector<ValuePtr> operator()(const std::vector<T> &x)
+  explicit BasicMLP(const std::vector<size_t> &sizes, Activation activation = Activation::TANH);
+  BasicMLP(const std::vector<size_t> &sizes, const BasicActFun<T> &act);
+  // Same as above, but the initial parameters are drawn from gen instead of a generator seeded by std::random_device.
+  BasicMLP(const std::vector<size_t> &sizes, std::mt19937 &gen, Activation activation = Activation::TANH);
+  BasicMLP(const std::vector<size_t> &sizes, const BasicActFun<T> &act, std::mt19937 &gen);
+  void randomize(std::mt19937 &gen);
+  ValuePtr operator()(const ValuePtr &x)
   {
-    std::vector<ValuePtr> y;
-    if constexpr (std::is_same_v<T, ValuePtr>) {
-      y = x;
-    } else {
-      y.resize(x.size());
-      for (int i = 0; i < x.size(); i++) { y[i] = std::make_shared<Value>(x[i]); }
+    ValuePtr y = x;
+    if (!_segments.empty()) {
+      for (const auto &s : _segments) { y = checkpoint(s.function, y, s.parameters); }
+      return y;
     }
     for (auto &l : _layers) { y = l(y); }
     return y;
   }
-  friend std::ostream &operator<<(std::ostream &os, const MLP &m);
+  template<typename X> std::vector<ValuePtr> operator()(const std::vector<X> &x)
+  {
+    return unstack((*this)(toTensor<T>(x)));
+  }
+  // Gradient checkpointing: with layersPerSegment > 0 the graph built by operator() only keeps the activations
+  // between segments of that many layers, and backward runs each segment forward a second time to rebuild its graph.
+  // Segments of about sqrt(depth) layers bring the memory a forward pass keeps alive for backward from O(depth) down
+  // to O(sqrt(depth)), at the cost of one more forward pass. 0 records every layer, which is the default.
+  void setCheckpointing(size_t layersPerSegment);
+  [[nodiscard]] size_t layersPerSegment() const { return _layersPerSegment; }
+  [[nodiscard]] size_t depth() const { return _layers.size(); }
+  // Inference on plain numbers: the same result as operator() but without building a graph.
+  [[nodiscard]] std::vector<T> predict(std::span<const T> x) const;
+  // Inference over a row-major batch: inputs holds rows of nin values and outputs receives rows of nout values.
+  // Rows are evaluated in blocks, each layer as one matrix product per block, and with a pool the blocks are spread
+  // across its threads. Results may differ from predict() in the last bits, as the products sum in another order.
+  void predictBatch(std::span<const T> inputs, std::span<T> outputs, ThreadPool *pool = nullptr) const;
+  template<class U> friend std::ostream &operator<<(std::ostream &os, const BasicMLP<U> &m);
   [[nodiscard]] std::vector<ValuePtr> parameters() const;
+  // The values and gradients of all parameters, e.g. to hand to an optimizer.
+  [[nodiscard]] const std::shared_ptr<BasicParameterBuffer<T>> &parameterBuffer() const { return _parameters; }
+  // Resets the gradients of all parameters. backward() adds to them, so gradients of several graphs can be summed
+  // before an update.
+  void zeroGrad() { _parameters->zeroGrad(); }
+  // A model sharing this model's parameter values but accumulating gradients into buffers of its own, so several
+  // threads can run forward and backward against the same parameters at once.
+  [[nodiscard]] BasicMLP replica() const;
+  // Writes the layer sizes, activations, weights and biases in the binary model format described in model_file.cpp.
+  // Layers with a CUSTOM activation cannot be saved. Returns false on failure.
+  bool save(const std::string &fileName) const;
+  // Maps a file written by save() into memory and builds a model whose parameters are views of the mapping, so
+  // nothing is parsed or copied; pages are read in as the weights are first touched. The mapping is private, so
+  // training the loaded model does not modify the file. Returns nothing if the file is missing or malformed, or was
+  // saved from a model of the other scalar type.
+  static std::optional<BasicMLP> load(const std::string &fileName);
 };
+using MLP = BasicMLP<double>;
 
-template<typename T> ValuePtr loss(const std::vector<T> &target, const std::vector<std::vector<ValuePtr>> &outputs)
+template<class T> std::ostream &operator<<(std::ostream &os, const BasicNeuron<T> &n);
+template<class T> std::ostream &operator<<(std::ostream &os, const BasicLayer<T> &l);
+template<class T> std::ostream &operator<<(std::ostream &os, const BasicMLP<T> &m);
+
+template<typename X, class T = double>
+BasicValuePtr<T> loss(const std::vector<X> &target, const std::vector<std::vector<BasicValuePtr<T>>> &outputs)
 {
-  ValuePtr sum = std::make_shared<Value>(0.0);
+  std::vector<BasicValuePtr<T>> terms;
+  terms.reserve(outputs.size() * target.size());
   for (const auto &y : outputs) {
-    for (int i = 0; i < target.size(); i++) { sum += pow(target[i] - y[i], 2); }
+    for (size_t i = 0; i < target.size(); i++) { terms.push_back(pow(target[i] - y[i], 2)); }
+  }
+  return sum(terms);
+}
+
+// Squared error with a target per sample: targets[s] is the target of outputs[s].
+template<class T>
+BasicValuePtr<T> loss(const std::vector<std::vector<BasicValuePtr<T>>> &targets,
+  const std::vector<std::vector<BasicValuePtr<T>>> &outputs)
+{
+  std::vector<BasicValuePtr<T>> terms;
+  terms.reserve(outputs.size() * (outputs.empty() ? 0 : outputs[0].size()));
+  for (size_t s = 0; s < outputs.size(); s++) {
+    for (size_t i = 0; i < outputs[s].size(); i++) { terms.push_back(pow(targets[s][i] - outputs[s][i], 2)); }
   }
-  return sum;
+  return sum(terms);
 }
 
+struct TrainOptions
+{
+  double lr = 0.01;
+  // How the parameters are updated from the gradient of each batch; see OptimizerOptions.
+  OptimizerType optimizer = OptimizerType::SGD;
+  double momentum = 0;
+  double weightDecay = 0;
+  // Training stops once the loss summed over an epoch drops below tol.
+  double tol = 1e-3;
+  // Number of epochs, i.e. passes over the whole dataset.
+  int niter = 100;
+  // Samples per parameter update; 0 uses the whole dataset as a single batch, or 256 rows when training on a
+  // Dataset. Only one batch's graph is alive at a time, so peak memory depends on the batch size and not on the size
+  // of the dataset.
+  size_t batchSize = 0;
+  // Samples per captured graph when training serially on in-memory samples; the gradients of the micro-batches of a
+  // batch are accumulated before its update, so the graph alive at a time is that of a micro-batch. 0 uses whole
+  // batches. Gives the same updates as the whole batch up to the order in which gradients are summed.
+  size_t microBatchSize = 0;
+  // Seed of the initial weights and of the shuffle that assigns samples to batches each epoch; 0 draws one from
+  // std::random_device.
+  unsigned seed = 0;
+  // Threads each batch is split across; 0 uses all hardware threads. Every thread runs forward and backward over its
+  // share of the batch against the shared parameters, and the per-thread gradients are summed before the update.
+  size_t threads = 1;
+  // Splits batches statically and sums the per-thread gradients in thread order, so that a given seed and thread
+  // count give bitwise identical results. Otherwise threads take samples as they go and gradients are summed in
+  // completion order.
+  bool deterministic = false;
+  // Trains with gradient checkpointing in segments of about sqrt(depth) layers; see BasicMLP::setCheckpointing.
+  bool checkpoint = false;
+  bool verbose = true;
+};
+
+// Trains a model with parameters of type T; inputs and targets are converted to T as they are copied into the graph.
+template<class T = double>
+BasicMLP<T> gradientDescent(const std::vector<size_t> &hiddenLayerSizes,
+  const std::vector<std::vector<double>> &inputs,
+  const std::vector<double> &target,
+  const TrainOptions &options);
+
+// Training on rows streamed from data, each with a target of its own. Batches are taken in the order of the data and
+// the next one is read on a background thread while the current one trains. Training is serial: options.threads and
+// options.deterministic do not apply.
+template<class T = double>
+BasicMLP<T> gradientDescent(const std::vector<size_t> &hiddenLayerSizes, Dataset &data, const TrainOptions &options);
+
 MLP gradientDescent(const std::vector<size_t> &hiddenLayerSizes,
   const std::vector<std::vector<double>> &inputs,
   const std::vector<double> &target,
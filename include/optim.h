@@ -0,0 +1,122 @@
+#pragma once
+#include "engine.h"
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <vector>
+
+// Values and gradients of all parameters of a model in two flat arrays of the same layout. Every tensor starts at a
+// multiple of 64 bytes and the gaps between tensors stay zero in both arrays, so an optimizer can sweep each array in
+// a single pass instead of visiting the tensors one by one. Layers hold views into the buffer, which keep it alive.
+template<class T> class BasicParameterBuffer : public std::enable_shared_from_this<BasicParameterBuffer<T>>
+{
+private:
+  struct Free
+  {
+    void operator()(T *p) const;
+  };
+  std::unique_ptr<T[], Free> _storage;
+  std::span<T> _values;
+  std::span<T> _grads;
+  std::shared_ptr<const void> _owner;
+
+public:
+  // Elements per 64 bytes; tensors are placed at multiples of it.
+  static constexpr size_t kAlignment = 64 / sizeof(T);
+  // Where the next tensor goes in a buffer whose tensors so far end at end.
+  static size_t align(size_t end) { return (end + kAlignment - 1) / kAlignment * kAlignment; }
+
+  // size zeroed values and gradients.
+  explicit BasicParameterBuffer(size_t size);
+  // Values stored elsewhere, e.g. in a mapped model file, kept alive through owner. grads is used for the gradients
+  // if given; otherwise zeroed gradients are allocated, e.g. for a replica sharing another buffer's values.
+  BasicParameterBuffer(std::span<T> values, std::shared_ptr<const void> owner, std::span<T> grads = {});
+  BasicParameterBuffer(const BasicParameterBuffer &) = delete;
+  BasicParameterBuffer &operator=(const BasicParameterBuffer &) = delete;
+  BasicParameterBuffer(BasicParameterBuffer &&) = delete;
+  BasicParameterBuffer &operator=(BasicParameterBuffer &&) = delete;
+  ~BasicParameterBuffer() = default;
+
+  [[nodiscard]] size_t size() const { return _values.size(); }
+  [[nodiscard]] std::span<T> values() const { return _values; }
+  [[nodiscard]] std::span<T> grads() const { return _grads; }
+  void zeroGrad() const;
+  // A leaf tensor over the elements from offset on. Must be called on a buffer owned by a shared_ptr.
+  [[nodiscard]] BasicValuePtr<T> view(size_t offset, std::span<const size_t> shape);
+};
+using ParameterBuffer = BasicParameterBuffer<double>;
+
+enum class OptimizerType { SGD, ADAM, ADAMW };
+
+struct OptimizerOptions
+{
+  OptimizerType type = OptimizerType::SGD;
+  double lr = 0.01;
+  // Velocity decay of SGD; 0 is plain gradient descent.
+  double momentum = 0;
+  // Moment decays and denominator guard of Adam and AdamW.
+  double beta1 = 0.9;
+  double beta2 = 0.999;
+  double eps = 1e-8;
+  // SGD and Adam add weightDecay * x to the gradient (L2 regularization); AdamW shrinks x by lr * weightDecay
+  // before every step instead, which does not scale the decay by the adaptive step size.
+  double weightDecay = 0;
+};
+
+// Updates the parameter values of a buffer from its gradients. Per-parameter state is kept in arrays of the buffer's
+// layout, and a step is one vectorized pass over all arrays, so it costs memory bandwidth rather than a walk over the
+// parameter tensors.
+template<class T> class BasicOptimizer
+{
+protected:
+  std::shared_ptr<BasicParameterBuffer<T>> _parameters;
+  OptimizerOptions _options;
+
+public:
+  BasicOptimizer(std::shared_ptr<BasicParameterBuffer<T>> parameters, const OptimizerOptions &options)
+    : _parameters(std::move(parameters)), _options(options)
+  {}
+  BasicOptimizer(const BasicOptimizer &) = delete;
+  BasicOptimizer &operator=(const BasicOptimizer &) = delete;
+  BasicOptimizer(BasicOptimizer &&) = delete;
+  BasicOptimizer &operator=(BasicOptimizer &&) = delete;
+  virtual ~BasicOptimizer() = default;
+  [[nodiscard]] const OptimizerOptions &options() const { return _options; }
+  // Changes the learning rate of the following steps, e.g. for a schedule.
+  void setLr(double lr) { _options.lr = lr; }
+  // Resets the gradients of the parameters, which backward only adds to, before the passes of the next step.
+  void zeroGrad() { _parameters->zeroGrad(); }
+  virtual void step() = 0;
+};
+using Optimizer = BasicOptimizer<double>;
+
+template<class T> class BasicSgd final : public BasicOptimizer<T>
+{
+private:
+  // Empty without momentum.
+  std::vector<T> _velocity;
+
+public:
+  BasicSgd(std::shared_ptr<BasicParameterBuffer<T>> parameters, const OptimizerOptions &options);
+  void step() override;
+};
+using Sgd = BasicSgd<double>;
+
+// Adam, or AdamW for OptimizerType::ADAMW.
+template<class T> class BasicAdam final : public BasicOptimizer<T>
+{
+private:
+  std::vector<T> _m;
+  std::vector<T> _v;
+  size_t _t{};
+
+public:
+  BasicAdam(std::shared_ptr<BasicParameterBuffer<T>> parameters, const OptimizerOptions &options);
+  void step() override;
+};
+using Adam = BasicAdam<double>;
+
+// The optimizer selected by options.type.
+template<class T>
+std::unique_ptr<BasicOptimizer<T>> makeOptimizer(std::shared_ptr<BasicParameterBuffer<T>> parameters,
+  const OptimizerOptions &options);
@@ -0,0 +1,127 @@
+#pragma once
+#include "engine.h"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Instrumentation of the engine and of training, built when configured with -DMICROGRAD_PROFILE=ON. The engine
+// counts the nodes created per op type and the bytes allocated for nodes and tensor buffers, and times every
+// topological sort and every backward step by op type; gradientDescent records a span per iteration and per batch.
+// Spans go to an in-memory trace that writeChromeTrace exports for chrome://tracing or Perfetto.
+//
+// Without the option the MICROGRAD_PROFILE_* macros expand to nothing, so the hot paths carry no instrumentation;
+// the functions below still exist, but the counters stay zero and the trace empty.
+namespace profiler {
+struct OpCounters
+{
+  std::uint64_t created{};
+  std::uint64_t backwardSteps{};
+  std::uint64_t backwardNs{};
+};
+
+struct Counters
+{
+  std::array<OpCounters, OPTYPE_COUNT> ops{};
+  std::uint64_t bytesAllocated{};
+  std::uint64_t topoSorts{};
+  std::uint64_t topoNs{};
+};
+
+constexpr bool enabled()
+{
+#ifdef MICROGRAD_PROFILE
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Snapshot of the counters summed over all threads.
+Counters counters();
+// Zeroes the counters and drops the recorded trace.
+void reset();
+// Table of the non-zero counters.
+void print(std::ostream &os);
+// Writes the recorded spans in the Chrome trace-event format. Returns false if the file cannot be written.
+bool writeChromeTrace(const std::string &fileName);
+
+void countNode(OpType op);
+void countBytes(std::uint64_t bytes);
+void addTopo(std::uint64_t ns);
+void addBackward(OpType op, std::uint64_t ns);
+// name must outlive the trace, e.g. be a string literal.
+void addSpan(const char *name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+// Records a span named name from construction to destruction.
+class Scope
+{
+private:
+  const char *_name;
+  std::chrono::steady_clock::time_point _start;
+
+public:
+  explicit Scope(const char *name) : _name(name), _start(std::chrono::steady_clock::now()) {}
+  Scope(const Scope &) = delete;
+  Scope &operator=(const Scope &) = delete;
+  ~Scope() { addSpan(_name, _start, std::chrono::steady_clock::now()); }
+};
+
+// Adds the time from construction to destruction to the backward time of op. Steps run from within another step,
+// i.e. those of the segment a checkpoint replays, are part of its time and are not recorded on their own.
+class BackwardTimer
+{
+private:
+  static inline thread_local unsigned _depth{};
+  OpType _op;
+  bool _outermost;
+  std::chrono::steady_clock::time_point _start;
+
+public:
+  explicit BackwardTimer(OpType op) : _op(op), _outermost(_depth++ == 0), _start(std::chrono::steady_clock::now()) {}
+  BackwardTimer(const BackwardTimer &) = delete;
+  BackwardTimer &operator=(const BackwardTimer &) = delete;
+  ~BackwardTimer()
+  {
+    _depth--;
+    if (_outermost) {
+      addBackward(_op, std::chrono::nanoseconds(std::chrono::steady_clock::now() - _start).count());
+    }
+  }
+};
+
+// Adds the time from construction to destruction to the topological sort time, and records it as a span.
+class TopoTimer
+{
+private:
+  std::chrono::steady_clock::time_point _start;
+
+public:
+  TopoTimer() : _start(std::chrono::steady_clock::now()) {}
+  TopoTimer(const TopoTimer &) = delete;
+  TopoTimer &operator=(const TopoTimer &) = delete;
+  ~TopoTimer()
+  {
+    auto end = std::chrono::steady_clock::now();
+    addTopo(std::chrono::nanoseconds(end - _start).count());
+    addSpan("topo", _start, end);
+  }
+};
+} // namespace profiler
+
+#ifdef MICROGRAD_PROFILE
+#define MICROGRAD_PROFILE_CONCAT_(a, b) a##b
+#define MICROGRAD_PROFILE_CONCAT(a, b) MICROGRAD_PROFILE_CONCAT_(a, b)
+#define MICROGRAD_PROFILE_SCOPE(name) ::profiler::Scope MICROGRAD_PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define MICROGRAD_PROFILE_NODE(op) ::profiler::countNode(op)
+#define MICROGRAD_PROFILE_BYTES(bytes) ::profiler::countBytes(bytes)
+#define MICROGRAD_PROFILE_TOPO() ::profiler::TopoTimer MICROGRAD_PROFILE_CONCAT(profileTopo, __LINE__)
+#define MICROGRAD_PROFILE_BACKWARD(op) ::profiler::BackwardTimer MICROGRAD_PROFILE_CONCAT(profileStep, __LINE__)(op)
+#else
+#define MICROGRAD_PROFILE_SCOPE(name) static_cast<void>(0)
+#define MICROGRAD_PROFILE_NODE(op) static_cast<void>(0)
+#define MICROGRAD_PROFILE_BYTES(bytes) static_cast<void>(0)
+#define MICROGRAD_PROFILE_TOPO() static_cast<void>(0)
+#define MICROGRAD_PROFILE_BACKWARD(op) static_cast<void>(0)
+#endif
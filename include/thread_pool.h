@@ -0,0 +1,45 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run index ranges in parallel. The calling thread takes part in the work, so a
+// pool of size n uses n - 1 background threads.
+class ThreadPool
+{
+private:
+  std::vector<std::thread> _workers;
+  // Held by an outside caller of parallelFor for the whole job, since the pool runs one job at a time.
+  std::mutex _callers;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::condition_variable _done;
+  const std::function<void(size_t)> *_job{};
+  size_t _jobSize{};
+  size_t _next{};
+  size_t _running{};
+  std::uint64_t _generation{};
+  std::exception_ptr _error;
+  bool _stop{};
+
+  void workerLoop();
+  void runJob();
+
+public:
+  explicit ThreadPool(size_t threads = std::thread::hardware_concurrency());
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+  ThreadPool(ThreadPool &&) = delete;
+  ThreadPool &operator=(ThreadPool &&) = delete;
+  ~ThreadPool();
+
+  [[nodiscard]] size_t size() const { return _workers.size() + 1; }
+  // Calls f(i) for every i in [0, n) and returns once all calls have finished. A call made from inside a job of the
+  // same pool runs serially on the calling thread instead of deadlocking; calls from different outside threads take
+  // turns. If f throws, indices not yet started are skipped and the first exception is rethrown here.
+  void parallelFor(size_t n, const std::function<void(size_t)> &f);
+};
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MICROGRAD_MMAP
+#endif
+
+// Common ground of the binary model and dataset files: fields are stored in the byte order of the writer, which
+// readers check through kByteOrder, and arrays start at multiples of kAlignment bytes.
+namespace binary_file {
+constexpr std::uint32_t kByteOrder = 0x01020304;
+constexpr std::uint32_t kFloat64 = 1;
+constexpr std::uint32_t kFloat32 = 2;
+constexpr std::uint64_t kAlignment = 64;
+
+// Element type code of arrays of T.
+template<class T> constexpr std::uint32_t kDtype = sizeof(T) == 4 ? kFloat32 : kFloat64;
+
+inline std::uint64_t alignUp(std::uint64_t n) { return (n + kAlignment - 1) / kAlignment * kAlignment; }
+
+// A whole file mapped privately into memory, or read into a buffer where mmap is not available. The bytes are
+// writable, but writes stay in memory and never reach the file.
+class MappedFile
+{
+private:
+  std::byte *_data{};
+  size_t _size{};
+#ifndef MICROGRAD_MMAP
+  std::vector<std::byte> _copy;
+#endif
+
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile()
+  {
+#ifdef MICROGRAD_MMAP
+    if (_data != nullptr) { munmap(_data, _size); }
+#endif
+  }
+
+  bool open(const std::string &fileName)
+  {
+#ifdef MICROGRAD_MMAP
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) { return false; }
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      close(fd);
+      return false;
+    }
+    _size = static_cast<size_t>(st.st_size);
+    void *p = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) { return false; }
+    _data = static_cast<std::byte *>(p);
+#else
+    std::ifstream in(fileName, std::ios::binary | std::ios::ate);
+    if (!in) { return false; }
+    _copy.resize(static_cast<size_t>(in.tellg()));
+    in.seekg(0);
+    if (!in.read(reinterpret_cast<char *>(_copy.data()), static_cast<std::streamsize>(_copy.size()))) { return false; }
+    _data = _copy.data();
+    _size = _copy.size();
+#endif
+    return true;
+  }
+
+  // Hints that the file will be read front to back, so the kernel reads ahead and drops pages behind.
+  void adviseSequential()
+  {
+#ifdef MICROGRAD_MMAP
+    if (_data != nullptr) { madvise(_data, _size, MADV_SEQUENTIAL); }
+#endif
+  }
+
+  [[nodiscard]] std::byte *data() const { return _data; }
+  [[nodiscard]] size_t size() const { return _size; }
+};
+} // namespace binary_file
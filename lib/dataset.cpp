@@ -0,0 +1,288 @@
+#include "dataset.h"
+#include "binary_file.h"
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <span>
+#include <string_view>
+
+using namespace binary_file;
+
+// Binary dataset format, version 1: a DatasetHeader, then rows of nin input and nout target doubles from offset 64.
+namespace {
+constexpr std::array<char, 8> kMagic{ 'm', 'g', 'r', 'a', 'd', 'd', 'a', 't' };
+constexpr std::uint32_t kVersion = 1;
+
+struct DatasetHeader
+{
+  std::array<char, 8> magic;
+  std::uint32_t version;
+  std::uint32_t byteOrder;
+  std::uint32_t dtype;
+  std::uint32_t nin;
+  std::uint32_t nout;
+  std::uint32_t reserved0;
+  std::uint64_t rows;
+  std::array<std::uint64_t, 3> reserved;
+};
+static_assert(sizeof(DatasetHeader) == 64);
+
+bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+// Parses exactly out.size() comma separated numbers from line.
+bool parseRow(std::string_view line, std::span<double> out)
+{
+  const char *p = line.data();
+  const char *end = line.data() + line.size();
+  for (size_t i = 0; i < out.size(); i++) {
+    while (p < end && isSpace(*p)) { p++; }
+    auto [next, ec] = std::from_chars(p, end, out[i]);
+    if (ec != std::errc()) { return false; }
+    p = next;
+    while (p < end && isSpace(*p)) { p++; }
+    if (i + 1 < out.size()) {
+      if (p == end || *p != ',') { return false; }
+      p++;
+    }
+  }
+  return p == end;
+}
+
+bool isBlank(std::string_view line) { return std::ranges::all_of(line, isSpace); }
+
+class CsvDataset final : public Dataset
+{
+private:
+  std::string _fileName;
+  std::ifstream _in;
+  std::streampos _start;
+  size_t _startLine{};
+  size_t _line{};
+  size_t _nin;
+  size_t _nout;
+  std::string _text;
+  std::vector<double> _row;
+  bool _failed{};
+
+public:
+  CsvDataset(std::string fileName, std::ifstream in, std::streampos start, size_t startLine, size_t nin, size_t nout)
+    : _fileName(std::move(fileName)), _in(std::move(in)), _start(start), _startLine(startLine), _line(startLine),
+      _nin(nin), _nout(nout), _row(nin + nout)
+  {}
+  [[nodiscard]] size_t nin() const override { return _nin; }
+  [[nodiscard]] size_t nout() const override { return _nout; }
+
+  void rewind() override
+  {
+    _in.clear();
+    _in.seekg(_start);
+    _line = _startLine;
+    _failed = false;
+  }
+
+  size_t read(Batch &batch, size_t rows) override
+  {
+    batch.inputs.resize(rows * _nin);
+    batch.targets.resize(rows * _nout);
+    size_t n = 0;
+    while (n < rows && !_failed && std::getline(_in, _text)) {
+      _line++;
+      if (isBlank(_text)) { continue; }
+      if (!parseRow(_text, _row)) {
+        std::cerr << "Error: " << _fileName << ":" << _line << ": expected " << _row.size() << " numbers" << std::endl;
+        _failed = true;
+        break;
+      }
+      std::copy_n(_row.begin(), _nin, batch.inputs.begin() + n * _nin);
+      std::copy_n(_row.begin() + _nin, _nout, batch.targets.begin() + n * _nout);
+      n++;
+    }
+    batch.rows = n;
+    batch.inputs.resize(n * _nin);
+    batch.targets.resize(n * _nout);
+    return n;
+  }
+};
+
+class BinaryDataset final : public Dataset
+{
+private:
+  MappedFile _file;
+  size_t _nin{};
+  size_t _nout{};
+  size_t _rows{};
+  size_t _next{};
+
+public:
+  bool open(const std::string &fileName)
+  {
+    DatasetHeader header{};
+    if (!_file.open(fileName) || _file.size() < sizeof(header)) { return false; }
+    std::memcpy(&header, _file.data(), sizeof(header));
+    if (header.magic != kMagic || header.byteOrder != kByteOrder || header.version != kVersion ||
+        header.dtype != kFloat64 || header.nin == 0) {
+      return false;
+    }
+    _nin = header.nin;
+    _nout = header.nout;
+    _rows = header.rows;
+    if (_rows > (_file.size() - sizeof(header)) / sizeof(double) / (_nin + _nout)) { return false; }
+    _file.adviseSequential();
+    return true;
+  }
+  [[nodiscard]] size_t nin() const override { return _nin; }
+  [[nodiscard]] size_t nout() const override { return _nout; }
+  void rewind() override { _next = 0; }
+
+  size_t read(Batch &batch, size_t rows) override
+  {
+    const size_t n = std::min(rows, _rows - _next);
+    const size_t width = _nin + _nout;
+    const auto *src = reinterpret_cast<const double *>(_file.data() + sizeof(DatasetHeader)) + _next * width;
+    batch.rows = n;
+    batch.inputs.resize(n * _nin);
+    batch.targets.resize(n * _nout);
+    for (size_t r = 0; r < n; r++) {
+      std::copy_n(src + r * width, _nin, batch.inputs.begin() + r * _nin);
+      std::copy_n(src + r * width + _nin, _nout, batch.targets.begin() + r * _nout);
+    }
+    _next += n;
+    return n;
+  }
+};
+} // namespace
+
+std::unique_ptr<Dataset> openCsvDataset(const std::string &fileName, size_t nout)
+{
+  std::ifstream in(fileName);
+  if (!in.is_open()) {
+    std::cerr << "Error: Unable to open file!" << std::endl;
+    return nullptr;
+  }
+  // The first non-blank line gives the number of columns; if it is not numeric it is a header and data starts after
+  // it.
+  std::string first;
+  size_t line = 0;
+  std::streampos start = in.tellg();
+  while (std::getline(in, first)) {
+    line++;
+    if (!isBlank(first)) { break; }
+    start = in.tellg();
+  }
+  const size_t columns = std::ranges::count(first, ',') + 1;
+  if (isBlank(first) || columns <= nout) {
+    std::cerr << "Error: " << fileName << ": expected more than " << nout << " columns" << std::endl;
+    return nullptr;
+  }
+  std::vector<double> row(columns);
+  size_t startLine = line - 1;
+  if (!parseRow(first, row)) {
+    start = in.tellg();
+    startLine = line;
+  }
+  // The rows are checked once up front, in constant memory, so a malformed one fails here instead of silently ending
+  // a pass over the data early.
+  std::string text;
+  while (std::getline(in, text)) {
+    line++;
+    if (!isBlank(text) && !parseRow(text, row)) {
+      std::cerr << "Error: " << fileName << ":" << line << ": expected " << columns << " numbers" << std::endl;
+      return nullptr;
+    }
+  }
+  auto data = std::make_unique<CsvDataset>(fileName, std::move(in), start, startLine, columns - nout, nout);
+  data->rewind();
+  return data;
+}
+
+std::unique_ptr<Dataset> openBinaryDataset(const std::string &fileName)
+{
+  auto data = std::make_unique<BinaryDataset>();
+  if (!data->open(fileName)) {
+    std::cerr << "Error: " << fileName << ": not a dataset file" << std::endl;
+    return nullptr;
+  }
+  return data;
+}
+
+bool writeBinaryDataset(const std::string &fileName, Dataset &data)
+{
+  std::ofstream out(fileName, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    std::cerr << "Error: Unable to open file!" << std::endl;
+    return false;
+  }
+  DatasetHeader header{};
+  header.magic = kMagic;
+  header.version = kVersion;
+  header.byteOrder = kByteOrder;
+  header.dtype = kFloat64;
+  header.nin = static_cast<std::uint32_t>(data.nin());
+  header.nout = static_cast<std::uint32_t>(data.nout());
+  // The row count is only known at the end, so the header is written twice.
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  Batch batch;
+  data.rewind();
+  while (data.read(batch, 4096) > 0) {
+    for (size_t r = 0; r < batch.rows; r++) {
+      out.write(reinterpret_cast<const char *>(batch.inputs.data() + r * data.nin()),
+        static_cast<std::streamsize>(data.nin() * sizeof(double)));
+      out.write(reinterpret_cast<const char *>(batch.targets.data() + r * data.nout()),
+        static_cast<std::streamsize>(data.nout() * sizeof(double)));
+    }
+    header.rows += batch.rows;
+  }
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  return static_cast<bool>(out);
+}
+
+Prefetcher::Prefetcher(Dataset &data, size_t batchSize) : _data(data), _batchSize(batchSize)
+{
+  _data.rewind();
+  _thread = std::thread([this] { run(); });
+}
+
+Prefetcher::~Prefetcher()
+{
+  {
+    std::lock_guard lock(_mutex);
+    _stop = true;
+  }
+  _changed.notify_all();
+  _thread.join();
+}
+
+void Prefetcher::run()
+{
+  Batch work;
+  while (true) {
+    const size_t rows = _data.read(work, _batchSize);
+    std::unique_lock lock(_mutex);
+    _changed.wait(lock, [this] { return !_full || _stop; });
+    if (_stop) { return; }
+    if (rows == 0) {
+      _end = true;
+      _changed.notify_all();
+      return;
+    }
+    std::swap(_ready, work);
+    _full = true;
+    _changed.notify_all();
+  }
+}
+
+bool Prefetcher::next(Batch &batch)
+{
+  std::unique_lock lock(_mutex);
+  _changed.wait(lock, [this] { return _full || _end; });
+  if (!_full) { return false; }
+  std::swap(batch, _ready);
+  _full = false;
+  _changed.notify_all();
+  return true;
+}
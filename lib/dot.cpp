@@ -0,0 +1,131 @@
+#include "dot.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <iterator>
+#include <string_view>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+// The buffer is written out once it holds this much text.
+constexpr size_t kBufferSize = size_t{ 1 } << 20;
+
+std::uintptr_t id(const void *v) { return reinterpret_cast<std::uintptr_t>(v); }
+} // namespace
+
+DotWriter::DotWriter(int fd, DotOptions options) : _fd(fd), _options(options) { _buffer.reserve(kBufferSize); }
+
+template<class... Args> void DotWriter::print(std::format_string<Args...> fmt, Args &&...args)
+{
+  std::format_to(std::back_inserter(_buffer), fmt, std::forward<Args>(args)...);
+  if (_buffer.size() >= kBufferSize) { flush(); }
+}
+
+void DotWriter::flush()
+{
+  const char *p = _buffer.data();
+  size_t left = _buffer.size();
+  while (_ok && left > 0) {
+    const auto n = ::write(_fd, p, static_cast<unsigned>(std::min<size_t>(left, kBufferSize)));
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n <= 0) {
+      _ok = false;
+      break;
+    }
+    p += n;
+    left -= static_cast<size_t>(n);
+  }
+  _buffer.clear();
+}
+
+template<class T> bool DotWriter::write(BasicValue<T> &root)
+{
+  // Breadth-first from the root, so that every node is written once, at its shortest distance from the root, which
+  // is what the depth limit applies to. Edges may name nodes that are only defined further down.
+  const std::uint64_t stamp = ++BasicValue<T>::_epoch;
+  std::vector<std::pair<BasicValue<T> *, size_t>> queue{ { &root, 0 } };
+  root._visit = stamp;
+  std::vector<const BasicValue<T> *> labeled;
+  // Labels go into record fields and quoted strings, where these characters have a meaning.
+  auto printLabel = [&](std::string_view label) {
+    for (char c : label) {
+      if (std::string_view("\"\\{}|<>").find(c) != std::string_view::npos) { _buffer += '\\'; }
+      _buffer += c;
+    }
+  };
+
+  print("digraph G {{\n");
+  for (size_t next = 0; next < queue.size(); next++) {
+    auto [v, depth] = queue[next];
+    const size_t operands = v->_prev.size();
+    const bool cut = operands > 0 && _options.maxDepth != 0 && depth == _options.maxDepth;
+    if (v->isTensor()) {
+      print("n{:x} [label=\"{{tensor: ", id(v));
+      for (size_t i = 0; i < v->shape().size(); i++) { print("{}{}", i == 0 ? "" : " x ", v->shape()[i]); }
+    } else {
+      print("n{:x} [label=\"{{val: {:.4f}|grad: {:.4f}", id(v), v->data(), v->grad());
+    }
+    if (!v->label().empty()) {
+      _buffer += '|';
+      printLabel(v->label());
+      if (_options.clusterLabels) { labeled.push_back(v); }
+    }
+    print("}}\" shape=\"record\"{}];\n", cut ? " style=\"dashed\"" : "");
+    if (operands == 0 || cut) { continue; }
+
+    // A constant folded into the op is shown on the op instead of as an operand of its own.
+    print("o{:x} [label=\"{}", id(v), opToString(v->op));
+    if (isScalarOp(v->op)) { print("\\nc: {:.4f}", v->_aux); }
+    print("\"];\no{:x} -> n{:x};\n", id(v), id(v));
+    const size_t shown = _options.maxOperands == 0 ? operands : std::min(operands, _options.maxOperands);
+    for (size_t i = 0; i < shown; i++) {
+      BasicValue<T> *p = v->_prev[i].get();
+      print("n{:x} -> o{:x};\n", id(p), id(v));
+      if (p->_visit != stamp) {
+        p->_visit = stamp;
+        queue.emplace_back(p, depth + 1);
+      }
+    }
+    if (shown < operands) {
+      print("m{:x} [label=\"{} more\" shape=\"plaintext\"];\nm{:x} -> o{:x};\n", id(v), operands - shown, id(v), id(v));
+    }
+  }
+
+  std::ranges::stable_sort(labeled, {}, [](const BasicValue<T> *v) -> const std::string & { return v->label(); });
+  size_t clusters = 0;
+  for (auto first = labeled.begin(); first != labeled.end();) {
+    auto last =
+      std::find_if(first, labeled.end(), [&](const BasicValue<T> *v) { return v->label() != (*first)->label(); });
+    if (last - first > 1) {
+      print("subgraph cluster_{} {{\nlabel=\"", clusters++);
+      printLabel((*first)->label());
+      print("\";\n");
+      for (auto it = first; it != last; ++it) { print("n{:x};\n", id(*it)); }
+      print("}}\n");
+    }
+    first = last;
+  }
+  print("}}\n");
+  flush();
+  return _ok;
+}
+
+template<class T> bool writeDot(const std::string &fileName, BasicValue<T> &root, const DotOptions &options)
+{
+  const int fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) { return false; }
+  bool ok = DotWriter(fd, options).write(root);
+  return ::close(fd) == 0 && ok;
+}
+
+template bool DotWriter::write(BasicValue<float> &root);
+template bool DotWriter::write(BasicValue<double> &root);
+template bool writeDot(const std::string &fileName, BasicValue<float> &root, const DotOptions &options);
+template bool writeDot(const std::string &fileName, BasicValue<double> &root, const DotOptions &options);
@@ -1,4 +1,131 @@
 #include "engine.h"
+#include "dot.h"
+#include "kernels.h"
+#include "profiler.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <functional>
+#include <memory_resource>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+// Spin locks guarding gradient accumulation during a parallel backward pass, picked by the address of the node
+// written to. Critical sections are a single update or kernel call, so spinning beats parking the thread.
+std::array<std::atomic_flag, 256> gradLocks;
+
+class GradLock
+{
+private:
+  std::atomic_flag *_flag{};
+
+public:
+  GradLock(const void *v, bool enabled)
+  {
+    if (!enabled) { return; }
+    auto hash = reinterpret_cast<std::uintptr_t>(v) * 0x9E3779B97F4A7C15ULL;
+    _flag = &gradLocks[hash >> 56];
+    while (_flag->test_and_set(std::memory_order_acquire)) {
+      while (_flag->test(std::memory_order_relaxed)) { std::this_thread::yield(); }
+    }
+  }
+  GradLock(const GradLock &) = delete;
+  GradLock &operator=(const GradLock &) = delete;
+  GradLock(GradLock &&) = delete;
+  GradLock &operator=(GradLock &&) = delete;
+  ~GradLock()
+  {
+    if (_flag != nullptr) { _flag->clear(std::memory_order_release); }
+  }
+};
+
+// Nodes of one level are handed to the pool in chunks of at least this many; narrower levels run serially.
+constexpr size_t kParallelGrain = 64;
+
+// Backs the nodes made under a NoGradGuard, and their tensors. Freed blocks are kept on free lists of the releasing
+// thread, by power-of-two size class from 64 bytes to 8 KiB, and handed out again without locking. Blocks are plain
+// operator new memory, so it does not matter which thread made them, and a thread deletes what it kept when it exits.
+class NoGradResource : public std::pmr::memory_resource
+{
+private:
+  static constexpr size_t kClasses = 8;
+  static constexpr size_t kMaxCached = 32;
+
+  struct Block
+  {
+    Block *next;
+  };
+
+  struct Cache
+  {
+    std::array<Block *, kClasses> free{};
+    std::array<size_t, kClasses> count{};
+    ~Cache();
+  };
+
+  // Blocks released during static destruction, after the cache of the thread is gone, go straight to the heap.
+  static thread_local bool exited;
+  static thread_local Cache cache;
+
+  static size_t sizeClass(size_t bytes) { return std::bit_width(std::max<size_t>(bytes, 64) - 1) - 6; }
+  static size_t classBytes(size_t c) { return size_t{ 64 } << c; }
+
+  void *do_allocate(size_t bytes, size_t alignment) override
+  {
+    const size_t c = sizeClass(bytes);
+    if (c >= kClasses || alignment > alignof(std::max_align_t)) {
+      return ::operator new(bytes, std::align_val_t(alignment));
+    }
+    if (exited || cache.free[c] == nullptr) { return ::operator new(classBytes(c)); }
+    Block *b = cache.free[c];
+    cache.free[c] = b->next;
+    cache.count[c]--;
+    return b;
+  }
+
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override
+  {
+    const size_t c = sizeClass(bytes);
+    if (c >= kClasses || alignment > alignof(std::max_align_t)) {
+      ::operator delete(p, bytes, std::align_val_t(alignment));
+      return;
+    }
+    if (exited || cache.count[c] == kMaxCached) {
+      ::operator delete(p, classBytes(c));
+      return;
+    }
+    cache.free[c] = ::new (p) Block{ cache.free[c] };
+    cache.count[c]++;
+  }
+
+  [[nodiscard]] bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+};
+
+thread_local bool NoGradResource::exited = false;
+thread_local NoGradResource::Cache NoGradResource::cache;
+
+NoGradResource::Cache::~Cache()
+{
+  exited = true;
+  for (size_t c = 0; c < kClasses; c++) {
+    while (free[c] != nullptr) { ::operator delete(std::exchange(free[c], free[c]->next), classBytes(c)); }
+  }
+}
+
+std::pmr::memory_resource *noGradResource()
+{
+  static NoGradResource resource;
+  return &resource;
+}
+} // namespace
 
 
 std::pair<std::string, std::string> opDot(OpType *op)
@@ -7,15 +134,6 @@ std::pair<std::string, std::string> opDot(OpType *op)
   return { opName, std::format("{} [label=\"{}\"]", opName, opToString(*op)) };
 }
 
-std::pair<std::string, std::string> valueDot(Value *v)
-{
-  std::string valueName = "VAL" + std::to_string(reinterpret_cast<std::uintptr_t>(v));
-  std::string nameField;
-  if (!v->label().empty()) { nameField = std::format("|{}", v->label()); }
-  return { valueName,
-    std::format(
-      R"({} [label="{{val: {:.4f}|grad: {:.4f}{}}}" shape="record"]; )", valueName, v->data(), v->grad(), nameField) };
-}
 std::string opToString(OpType op)
 {
   switch (op) {
@@ -33,69 +151,965 @@ std::string opToString(OpType op)
     return "sub";
   case DIV:
     return "div";
+  case NEG:
+    return "neg";
   case TANH:
     return "tanh";
+  case MATVEC:
+    return "matvec";
+  case ELEMENT:
+    return "element";
+  case STACK:
+    return "stack";
+  case SUM:
+    return "sum";
+  case DOT:
+    return "dot";
+  case FUSED:
+    return "fused";
+  case CHECKPOINT:
+    return "checkpoint";
+  case ADD_SCALAR:
+    return "+ c";
+  case MUL_SCALAR:
+    return "* c";
+  case DIV_SCALAR:
+    return "div c";
+  case RSUB_SCALAR:
+    return "c sub";
+  case RDIV_SCALAR:
+    return "c div";
+  case POW_SCALAR:
+    return "pow c";
+  case RPOW_SCALAR:
+    return "c pow";
   default:
     return "none";
   }
 }
 
-std::vector<Value *> Value::topo()
+bool isScalarOp(OpType op)
+{
+  switch (op) {
+  case ADD_SCALAR:
+  case MUL_SCALAR:
+  case DIV_SCALAR:
+  case RSUB_SCALAR:
+  case RDIV_SCALAR:
+  case POW_SCALAR:
+  case RPOW_SCALAR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+template<class T> BasicValuePtr<T> BasicValue<T>::make(T data)
+{
+  // Nodes made without grad never join a graph, so they stay off the tape, and an inference makes and drops nodes
+  // and tensors of the same few sizes over and over, which the pool serves from its free lists.
+  if (NoGradGuard::enabled()) {
+    std::pmr::polymorphic_allocator<BasicValue> alloc(noGradResource());
+    MICROGRAD_PROFILE_BYTES(sizeof(BasicValue));
+    return std::allocate_shared<BasicValue>(alloc, std::allocator_arg, alloc.resource(), data);
+  }
+  if (BasicTape<T> *tape = BasicTape<T>::active()) { return tape->record(data); }
+  MICROGRAD_PROFILE_BYTES(sizeof(BasicValue));
+  return std::make_shared<BasicValue>(data);
+}
+
+template<class T> BasicValuePtr<T> BasicValue<T>::constant(T value)
+{
+  ValuePtr out = make(value);
+  out->_constant = true;
+  out->_requiresGrad = false;
+  return out;
+}
+
+template<class T>
+BasicValue<T>::Tensor::Tensor(std::span<const size_t> shape, std::pmr::memory_resource *resource, T *data, T *grad)
+  : shape(shape.begin(), shape.end(), resource), storage(resource), data(data), grad(grad), size(1)
+{
+  for (auto d : shape) { size *= d; }
+  storage.resize((data == nullptr ? size : 0) + (grad == nullptr ? size : 0));
+  MICROGRAD_PROFILE_BYTES(sizeof(Tensor) + storage.size() * sizeof(T));
+  if (data == nullptr) { this->data = storage.data(); }
+  if (grad == nullptr) { this->grad = storage.data() + (data == nullptr ? size : 0); }
+}
+
+template<class T> BasicValuePtr<T> BasicValue<T>::makeTensor(std::span<const size_t> shape, std::span<const T> data)
+{
+  ValuePtr out = make();
+  std::pmr::polymorphic_allocator<> alloc(out->_prev.get_allocator().resource());
+  out->_tensor = alloc.new_object<Tensor>(shape, alloc.resource(), nullptr, nullptr);
+  assert(data.empty() || data.size() == out->size());
+  std::ranges::copy(data, out->_tensor->data);
+  return out;
+}
+
+template<class T>
+BasicValuePtr<T> BasicValue<T>::makeTensorView(std::span<const size_t> shape,
+  T *data,
+  T *grad,
+  std::shared_ptr<const void> owner)
+{
+  ValuePtr out = make();
+  std::pmr::polymorphic_allocator<> alloc(out->_prev.get_allocator().resource());
+  out->_tensor = alloc.new_object<Tensor>(shape, alloc.resource(), data, grad);
+  out->_tensor->owner = std::move(owner);
+  return out;
+}
+
+template<class T> BasicValuePtr<T> BasicValue<T>::makeLike(const ValuePtr &lhs, const ValuePtr &rhs)
+{
+  if (!lhs->isTensor() && !rhs->isTensor()) { return make(); }
+  assert(lhs->size() == rhs->size() || lhs->size() == 1 || rhs->size() == 1);
+  return makeTensor(lhs->size() >= rhs->size() ? lhs->shape() : rhs->shape());
+}
+
+template<class T> BasicValuePtr<T> BasicValue<T>::makeScalarOp(OpType op, const ValuePtr &x, T c)
+{
+  ValuePtr out = makeLike(x, x);
+  out->_aux = c;
+  return makeOp(op, std::move(out), { x });
+}
+
+template<class T> BasicValuePtr<T> BasicValue<T>::makeBinary(OpType op, const ValuePtr &lhs, const ValuePtr &rhs)
+{
+  // x - c is x + (-c), which rounds the same.
+  if (rhs->_constant && !rhs->isTensor()) {
+    const T c = rhs->_data;
+    switch (op) {
+    case ADD:
+      return makeScalarOp(ADD_SCALAR, lhs, c);
+    case SUB:
+      return makeScalarOp(ADD_SCALAR, lhs, -c);
+    case MUL:
+      return makeScalarOp(MUL_SCALAR, lhs, c);
+    case DIV:
+      return makeScalarOp(DIV_SCALAR, lhs, c);
+    default:
+      return makeScalarOp(POW_SCALAR, lhs, c);
+    }
+  }
+  if (lhs->_constant && !lhs->isTensor()) {
+    const T c = lhs->_data;
+    switch (op) {
+    case ADD:
+      return makeScalarOp(ADD_SCALAR, rhs, c);
+    case SUB:
+      return makeScalarOp(RSUB_SCALAR, rhs, c);
+    case MUL:
+      return makeScalarOp(MUL_SCALAR, rhs, c);
+    case DIV:
+      return makeScalarOp(RDIV_SCALAR, rhs, c);
+    default:
+      return makeScalarOp(RPOW_SCALAR, rhs, c);
+    }
+  }
+  return makeOp(op, op == POW ? make() : makeLike(lhs, rhs), { lhs, rhs });
+}
+
+template<class T> void BasicValue<T>::fillGrad(T g) { std::fill_n(grds(), size(), g); }
+
+template<class T> std::atomic<std::uint64_t> BasicValue<T>::_epoch{ 0 };
+
+template<class T> BasicValue<T>::~BasicValue()
 {
-  std::vector<Value *> t{};
-  std::set<Value *> s{};
-  buildTopo(this, t, s);
+  // Operands this node holds the last reference to are released from a worklist instead of recursively, so
+  // dropping the root of a long chain does not overflow the stack.
+  if (_tensor != nullptr) { _prev.get_allocator().delete_object(_tensor); }
+  thread_local std::vector<ValuePtr> pending;
+  thread_local bool draining = false;
+  for (auto &p : _prev) {
+    if (p.use_count() == 1) { pending.push_back(std::move(p)); }
+  }
+  if (draining) { return; }
+  draining = true;
+  while (!pending.empty()) {
+    ValuePtr p = std::move(pending.back());
+    pending.pop_back();
+    p.reset();
+  }
+  draining = false;
+}
+
+template<class T> std::vector<BasicValue<T> *> BasicValue<T>::topo(bool pruned)
+{
+  std::vector<BasicValue *> t{};
+  buildTopo(this, t, pruned);
   return t;
 }
 
-void Value::buildTopo(Value *v, std::vector<Value *> &topo, std::set<Value *> &seen)
+template<class T> void BasicValue<T>::buildTopo(BasicValue *root, std::vector<BasicValue *> &topo, bool pruned)
+{
+  MICROGRAD_PROFILE_TOPO();
+  // Depth-first post-order with an explicit stack; a node is visited once per sort when its stamp matches.
+  if (pruned && !root->_requiresGrad) { return; }
+  const std::uint64_t stamp = ++_epoch;
+  thread_local std::vector<std::pair<BasicValue *, size_t>> stack;
+  stack.clear();
+  root->_visit = stamp;
+  stack.emplace_back(root, 0);
+  while (!stack.empty()) {
+    auto &[v, next] = stack.back();
+    if (next < v->_prev.size()) {
+      BasicValue *p = v->_prev[next++].get();
+      if (p->_visit != stamp && (!pruned || p->_requiresGrad)) {
+        p->_visit = stamp;
+        stack.emplace_back(p, 0);
+      }
+    } else {
+      topo.push_back(v);
+      stack.pop_back();
+    }
+  }
+}
+
+template<class T>
+const std::vector<BasicValue<T> *> &BasicValue<T>::topoOrder(bool cacheTopo, std::vector<BasicValue *> &fresh)
 {
-  if (seen.find(v) != seen.end()) { return; }
-  seen.insert(v);
-  for (const auto &p : v->_prev) { buildTopo(p.get(), topo, seen); }
-  topo.push_back(v);
+  if (cacheTopo && !_topoCache) { _topoCache = std::make_unique<std::vector<BasicValue *>>(topo()); }
+  if (!_topoCache) { fresh = topo(); }
+  return _topoCache ? *_topoCache : fresh;
 }
-void Value::backward()
+
+template<class T> void BasicValue<T>::backward(bool cacheTopo)
 {
-  auto topo_order = topo();
+  MICROGRAD_PROFILE_SCOPE("backward");
+  std::vector<BasicValue *> fresh;
+  const auto &topo_order = topoOrder(cacheTopo, fresh);
+  // Only the nodes in between start from zero; leaves keep what earlier passes left.
   for (auto &it : topo_order) {
-    if (it != nullptr) { it->_grad = 0; }
+    if (it != nullptr && !it->_prev.empty()) { it->fillGrad(0); }
   }
-  _grad = 1.0;
+  fillGrad(1.0);
   for (auto &it : std::ranges::reverse_view(topo_order)) {
-    if (it != nullptr) { it->_backward(); }
+    if (it != nullptr) { it->backwardStep(); }
   }
 }
 
-void Value::printDOT(const std::string &filename, Value *value)
+template<class T> void BasicValue<T>::backward(ThreadPool &pool, bool cacheTopo)
 {
-  std::ofstream outFile(filename);
-  if (!outFile.is_open()) {
-    std::cerr << "Error: Unable to open file!" << std::endl;
+  if (pool.size() == 1) {
+    backward(cacheTopo);
     return;
   }
+  MICROGRAD_PROFILE_SCOPE("backward");
+  std::vector<BasicValue *> fresh;
+  const auto &topo_order = topoOrder(cacheTopo, fresh);
+  for (auto &it : topo_order) {
+    if (it != nullptr) {
+      if (!it->_prev.empty()) { it->fillGrad(0); }
+      it->_level = 0;
+    }
+  }
+  fillGrad(1.0);
 
-  std::function<void(std::ofstream &, Value *)> traverseAndPrintDOT = [&](std::ofstream &out, Value *v) {
-    auto [valueName, valueDotStr] = valueDot(v);
-    out << valueDotStr << std::endl;
-    if (!v->_prev.empty()) {
-      auto [opName, opDotStr] = opDot(&v->op);
+  // A node's level is its longest distance from the root. Every consumer of a node is on a lower level, so once the
+  // lower levels are done its gradient is complete, and the nodes of one level only write into higher levels.
+  // Levels are final when a node is reached in reverse topological order, so they are counted in the same pass.
+  std::vector<size_t> offsets(1);
+  for (auto &it : std::ranges::reverse_view(topo_order)) {
+    if (it == nullptr) { continue; }
+    for (auto &p : it->_prev) { p->_level = std::max(p->_level, it->_level + 1); }
+    if (offsets.size() < it->_level + 2) { offsets.resize(it->_level + 2); }
+    offsets[it->_level + 1]++;
+  }
+  const size_t levels = offsets.size() - 1;
+  for (size_t l = 0; l < levels; l++) { offsets[l + 1] += offsets[l]; }
+  std::vector<BasicValue *> byLevel(offsets.back());
+  std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+  for (auto &it : topo_order) {
+    if (it != nullptr) { byLevel[fill[it->_level]++] = it; }
+  }
 
-      out << opDotStr << std::endl;
-      out << opName << " -> " << valueName << ";" << std::endl;
-      for (const auto &p : v->_prev) {
-        auto [prevValueName, prevValueDotStr] = valueDot(p.get());
-        out << prevValueDotStr << std::endl;
-        out << prevValueName << " -> " << opName << ";" << std::endl;
-      }
+  for (size_t l = 0; l < levels; l++) {
+    const size_t begin = offsets[l];
+    const size_t count = offsets[l + 1] - begin;
+    const size_t chunks = std::min(pool.size() * 4, count / kParallelGrain);
+    if (chunks <= 1) {
+      for (size_t i = begin; i < begin + count; i++) { byLevel[i]->backwardStep(); }
+      continue;
     }
+    pool.parallelFor(chunks, [&](size_t c) {
+      const size_t first = begin + count * c / chunks;
+      const size_t last = begin + count * (c + 1) / chunks;
+      for (size_t i = first; i < last; i++) { byLevel[i]->backwardStep(true); }
+    });
+  }
+}
+
+template<class T> void BasicValue<T>::backwardStep(bool concurrent)
+{
+  MICROGRAD_PROFILE_BACKWARD(op);
+  if (_tensor != nullptr || op == ELEMENT || op == STACK) {
+    backwardTensor(concurrent);
+    return;
+  }
+  // Adds d to the gradient of operand i, if it takes one.
+  auto accumulate = [&](size_t i, T d) {
+    if (!_prev[i]->_requiresGrad) { return; }
+    GradLock lock(_prev[i].get(), concurrent);
+    _prev[i]->_grad += d;
   };
-  auto topo = value->topo();
-  outFile << "digraph G {" << std::endl;
-  for (const auto &v : topo) { traverseAndPrintDOT(outFile, v); }
-  outFile << "}" << std::endl;
-  outFile.close();
+  switch (op) {
+  case ADD:
+    accumulate(0, _grad);
+    accumulate(1, _grad);
+    break;
+  case SUB:
+    accumulate(0, _grad);
+    accumulate(1, -_grad);
+    break;
+  case MUL:
+    accumulate(0, _grad * _prev[1]->_data);
+    accumulate(1, _grad * _prev[0]->_data);
+    break;
+  case DIV:
+    // d(a / b)/db = -(a / b) / b, written in terms of the output.
+    accumulate(0, _grad / _prev[1]->_data);
+    accumulate(1, -_grad * _data / _prev[1]->_data);
+    break;
+  case NEG:
+    accumulate(0, -_grad);
+    break;
+  case EXP:
+    accumulate(0, _grad * _data);
+    break;
+  case POW: {
+    const T x = _prev[0]->_data;
+    const T a = _prev[1]->_data;
+    accumulate(0, _grad * a * std::pow(x, a - 1));
+    accumulate(1, _grad * std::log(x) * _data);
+    break;
+  }
+  case RELU:
+    accumulate(0, _grad * (_prev[0]->_data > 0 ? 1 : 0));
+    break;
+  case TANH:
+    accumulate(0, _grad * (1 - _data * _data));
+    break;
+  case SUM:
+    for (size_t i = 0; i < _prev.size(); i++) { accumulate(i, _grad); }
+    break;
+  case DOT: {
+    const size_t n = _prev.size() / 2;
+    for (size_t i = 0; i < n; i++) {
+      accumulate(i, _grad * _prev[n + i]->_data);
+      accumulate(n + i, _grad * _prev[i]->_data);
+    }
+    break;
+  }
+  case FUSED: {
+    const T *partials = _prev.back()->vals();
+    for (size_t i = 0; i + 1 < _prev.size(); i++) { accumulate(i, _grad * partials[i]); }
+    break;
+  }
+  case ADD_SCALAR:
+    accumulate(0, _grad);
+    break;
+  case MUL_SCALAR:
+    accumulate(0, _grad * _aux);
+    break;
+  case DIV_SCALAR:
+    accumulate(0, _grad / _aux);
+    break;
+  case RSUB_SCALAR:
+    accumulate(0, -_grad);
+    break;
+  case RDIV_SCALAR:
+    accumulate(0, -_grad * _data / _prev[0]->_data);
+    break;
+  case POW_SCALAR:
+    accumulate(0, _grad * _aux * std::pow(_prev[0]->_data, _aux - 1));
+    break;
+  case RPOW_SCALAR:
+    accumulate(0, _grad * std::log(_aux) * _data);
+    break;
+  default:
+    break;
+  }
+}
+
+template<class T> void BasicValue<T>::forward(std::span<const ValuePtr> in)
+{
+  if (_tensor != nullptr) {
+    forwardTensor(in);
+    return;
+  }
+  switch (op) {
+  case ADD:
+    _data = in[0]->_data + in[1]->_data;
+    break;
+  case SUB:
+    _data = in[0]->_data - in[1]->_data;
+    break;
+  case MUL:
+    _data = in[0]->_data * in[1]->_data;
+    break;
+  case DIV:
+    _data = in[0]->_data / in[1]->_data;
+    break;
+  case NEG:
+    _data = -in[0]->_data;
+    break;
+  case EXP:
+    _data = std::exp(in[0]->_data);
+    break;
+  case POW:
+    _data = std::pow(in[0]->_data, in[1]->_data);
+    break;
+  case RELU:
+    _data = std::max(T(0), in[0]->_data);
+    break;
+  case TANH:
+    _data = std::tanh(in[0]->_data);
+    break;
+  case ADD_SCALAR:
+    _data = in[0]->_data + _aux;
+    break;
+  case MUL_SCALAR:
+    _data = in[0]->_data * _aux;
+    break;
+  case DIV_SCALAR:
+    _data = in[0]->_data / _aux;
+    break;
+  case RSUB_SCALAR:
+    _data = _aux - in[0]->_data;
+    break;
+  case RDIV_SCALAR:
+    _data = _aux / in[0]->_data;
+    break;
+  case POW_SCALAR:
+    _data = std::pow(in[0]->_data, _aux);
+    break;
+  case RPOW_SCALAR:
+    _data = std::pow(_aux, in[0]->_data);
+    break;
+  case ELEMENT:
+    _data = in[0]->vals()[_index];
+    break;
+  case SUM:
+    _data = 0;
+    for (const auto &p : in) { _data += p->_data; }
+    break;
+  case DOT: {
+    // Operands are the n inputs followed by the n weights.
+    const size_t n = in.size() / 2;
+    _data = 0;
+    for (size_t i = 0; i < n; i++) { _data += in[i]->_data * in[n + i]->_data; }
+    break;
+  }
+  case FUSED: {
+    // The last operand holds the partials and keeps the function alive.
+    BasicValue *state = in.back().get();
+    const auto *f = static_cast<const FusedFunction *>(state->_tensor->owner.get());
+    thread_local std::vector<double> x;
+    x.resize(in.size() - 1);
+    for (size_t i = 0; i < x.size(); i++) { x[i] = in[i]->_data; }
+    if constexpr (std::is_same_v<T, double>) {
+      f->evaluate(x, _data, state->values());
+    } else {
+      thread_local std::vector<double> partials;
+      partials.resize(x.size());
+      double value{};
+      f->evaluate(x, value, partials);
+      _data = static_cast<T>(value);
+      std::ranges::copy(partials, state->values().begin());
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+template<class T> void BasicValue<T>::forwardTensor(std::span<const ValuePtr> in)
+{
+  T *o = vals();
+  const size_t n = size();
+  switch (op) {
+  case ADD:
+  case SUB:
+  case MUL:
+  case DIV: {
+    // A scalar operand has stride 0 and is broadcast over the output.
+    const T *l = in[0]->vals();
+    const T *r = in[1]->vals();
+    const size_t ls = in[0]->size() == 1 ? 0 : 1;
+    const size_t rs = in[1]->size() == 1 ? 0 : 1;
+    if (ls == 1 && rs == 1 && op == ADD) {
+      kernels::add(l, r, o, n);
+    } else if (ls == 1 && rs == 1 && op == MUL) {
+      kernels::mul(l, r, o, n);
+    } else if (op == ADD) {
+      for (size_t i = 0; i < n; i++) { o[i] = l[i * ls] + r[i * rs]; }
+    } else if (op == SUB) {
+      for (size_t i = 0; i < n; i++) { o[i] = l[i * ls] - r[i * rs]; }
+    } else if (op == MUL) {
+      for (size_t i = 0; i < n; i++) { o[i] = l[i * ls] * r[i * rs]; }
+    } else {
+      for (size_t i = 0; i < n; i++) { o[i] = l[i * ls] / r[i * rs]; }
+    }
+    break;
+  }
+  case NEG: {
+    const T *x = in[0]->vals();
+    for (size_t i = 0; i < n; i++) { o[i] = -x[i]; }
+    break;
+  }
+  case ADD_SCALAR:
+  case MUL_SCALAR:
+  case DIV_SCALAR:
+  case RSUB_SCALAR:
+  case RDIV_SCALAR: {
+    const T *x = in[0]->vals();
+    const T c = _aux;
+    if (op == ADD_SCALAR) {
+      for (size_t i = 0; i < n; i++) { o[i] = x[i] + c; }
+    } else if (op == MUL_SCALAR) {
+      for (size_t i = 0; i < n; i++) { o[i] = x[i] * c; }
+    } else if (op == DIV_SCALAR) {
+      for (size_t i = 0; i < n; i++) { o[i] = x[i] / c; }
+    } else if (op == RSUB_SCALAR) {
+      for (size_t i = 0; i < n; i++) { o[i] = c - x[i]; }
+    } else {
+      for (size_t i = 0; i < n; i++) { o[i] = c / x[i]; }
+    }
+    break;
+  }
+  case EXP:
+    kernels::exp(in[0]->vals(), o, n);
+    break;
+  case RELU:
+    kernels::relu(in[0]->vals(), o, n);
+    break;
+  case TANH:
+    kernels::tanh(in[0]->vals(), o, n);
+    break;
+  case MATVEC: {
+    const T *W = in[0]->vals();
+    const T *x = in[1]->vals();
+    const size_t cols = in[1]->size();
+    for (size_t i = 0; i < n; i++) { o[i] = kernels::dot(W + i * cols, x, cols); }
+    break;
+  }
+  case STACK:
+    for (size_t i = 0; i < n; i++) { o[i] = in[i]->_data; }
+    break;
+  case CHECKPOINT: {
+    // The function is kept alive as the owner of the node's tensor.
+    ValuePtr y = evaluateUnrecorded(*static_cast<const CheckpointFunction<T> *>(_tensor->owner.get()), in[0]);
+    assert(y->size() == n);
+    std::ranges::copy(y->values(), o);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+template<class T> void BasicValue<T>::backwardTensor(bool concurrent)
+{
+  const T *g = grds();
+  const size_t n = size();
+  switch (op) {
+  case ADD:
+  case SUB: {
+    // A broadcast operand receives the sum of the output gradient.
+    for (size_t k = 0; k < 2; k++) {
+      BasicValue *p = _prev[k].get();
+      if (!p->_requiresGrad) { continue; }
+      const T sign = k == 1 && op == SUB ? -1 : 1;
+      GradLock lock(p, concurrent);
+      if (p->size() == 1) {
+        p->grds()[0] += sign * kernels::sum(g, n);
+      } else {
+        kernels::axpy(sign, g, p->grds(), n);
+      }
+    }
+    break;
+  }
+  case MUL:
+  case DIV: {
+    BasicValue *lhs = _prev[0].get();
+    BasicValue *rhs = _prev[1].get();
+    const size_t ls = lhs->size() == 1 ? 0 : 1;
+    const size_t rs = rhs->size() == 1 ? 0 : 1;
+    const T *l = lhs->vals();
+    const T *r = rhs->vals();
+    T *lg = lhs->grds();
+    T *rg = rhs->grds();
+    if (lhs->_requiresGrad) {
+      GradLock lock(lhs, concurrent);
+      if (op == MUL && ls == 1 && rs == 1) {
+        kernels::mulAcc(g, r, lg, n);
+      } else if (op == MUL) {
+        for (size_t i = 0; i < n; i++) { lg[i * ls] += g[i] * r[i * rs]; }
+      } else {
+        for (size_t i = 0; i < n; i++) { lg[i * ls] += g[i] / r[i * rs]; }
+      }
+    }
+    if (!rhs->_requiresGrad) { break; }
+    GradLock lock(rhs, concurrent);
+    if (op == MUL && ls == 1 && rs == 1) {
+      kernels::mulAcc(g, l, rg, n);
+    } else if (op == MUL) {
+      for (size_t i = 0; i < n; i++) { rg[i * rs] += g[i] * l[i * ls]; }
+    } else {
+      // d(l / r)/dr = -(l / r) / r, written in terms of the output.
+      const T *o = vals();
+      for (size_t i = 0; i < n; i++) { rg[i * rs] -= g[i] * o[i] / r[i * rs]; }
+    }
+    break;
+  }
+  case NEG:
+  case RSUB_SCALAR: {
+    GradLock lock(_prev[0].get(), concurrent);
+    kernels::axpy(T(-1), g, _prev[0]->grds(), n);
+    break;
+  }
+  case ADD_SCALAR:
+  case MUL_SCALAR: {
+    GradLock lock(_prev[0].get(), concurrent);
+    kernels::axpy(op == ADD_SCALAR ? T(1) : _aux, g, _prev[0]->grds(), n);
+    break;
+  }
+  case DIV_SCALAR: {
+    GradLock lock(_prev[0].get(), concurrent);
+    T *xg = _prev[0]->grds();
+    for (size_t i = 0; i < n; i++) { xg[i] += g[i] / _aux; }
+    break;
+  }
+  case RDIV_SCALAR: {
+    // d(c / x)/dx = -(c / x) / x, written in terms of the output.
+    GradLock lock(_prev[0].get(), concurrent);
+    const T *x = _prev[0]->vals();
+    const T *o = vals();
+    T *xg = _prev[0]->grds();
+    for (size_t i = 0; i < n; i++) { xg[i] -= g[i] * o[i] / x[i]; }
+    break;
+  }
+  case EXP: {
+    GradLock lock(_prev[0].get(), concurrent);
+    kernels::expBackward(vals(), g, _prev[0]->grds(), n);
+    break;
+  }
+  case RELU: {
+    GradLock lock(_prev[0].get(), concurrent);
+    kernels::reluBackward(_prev[0]->vals(), g, _prev[0]->grds(), n);
+    break;
+  }
+  case TANH: {
+    GradLock lock(_prev[0].get(), concurrent);
+    kernels::tanhBackward(vals(), g, _prev[0]->grds(), n);
+    break;
+  }
+  case MATVEC: {
+    const T *W = _prev[0]->vals();
+    const T *x = _prev[1]->vals();
+    T *Wg = _prev[0]->grds();
+    T *xg = _prev[1]->grds();
+    const size_t cols = _prev[1]->size();
+    if (_prev[0]->_requiresGrad) {
+      GradLock lock(_prev[0].get(), concurrent);
+      for (size_t i = 0; i < n; i++) { kernels::axpy(g[i], x, Wg + i * cols, cols); }
+    }
+    // W^T g is only needed when x is not an input.
+    if (!_prev[1]->_requiresGrad) { break; }
+    GradLock lock(_prev[1].get(), concurrent);
+    for (size_t i = 0; i < n; i++) { kernels::axpy(g[i], W + i * cols, xg, cols); }
+    break;
+  }
+  case ELEMENT: {
+    GradLock lock(_prev[0].get(), concurrent);
+    _prev[0]->grds()[_index] += _grad;
+    break;
+  }
+  case STACK:
+    for (size_t i = 0; i < n; i++) {
+      if (!_prev[i]->_requiresGrad) { continue; }
+      GradLock lock(_prev[i].get(), concurrent);
+      _prev[i]->_grad += g[i];
+    }
+    break;
+  case CHECKPOINT:
+    backwardCheckpoint(concurrent);
+    break;
+  default:
+    break;
+  }
+}
+
+template<class T> BasicValuePtr<T> BasicValue<T>::evaluateUnrecorded(const CheckpointFunction<T> &f, const ValuePtr &x)
+{
+  NoGradGuard guard;
+  return f(x);
+}
+
+template<class T> void BasicValue<T>::backwardCheckpoint(bool concurrent)
+{
+  // The graph of f is rebuilt on a tape of its own, whose creation order is a topological order, over a view of the
+  // input with separate gradients. Its nodes are new, so their gradients start at zero and only the leaves from
+  // outside, i.e. the parameters, accumulate on top of the gradients they already hold. The tape is released when
+  // this step is done, so one segment's graph is alive at a time.
+  const auto &f = *static_cast<const CheckpointFunction<T> *>(_tensor->owner.get());
+  const BasicValuePtr<T> &input = _prev[0];
+  BasicTape<T> tape(0);
+  {
+    typename BasicTape<T>::Scope scope(tape);
+    ValuePtr x = shareValues(input);
+    x->_requiresGrad = input->_requiresGrad;
+    ValuePtr y = f(x);
+    assert(y->size() == size());
+    std::ranges::copy(grads(), y->grds());
+    for (const auto &node : std::ranges::reverse_view(tape._nodes)) {
+      if (node->_requiresGrad) { node->backwardStep(concurrent); }
+    }
+    if (!input->_requiresGrad) { return; }
+    GradLock lock(input.get(), concurrent);
+    kernels::axpy(T(1), x->grds(), input->grds(), input->size());
+  }
+}
+
+template<class T> BasicValuePtr<T> BasicValue<T>::makeOp(OpType op, ValuePtr out, std::span<const ValuePtr> in)
+{
+  MICROGRAD_PROFILE_NODE(op);
+  out->op = op;
+  out->forward(in);
+  // An op over nothing but constants is a constant itself, whose value is final.
+  const bool constant = std::ranges::all_of(in, &BasicValue::_constant);
+  if (constant || NoGradGuard::enabled()) {
+    out->op = NONE;
+    out->_constant = constant;
+    out->_requiresGrad = false;
+  } else {
+    out->_requiresGrad = std::ranges::any_of(in, &BasicValue::_requiresGrad);
+    out->_prev.assign(in.begin(), in.end());
+  }
+  return out;
+}
+
+template<class T> BasicValuePtr<T> matvec(const BasicValuePtr<T> &W, const BasicValuePtr<T> &x)
+{
+  assert(W->shape().size() == 2 && W->shape()[1] == x->size());
+  return BasicValue<T>::makeOp(MATVEC, BasicValue<T>::makeTensor({ W->shape()[0] }), { W, x });
+}
+
+template<class T> BasicValuePtr<T> element(const BasicValuePtr<T> &t, size_t i)
+{
+  assert(i < t->size());
+  BasicValuePtr<T> out = BasicValue<T>::make();
+  out->_index = static_cast<std::uint32_t>(i);
+  return BasicValue<T>::makeOp(ELEMENT, std::move(out), { t });
+}
+
+template<class T> BasicValuePtr<T> stack(const std::vector<BasicValuePtr<T>> &xs)
+{
+  assert(std::ranges::none_of(xs, &BasicValue<T>::isTensor));
+  return BasicValue<T>::makeOp(STACK, BasicValue<T>::makeTensor({ xs.size() }), xs);
+}
+
+template<class T> BasicValuePtr<T> sum(const std::vector<BasicValuePtr<T>> &xs)
+{
+  assert(std::ranges::none_of(xs, &BasicValue<T>::isTensor));
+  return BasicValue<T>::makeOp(SUM, BasicValue<T>::make(), xs);
+}
+
+template<class T> BasicValuePtr<T> dot(const std::vector<BasicValuePtr<T>> &xs, const std::vector<BasicValuePtr<T>> &ws)
+{
+  assert(xs.size() == ws.size());
+  assert(std::ranges::none_of(xs, &BasicValue<T>::isTensor) && std::ranges::none_of(ws, &BasicValue<T>::isTensor));
+  // Operands are the inputs followed by the weights.
+  std::vector<BasicValuePtr<T>> in;
+  in.reserve(2 * xs.size());
+  in.insert(in.end(), xs.begin(), xs.end());
+  in.insert(in.end(), ws.begin(), ws.end());
+  return BasicValue<T>::makeOp(DOT, BasicValue<T>::make(), in);
+}
+
+template<class T>
+BasicValuePtr<T> fused(std::shared_ptr<const FusedFunction> f, const std::vector<BasicValuePtr<T>> &xs)
+{
+  assert(std::ranges::none_of(xs, &BasicValue<T>::isTensor));
+  // Operands are xs followed by a tensor receiving the partials, which owns f.
+  BasicValuePtr<T> state = BasicValue<T>::makeTensor({ xs.size() });
+  state->_tensor->owner = std::move(f);
+  // Backward reads the partials but sends nothing into them, so whether the node needs a gradient depends on xs alone.
+  state->_requiresGrad = false;
+  std::vector<BasicValuePtr<T>> in = xs;
+  in.push_back(std::move(state));
+  return BasicValue<T>::makeOp(FUSED, BasicValue<T>::make(), in);
+}
+
+template<class T>
+BasicValuePtr<T> checkpoint(std::shared_ptr<const CheckpointFunction<T>> f,
+  const BasicValuePtr<T> &x,
+  const std::vector<BasicValuePtr<T>> &params)
+{
+  assert(x->isTensor());
+  // The shape of the result is only known once f has run, so the node is built around its first result instead of
+  // going through makeOp, which would evaluate f a second time.
+  MICROGRAD_PROFILE_NODE(CHECKPOINT);
+  BasicValuePtr<T> y = BasicValue<T>::evaluateUnrecorded(*f, x);
+  BasicValuePtr<T> out = BasicValue<T>::makeTensor(y->shape(), y->values());
+  out->_tensor->owner = std::move(f);
+  // The flag follows the operands as it would in makeOp.
+  if (NoGradGuard::enabled()) {
+    out->_requiresGrad = false;
+  } else {
+    out->op = CHECKPOINT;
+    out->_prev.reserve(params.size() + 1);
+    out->_prev.push_back(x);
+    out->_prev.insert(out->_prev.end(), params.begin(), params.end());
+    out->_requiresGrad = x->_requiresGrad || std::ranges::any_of(params, &BasicValue<T>::_requiresGrad);
+  }
+  return out;
+}
+
+template<class T> std::vector<BasicValuePtr<T>> unstack(const BasicValuePtr<T> &t)
+{
+  std::vector<BasicValuePtr<T>> out(t->size());
+  for (size_t i = 0; i < out.size(); i++) { out[i] = element(t, i); }
+  return out;
+}
+
+template<class T> void BasicValue<T>::printDOT(const std::string &filename, BasicValue *value)
+{
+  if (!writeDot(filename, *value)) {
+    std::cerr << "Error: Unable to open file!" << std::endl;
+    return;
+  }
   std::cout << "DOT representation written to " << filename << std::endl;
 }
 
-void Value::printDOT(const std::string &filename) { printDOT(filename, this); }
\ No newline at end of file
+template<class T> void BasicValue<T>::printDOT(const std::string &filename) { printDOT(filename, this); }
+
+thread_local bool NoGradGuard::_enabled = false;
+
+NoGradGuard::NoGradGuard() : _previous(_enabled) { _enabled = true; }
+
+NoGradGuard::~NoGradGuard() { _enabled = _previous; }
+
+template<class T> void *BasicTape<T>::Upstream::do_allocate(size_t bytes, size_t alignment)
+{
+  overflow += bytes;
+  return std::pmr::get_default_resource()->allocate(bytes, alignment);
+}
+
+template<class T> void BasicTape<T>::Upstream::do_deallocate(void *p, size_t bytes, size_t alignment)
+{
+  std::pmr::get_default_resource()->deallocate(p, bytes, alignment);
+}
+
+template<class T> bool BasicTape<T>::Upstream::do_is_equal(const std::pmr::memory_resource &other) const noexcept
+{
+  return this == &other;
+}
+
+template<class T>
+BasicTape<T>::BasicTape(size_t initialBytes)
+  : _buffer(initialBytes), _arena(_buffer.data(), _buffer.size(), &_upstream)
+{}
+
+template<class T> BasicTape<T>::~BasicTape()
+{
+  if (_active == this) { _active = nullptr; }
+  releaseNodes();
+}
+
+template<class T> BasicTape<T>::Scope::Scope(BasicTape &tape) : _previous(_active) { _active = &tape; }
+
+template<class T> BasicTape<T>::Scope::~Scope() { _active = _previous; }
+
+template<class T> BasicValuePtr<T> BasicTape<T>::record(T data)
+{
+  std::pmr::polymorphic_allocator<BasicValue<T>> alloc(&_arena);
+  auto node = std::allocate_shared<BasicValue<T>>(alloc, std::allocator_arg, &_arena, data);
+  MICROGRAD_PROFILE_BYTES(sizeof(BasicValue<T>));
+  _nodes.push_back(node);
+  return node;
+}
+
+template<class T> void BasicTape<T>::backward(const BasicValuePtr<T> &root)
+{
+  MICROGRAD_PROFILE_SCOPE("backward");
+  for (const auto &node : _nodes) {
+    if (node->_requiresGrad && !node->_prev.empty()) { node->fillGrad(0); }
+  }
+  root->fillGrad(1.0);
+  for (const auto &node : std::ranges::reverse_view(_nodes)) {
+    if (node->_requiresGrad) { node->backwardStep(); }
+  }
+}
+
+template<class T> void BasicTape<T>::releaseNodes()
+{
+#ifndef NDEBUG
+  // The arena is about to be released, so nothing but the tape and other tape nodes may still hold on to a node.
+  std::unordered_map<BasicValue<T> *, long> internal;
+  for (const auto &node : _nodes) {
+    for (const auto &p : node->_prev) { internal[p.get()]++; }
+  }
+  for (const auto &node : _nodes) { assert(node.use_count() == 1 + internal[node.get()]); }
+#endif
+  // Releasing in creation order lets each node drop its operands right after they lost their last tape reference,
+  // so destruction never recurses through a long chain.
+  for (auto &node : _nodes) { node.reset(); }
+  _nodes.clear();
+}
+
+template<class T> void BasicTape<T>::clear()
+{
+  releaseNodes();
+  _arena.release();
+  if (_upstream.overflow > 0) {
+    std::destroy_at(&_arena);
+    _buffer.resize(_buffer.size() + _upstream.overflow);
+    _upstream.overflow = 0;
+    std::construct_at(&_arena, _buffer.data(), _buffer.size(), &_upstream);
+  }
+}
+
+template<class T> BasicPlan<T>::BasicPlan(BasicValuePtr<T> root) : _root(std::move(root)), _order(_root->topo(false))
+{
+  for (auto *v : _order) {
+    if (!v->_prev.empty()) { _ops.push_back(v); }
+    if (v->_requiresGrad) { _grads.push_back(v); }
+  }
+}
+
+template<class T> void BasicPlan<T>::forward()
+{
+  MICROGRAD_PROFILE_SCOPE("forward");
+  for (auto *v : _ops) { v->forward(); }
+}
+
+template<class T> void BasicPlan<T>::backward()
+{
+  MICROGRAD_PROFILE_SCOPE("backward");
+  for (auto *v : _grads) {
+    if (!v->_prev.empty()) { v->fillGrad(0); }
+  }
+  _root->fillGrad(1.0);
+  for (auto *v : std::ranges::reverse_view(_grads)) { v->backwardStep(); }
+}
+
+#define MICROGRAD_INSTANTIATE(T)                                                                                       \
+  template class BasicValue<T>;                                                                                        \
+  template class BasicTape<T>;                                                                                         \
+  template class BasicPlan<T>;                                                                                         \
+  template BasicValuePtr<T> matvec(const BasicValuePtr<T> &W, const BasicValuePtr<T> &x);                            \
+  template BasicValuePtr<T> element(const BasicValuePtr<T> &t, size_t i);                                            \
+  template BasicValuePtr<T> stack(const std::vector<BasicValuePtr<T>> &xs);                                          \
+  template std::vector<BasicValuePtr<T>> unstack(const BasicValuePtr<T> &t);                                         \
+  template BasicValuePtr<T> sum(const std::vector<BasicValuePtr<T>> &xs);                                            \
+  template BasicValuePtr<T> dot(const std::vector<BasicValuePtr<T>> &xs, const std::vector<BasicValuePtr<T>> &ws);   \
+  template BasicValuePtr<T> fused(std::shared_ptr<const FusedFunction> f, const std::vector<BasicValuePtr<T>> &xs);  \
+  template BasicValuePtr<T> checkpoint(std::shared_ptr<const CheckpointFunction<T>> f,                               \
+    const BasicValuePtr<T> &x,                                                                                         \
+    const std::vector<BasicValuePtr<T>> &params);
+
+MICROGRAD_INSTANTIATE(float)
+MICROGRAD_INSTANTIATE(double)
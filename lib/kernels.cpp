@@ -0,0 +1,137 @@
+#include "kernels.h"
+#include "kernels_impl.h"
+#include <atomic>
+
+namespace kernels {
+namespace {
+  bool supported(Isa isa)
+  {
+    switch (isa) {
+    case Isa::SCALAR:
+      return true;
+#ifdef MICROGRAD_X86_KERNELS
+    case Isa::AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case Isa::AVX512:
+      return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+      return false;
+    }
+  }
+
+  const Table &table(Isa isa)
+  {
+    switch (isa) {
+#ifdef MICROGRAD_X86_KERNELS
+    case Isa::AVX2:
+      return avx2Table();
+    case Isa::AVX512:
+      return avx512Table();
+#endif
+    default:
+      return scalarTable();
+    }
+  }
+
+  // Function-local so that kernels are usable from static initializers of other translation units.
+  struct Dispatch
+  {
+    std::atomic<Isa> isa{ detectIsa() };
+    std::atomic<const Table *> table{ &kernels::table(isa.load()) };
+  };
+
+  Dispatch &dispatch()
+  {
+    static Dispatch d;
+    return d;
+  }
+
+  const Table &t() { return *dispatch().table.load(std::memory_order_relaxed); }
+} // namespace
+
+const Table &scalarTable()
+{
+  static const Table table = makeTable<ScalarLane<double>, ScalarLane<float>>();
+  return table;
+}
+
+Isa detectIsa()
+{
+  for (Isa isa : { Isa::AVX512, Isa::AVX2 }) {
+    if (supported(isa)) { return isa; }
+  }
+  return Isa::SCALAR;
+}
+
+Isa activeIsa() { return dispatch().isa.load(); }
+
+void setIsa(Isa isa)
+{
+  if (!supported(isa)) { isa = detectIsa(); }
+  dispatch().isa.store(isa);
+  dispatch().table.store(&table(isa));
+}
+
+std::string_view isaName(Isa isa)
+{
+  switch (isa) {
+  case Isa::AVX2:
+    return "avx2";
+  case Isa::AVX512:
+    return "avx512";
+  default:
+    return "scalar";
+  }
+}
+
+double dot(const double *x, const double *y, size_t n) { return t().f64.dot(x, y, n); }
+double sum(const double *x, size_t n) { return t().f64.sum(x, n); }
+void axpy(double a, const double *x, double *y, size_t n) { t().f64.axpy(a, x, y, n); }
+void add(const double *x, const double *y, double *out, size_t n) { t().f64.add(x, y, out, n); }
+void mul(const double *x, const double *y, double *out, size_t n) { t().f64.mul(x, y, out, n); }
+void mulAcc(const double *x, const double *y, double *out, size_t n) { t().f64.mulAcc(x, y, out, n); }
+void exp(const double *x, double *y, size_t n) { t().f64.exp(x, y, n); }
+void tanh(const double *x, double *y, size_t n) { t().f64.tanh(x, y, n); }
+void relu(const double *x, double *y, size_t n) { t().f64.relu(x, y, n); }
+void expBackward(const double *y, const double *g, double *xg, size_t n) { t().f64.expBackward(y, g, xg, n); }
+void tanhBackward(const double *y, const double *g, double *xg, size_t n) { t().f64.tanhBackward(y, g, xg, n); }
+void reluBackward(const double *x, const double *g, double *xg, size_t n) { t().f64.reluBackward(x, g, xg, n); }
+void matmulT(const double *x, const double *w, double *out, size_t m, size_t n, size_t k)
+{
+  t().f64.matmulT(x, w, out, m, n, k);
+}
+void sgd(const SgdStep<double> &p, const double *g, double *velocity, double *x, size_t n)
+{
+  t().f64.sgd(p, g, velocity, x, n);
+}
+void adam(const AdamStep<double> &p, const double *g, double *m, double *v, double *x, size_t n)
+{
+  t().f64.adam(p, g, m, v, x, n);
+}
+
+float dot(const float *x, const float *y, size_t n) { return t().f32.dot(x, y, n); }
+float sum(const float *x, size_t n) { return t().f32.sum(x, n); }
+void axpy(float a, const float *x, float *y, size_t n) { t().f32.axpy(a, x, y, n); }
+void add(const float *x, const float *y, float *out, size_t n) { t().f32.add(x, y, out, n); }
+void mul(const float *x, const float *y, float *out, size_t n) { t().f32.mul(x, y, out, n); }
+void mulAcc(const float *x, const float *y, float *out, size_t n) { t().f32.mulAcc(x, y, out, n); }
+void exp(const float *x, float *y, size_t n) { t().f32.exp(x, y, n); }
+void tanh(const float *x, float *y, size_t n) { t().f32.tanh(x, y, n); }
+void relu(const float *x, float *y, size_t n) { t().f32.relu(x, y, n); }
+void expBackward(const float *y, const float *g, float *xg, size_t n) { t().f32.expBackward(y, g, xg, n); }
+void tanhBackward(const float *y, const float *g, float *xg, size_t n) { t().f32.tanhBackward(y, g, xg, n); }
+void reluBackward(const float *x, const float *g, float *xg, size_t n) { t().f32.reluBackward(x, g, xg, n); }
+void matmulT(const float *x, const float *w, float *out, size_t m, size_t n, size_t k)
+{
+  t().f32.matmulT(x, w, out, m, n, k);
+}
+void sgd(const SgdStep<float> &p, const float *g, float *velocity, float *x, size_t n)
+{
+  t().f32.sgd(p, g, velocity, x, n);
+}
+void adam(const AdamStep<float> &p, const float *g, float *m, float *v, float *x, size_t n)
+{
+  t().f32.adam(p, g, m, v, x, n);
+}
+} // namespace kernels
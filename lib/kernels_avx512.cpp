@@ -0,0 +1,85 @@
+// Compiled with -mavx512f; only called after the CPU has been checked for it.
+#include "kernels_impl.h"
+#include <immintrin.h>
+
+namespace {
+struct Avx512Lane
+{
+  using scalar = double;
+  using reg = __m512d;
+  using mask = __mmask8;
+  static constexpr size_t width = 8;
+  static reg load(const double *p) { return _mm512_loadu_pd(p); }
+  static void store(double *p, reg v) { _mm512_storeu_pd(p, v); }
+  static reg set1(double v) { return _mm512_set1_pd(v); }
+  static reg add(reg a, reg b) { return _mm512_add_pd(a, b); }
+  static reg sub(reg a, reg b) { return _mm512_sub_pd(a, b); }
+  static reg mul(reg a, reg b) { return _mm512_mul_pd(a, b); }
+  static reg div(reg a, reg b) { return _mm512_div_pd(a, b); }
+  static reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_pd(a, b, c); }
+  static reg sqrt(reg a) { return _mm512_sqrt_pd(a); }
+  static reg abs(reg a) { return _mm512_abs_pd(a); }
+  static reg copysign(reg magnitude, reg sign)
+  {
+    const __m512i bit = _mm512_set1_epi64(static_cast<long long>(1ULL << 63));
+    return _mm512_castsi512_pd(
+      _mm512_or_si512(_mm512_castpd_si512(magnitude), _mm512_and_si512(_mm512_castpd_si512(sign), bit)));
+  }
+  static reg max(reg a, reg b) { return _mm512_max_pd(a, b); }
+  static reg min(reg a, reg b) { return _mm512_min_pd(a, b); }
+  static reg round(reg a) { return _mm512_roundscale_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+  static reg pow2(reg k)
+  {
+    const __m512d shifter = _mm512_set1_pd(0x1.8p52);
+    __m512i ki = _mm512_sub_epi64(_mm512_castpd_si512(_mm512_add_pd(k, shifter)), _mm512_castpd_si512(shifter));
+    return _mm512_castsi512_pd(_mm512_slli_epi64(_mm512_add_epi64(ki, _mm512_set1_epi64(1023)), 52));
+  }
+  static mask gt(reg a, reg b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+  static mask isnan(reg a) { return _mm512_cmp_pd_mask(a, a, _CMP_UNORD_Q); }
+  static reg select(mask m, reg a, reg b) { return _mm512_mask_blend_pd(m, b, a); }
+  static double hsum(reg a) { return _mm512_reduce_add_pd(a); }
+};
+
+struct Avx512FloatLane
+{
+  using scalar = float;
+  using reg = __m512;
+  using mask = __mmask16;
+  static constexpr size_t width = 16;
+  static reg load(const float *p) { return _mm512_loadu_ps(p); }
+  static void store(float *p, reg v) { _mm512_storeu_ps(p, v); }
+  static reg set1(float v) { return _mm512_set1_ps(v); }
+  static reg add(reg a, reg b) { return _mm512_add_ps(a, b); }
+  static reg sub(reg a, reg b) { return _mm512_sub_ps(a, b); }
+  static reg mul(reg a, reg b) { return _mm512_mul_ps(a, b); }
+  static reg div(reg a, reg b) { return _mm512_div_ps(a, b); }
+  static reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_ps(a, b, c); }
+  static reg sqrt(reg a) { return _mm512_sqrt_ps(a); }
+  static reg abs(reg a) { return _mm512_abs_ps(a); }
+  static reg copysign(reg magnitude, reg sign)
+  {
+    const __m512i bit = _mm512_set1_epi32(static_cast<int>(1U << 31));
+    return _mm512_castsi512_ps(
+      _mm512_or_si512(_mm512_castps_si512(magnitude), _mm512_and_si512(_mm512_castps_si512(sign), bit)));
+  }
+  static reg max(reg a, reg b) { return _mm512_max_ps(a, b); }
+  static reg min(reg a, reg b) { return _mm512_min_ps(a, b); }
+  static reg round(reg a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+  static reg pow2(reg k)
+  {
+    const __m512 shifter = _mm512_set1_ps(0x1.8p23f);
+    __m512i ki = _mm512_sub_epi32(_mm512_castps_si512(_mm512_add_ps(k, shifter)), _mm512_castps_si512(shifter));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(ki, _mm512_set1_epi32(127)), 23));
+  }
+  static mask gt(reg a, reg b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+  static mask isnan(reg a) { return _mm512_cmp_ps_mask(a, a, _CMP_UNORD_Q); }
+  static reg select(mask m, reg a, reg b) { return _mm512_mask_blend_ps(m, b, a); }
+  static float hsum(reg a) { return _mm512_reduce_add_ps(a); }
+};
+} // namespace
+
+const kernels::Table &kernels::avx512Table()
+{
+  static const Table table = makeTable<Avx512Lane, Avx512FloatLane>();
+  return table;
+}
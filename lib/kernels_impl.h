@@ -0,0 +1,455 @@
+#pragma once
+// Kernel algorithms shared by the per-ISA translation units. Each of them includes this header, defines traits
+// structs wrapping its intrinsics for double and for float and instantiates the templates below with them.
+//
+// Code compiled with -mavx2 or -mavx512f must not be shared with other translation units. The templates below live
+// in an anonymous namespace, which gives every instantiation internal linkage. That does not extend to the inline
+// functions of the standard library they might call, e.g. std::bit_cast or std::sqrt: those are emitted as weak
+// definitions in each translation unit, with its flags, and the linker keeps one copy for every caller, possibly an
+// AVX one for the scalar path. So nothing here calls into std; bitCast and squareRoot use compiler builtins instead.
+#include "kernels.h"
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace kernels {
+// Kernels of one element type.
+template<class S> struct BasicTable
+{
+  S (*dot)(const S *, const S *, size_t);
+  S (*sum)(const S *, size_t);
+  void (*axpy)(S, const S *, S *, size_t);
+  void (*add)(const S *, const S *, S *, size_t);
+  void (*mul)(const S *, const S *, S *, size_t);
+  void (*mulAcc)(const S *, const S *, S *, size_t);
+  void (*exp)(const S *, S *, size_t);
+  void (*tanh)(const S *, S *, size_t);
+  void (*relu)(const S *, S *, size_t);
+  void (*expBackward)(const S *, const S *, S *, size_t);
+  void (*tanhBackward)(const S *, const S *, S *, size_t);
+  void (*reluBackward)(const S *, const S *, S *, size_t);
+  void (*matmulT)(const S *, const S *, S *, size_t, size_t, size_t);
+  void (*sgd)(const SgdStep<S> &, const S *, S *, S *, size_t);
+  void (*adam)(const AdamStep<S> &, const S *, S *, S *, S *, size_t);
+};
+
+struct Table
+{
+  BasicTable<double> f64;
+  BasicTable<float> f32;
+};
+
+const Table &scalarTable();
+const Table &avx2Table();
+const Table &avx512Table();
+} // namespace kernels
+
+namespace {
+template<class To, class From> To bitCast(From v) { return __builtin_bit_cast(To, v); }
+
+template<class S> S squareRoot(S a)
+{
+#ifdef _MSC_VER
+  // MSVC only builds the scalar kernels, whose translation unit has no ISA flags of its own.
+  return std::sqrt(a);
+#else
+  if constexpr (std::is_same_v<S, double>) {
+    return __builtin_sqrt(a);
+  } else {
+    return __builtin_sqrtf(a);
+  }
+#endif
+}
+
+// Bit layout of an IEEE type: the unsigned integer of the same width and where its exponent field starts.
+template<class S> struct Bits;
+
+template<> struct Bits<double>
+{
+  using uint = std::uint64_t;
+  static constexpr int mantissa = 52;
+  static constexpr uint bias = 1023;
+};
+
+template<> struct Bits<float>
+{
+  using uint = std::uint32_t;
+  static constexpr int mantissa = 23;
+  static constexpr uint bias = 127;
+};
+
+// One lane; used as the portable implementation and for the tails of the vector loops.
+template<class S> struct ScalarLane
+{
+  using scalar = S;
+  using reg = S;
+  using mask = bool;
+  using uint = typename Bits<S>::uint;
+  static constexpr size_t width = 1;
+  static constexpr uint signBit = uint{ 1 } << (sizeof(S) * 8 - 1);
+  // 1.5 * 2^mantissa: adding it rounds to an integer held in the low bits of the mantissa.
+  static constexpr S shifter = S(3) * S(uint{ 1 } << (Bits<S>::mantissa - 1));
+  static reg load(const S *p) { return *p; }
+  static void store(S *p, reg v) { *p = v; }
+  static reg set1(S v) { return v; }
+  static reg add(reg a, reg b) { return a + b; }
+  static reg sub(reg a, reg b) { return a - b; }
+  static reg mul(reg a, reg b) { return a * b; }
+  static reg div(reg a, reg b) { return a / b; }
+  static reg fmadd(reg a, reg b, reg c) { return a * b + c; }
+  static reg sqrt(reg a) { return squareRoot(a); }
+  static reg abs(reg a) { return bitCast<S>(bitCast<uint>(a) & ~signBit); }
+  static reg copysign(reg magnitude, reg sign)
+  {
+    return bitCast<S>(bitCast<uint>(magnitude) | (bitCast<uint>(sign) & signBit));
+  }
+  // min/max return the second operand when the first comparison fails, which lets NaN in the second through.
+  static reg max(reg a, reg b) { return a > b ? a : b; }
+  static reg min(reg a, reg b) { return a < b ? a : b; }
+  // Round to nearest even via the shifter; |a| stays far below 2^(mantissa - 1) here.
+  static reg round(reg a) { return (a + shifter) - shifter; }
+  // 2^k for integral k in the range of normal exponents, built directly in the exponent field.
+  static reg pow2(reg k)
+  {
+    auto ki = bitCast<uint>(k + shifter) - bitCast<uint>(shifter);
+    return bitCast<S>((ki + Bits<S>::bias) << Bits<S>::mantissa);
+  }
+  static mask gt(reg a, reg b) { return a > b; }
+  static mask isnan(reg a) { return a != a; }
+  static reg select(mask m, reg a, reg b) { return m ? a : b; }
+  static S hsum(reg a) { return a; }
+};
+
+// Constants of exp for each element type: ln 2 split into a high part exact in few bits and the remainder, the
+// range of arguments whose results are normal numbers, and a range just wider than the one in which exp is neither
+// 0 nor infinity.
+template<class S> struct ExpConstants;
+
+template<> struct ExpConstants<double>
+{
+  static constexpr double ln2Hi = 0.6931471803691238;
+  static constexpr double ln2Lo = 1.9082149292705877e-10;
+  static constexpr double min = -708.0;
+  static constexpr double max = 709.0;
+  static constexpr double underflow = -746.0;
+  static constexpr double overflow = 710.0;
+};
+
+template<> struct ExpConstants<float>
+{
+  static constexpr float ln2Hi = 0.693359375f;
+  static constexpr float ln2Lo = -2.12194440e-4f;
+  static constexpr float min = -87.0f;
+  static constexpr float max = 88.0f;
+  static constexpr float underflow = -104.0f;
+  static constexpr float overflow = 89.0f;
+};
+
+constexpr double kLog2e = 1.4426950408889634;
+
+// Splits exp(x) into 2^k * (1 + q) with |r| <= ln2 / 2 and q = exp(r) - 1 from its Taylor series, up to r^12 for
+// double and r^7 for float; the truncation error is below 2e-16 and 1e-8 respectively relative to exp(r). x has to
+// be clamped to [underflow, overflow] by the caller.
+template<class V> void expParts(typename V::reg x, typename V::reg &q, typename V::reg &k)
+{
+  using S = typename V::scalar;
+  using C = ExpConstants<S>;
+  using reg = typename V::reg;
+  k = V::round(V::mul(x, V::set1(S(kLog2e))));
+  reg r = V::fmadd(k, V::set1(-C::ln2Hi), x);
+  r = V::fmadd(k, V::set1(-C::ln2Lo), r);
+  reg p;
+  if constexpr (std::is_same_v<S, double>) {
+    p = V::set1(1.0 / 479001600.0);
+    p = V::fmadd(p, r, V::set1(1.0 / 39916800.0));
+    p = V::fmadd(p, r, V::set1(1.0 / 3628800.0));
+    p = V::fmadd(p, r, V::set1(1.0 / 362880.0));
+    p = V::fmadd(p, r, V::set1(1.0 / 40320.0));
+    p = V::fmadd(p, r, V::set1(1.0 / 5040.0));
+  } else {
+    p = V::set1(S(1.0 / 5040.0));
+  }
+  p = V::fmadd(p, r, V::set1(S(1.0 / 720.0)));
+  p = V::fmadd(p, r, V::set1(S(1.0 / 120.0)));
+  p = V::fmadd(p, r, V::set1(S(1.0 / 24.0)));
+  p = V::fmadd(p, r, V::set1(S(1.0 / 6.0)));
+  p = V::fmadd(p, r, V::set1(S(0.5)));
+  p = V::fmadd(p, r, V::set1(S(1.0)));
+  q = V::mul(p, r);
+}
+
+// Past the range of normal results 2^k is no longer a normal number, so it is applied as two halves that are: the
+// last multiplication then rounds to a denormal, 0 or infinity exactly where std::exp does.
+template<class V> typename V::reg expLane(typename V::reg x)
+{
+  using C = ExpConstants<typename V::scalar>;
+  typename V::reg q;
+  typename V::reg k;
+  expParts<V>(V::min(V::set1(C::overflow), V::max(V::set1(C::underflow), x)), q, k);
+  auto k1 = V::round(V::mul(k, V::set1(0.5)));
+  auto y = V::mul(V::mul(V::add(q, V::set1(1)), V::pow2(k1)), V::pow2(V::sub(k, k1)));
+  return V::select(V::isnan(x), x, y);
+}
+
+// tanh|x| = -m / (2 + m) with m = exp(-2|x|) - 1 = 2^k q + (2^k - 1). Computing m without cancellation keeps the
+// relative error small near zero, where 1 - exp(-2|x|) would lose all its digits.
+template<class V> typename V::reg tanhLane(typename V::reg x)
+{
+  typename V::reg q;
+  typename V::reg k;
+  expParts<V>(V::max(V::set1(ExpConstants<typename V::scalar>::min), V::mul(V::set1(-2), V::abs(x))), q, k);
+  auto p = V::pow2(k);
+  auto m = V::fmadd(q, p, V::sub(p, V::set1(1)));
+  auto t = V::div(V::sub(V::set1(0), m), V::add(V::set1(2), m));
+  return V::select(V::isnan(x), x, V::copysign(t, x));
+}
+
+// Applies f lane-wise to a vector loop followed by a scalar tail.
+template<class V, class S, class F, class G> void unary(const S *x, S *y, size_t n, F f, G tail)
+{
+  size_t i = 0;
+  for (; i + V::width <= n; i += V::width) { V::store(y + i, f(V::load(x + i))); }
+  for (; i < n; i++) { y[i] = tail(x[i]); }
+}
+
+template<class V, class S = typename V::scalar> void expT(const S *x, S *y, size_t n)
+{
+  unary<V>(x, y, n, expLane<V>, expLane<ScalarLane<S>>);
+}
+
+template<class V, class S = typename V::scalar> void tanhT(const S *x, S *y, size_t n)
+{
+  unary<V>(x, y, n, tanhLane<V>, tanhLane<ScalarLane<S>>);
+}
+
+template<class V, class S = typename V::scalar> void reluT(const S *x, S *y, size_t n)
+{
+  unary<V>(
+    x, y, n, [](auto v) { return V::max(v, V::set1(0)); }, [](S v) { return v > 0 ? v : S(0); });
+}
+
+template<class V, class S = typename V::scalar> S dotT(const S *x, const S *y, size_t n)
+{
+  // Four independent accumulators hide the latency of the fused multiply-adds.
+  auto a0 = V::set1(0);
+  auto a1 = V::set1(0);
+  auto a2 = V::set1(0);
+  auto a3 = V::set1(0);
+  size_t i = 0;
+  for (; i + 4 * V::width <= n; i += 4 * V::width) {
+    a0 = V::fmadd(V::load(x + i), V::load(y + i), a0);
+    a1 = V::fmadd(V::load(x + i + V::width), V::load(y + i + V::width), a1);
+    a2 = V::fmadd(V::load(x + i + 2 * V::width), V::load(y + i + 2 * V::width), a2);
+    a3 = V::fmadd(V::load(x + i + 3 * V::width), V::load(y + i + 3 * V::width), a3);
+  }
+  for (; i + V::width <= n; i += V::width) { a0 = V::fmadd(V::load(x + i), V::load(y + i), a0); }
+  S acc = V::hsum(V::add(V::add(a0, a1), V::add(a2, a3)));
+  for (; i < n; i++) { acc += x[i] * y[i]; }
+  return acc;
+}
+
+template<class V, class S = typename V::scalar> S sumT(const S *x, size_t n)
+{
+  auto a0 = V::set1(0);
+  auto a1 = V::set1(0);
+  size_t i = 0;
+  for (; i + 2 * V::width <= n; i += 2 * V::width) {
+    a0 = V::add(a0, V::load(x + i));
+    a1 = V::add(a1, V::load(x + i + V::width));
+  }
+  for (; i + V::width <= n; i += V::width) { a0 = V::add(a0, V::load(x + i)); }
+  S acc = V::hsum(V::add(a0, a1));
+  for (; i < n; i++) { acc += x[i]; }
+  return acc;
+}
+
+// out[i] = f(a[i], b[i], out[i]) over a vector loop and a scalar tail.
+template<class V, class S, class F, class G> void ternary(const S *a, const S *b, S *out, size_t n, F f, G tail)
+{
+  size_t i = 0;
+  for (; i + V::width <= n; i += V::width) { V::store(out + i, f(V::load(a + i), V::load(b + i), V::load(out + i))); }
+  for (; i < n; i++) { out[i] = tail(a[i], b[i], out[i]); }
+}
+
+template<class V, class S = typename V::scalar> void axpyT(S a, const S *x, S *y, size_t n)
+{
+  const auto av = V::set1(a);
+  size_t i = 0;
+  for (; i + V::width <= n; i += V::width) { V::store(y + i, V::fmadd(av, V::load(x + i), V::load(y + i))); }
+  for (; i < n; i++) { y[i] += a * x[i]; }
+}
+
+template<class V, class S = typename V::scalar> void addT(const S *x, const S *y, S *out, size_t n)
+{
+  size_t i = 0;
+  for (; i + V::width <= n; i += V::width) { V::store(out + i, V::add(V::load(x + i), V::load(y + i))); }
+  for (; i < n; i++) { out[i] = x[i] + y[i]; }
+}
+
+template<class V, class S = typename V::scalar> void mulT(const S *x, const S *y, S *out, size_t n)
+{
+  size_t i = 0;
+  for (; i + V::width <= n; i += V::width) { V::store(out + i, V::mul(V::load(x + i), V::load(y + i))); }
+  for (; i < n; i++) { out[i] = x[i] * y[i]; }
+}
+
+template<class V, class S = typename V::scalar> void mulAccT(const S *x, const S *y, S *out, size_t n)
+{
+  ternary<V>(
+    x, y, out, n, [](auto a, auto b, auto o) { return V::fmadd(a, b, o); }, [](S a, S b, S o) { return o + a * b; });
+}
+
+template<class V, class S = typename V::scalar> void expBackwardT(const S *y, const S *g, S *xg, size_t n)
+{
+  mulAccT<V>(y, g, xg, n);
+}
+
+template<class V, class S = typename V::scalar> void tanhBackwardT(const S *y, const S *g, S *xg, size_t n)
+{
+  ternary<V>(
+    y,
+    g,
+    xg,
+    n,
+    [](auto a, auto b, auto o) { return V::fmadd(b, V::sub(V::set1(1), V::mul(a, a)), o); },
+    [](S a, S b, S o) { return o + b * (1 - a * a); });
+}
+
+template<class V, class S = typename V::scalar> void reluBackwardT(const S *x, const S *g, S *xg, size_t n)
+{
+  ternary<V>(
+    x,
+    g,
+    xg,
+    n,
+    [](auto a, auto b, auto o) { return V::add(o, V::select(V::gt(a, V::set1(0)), b, V::set1(0))); },
+    [](S a, S b, S o) { return o + (a > 0 ? b : S(0)); });
+}
+
+// out (m x n) = x (m x k) times the transpose of w (n x k). Rows of x are taken four at a time, so every load of a
+// row of w feeds four fused multiply-adds and w is streamed m / 4 times instead of m times.
+template<class V, class S = typename V::scalar>
+void matmulTT(const S *x, const S *w, S *out, size_t m, size_t n, size_t k)
+{
+  size_t r = 0;
+  for (; r + 4 <= m; r += 4) {
+    const S *x0 = x + r * k;
+    const S *x1 = x0 + k;
+    const S *x2 = x1 + k;
+    const S *x3 = x2 + k;
+    for (size_t j = 0; j < n; j++) {
+      const S *wj = w + j * k;
+      auto a0 = V::set1(0);
+      auto a1 = V::set1(0);
+      auto a2 = V::set1(0);
+      auto a3 = V::set1(0);
+      size_t i = 0;
+      for (; i + V::width <= k; i += V::width) {
+        const auto wv = V::load(wj + i);
+        a0 = V::fmadd(V::load(x0 + i), wv, a0);
+        a1 = V::fmadd(V::load(x1 + i), wv, a1);
+        a2 = V::fmadd(V::load(x2 + i), wv, a2);
+        a3 = V::fmadd(V::load(x3 + i), wv, a3);
+      }
+      S s0 = V::hsum(a0);
+      S s1 = V::hsum(a1);
+      S s2 = V::hsum(a2);
+      S s3 = V::hsum(a3);
+      for (; i < k; i++) {
+        s0 += x0[i] * wj[i];
+        s1 += x1[i] * wj[i];
+        s2 += x2[i] * wj[i];
+        s3 += x3[i] * wj[i];
+      }
+      out[r * n + j] = s0;
+      out[(r + 1) * n + j] = s1;
+      out[(r + 2) * n + j] = s2;
+      out[(r + 3) * n + j] = s3;
+    }
+  }
+  for (; r < m; r++) {
+    for (size_t j = 0; j < n; j++) { out[r * n + j] = dotT<V>(x + r * k, w + j * k, k); }
+  }
+}
+
+template<class V, class S = typename V::scalar>
+void sgdT(const kernels::SgdStep<S> &p, const S *g, S *velocity, S *x, size_t n)
+{
+  const auto lr = V::set1(p.lr);
+  const auto mu = V::set1(p.momentum);
+  const auto l2 = V::set1(p.l2);
+  size_t i = 0;
+  if (velocity == nullptr) {
+    for (; i + V::width <= n; i += V::width) {
+      const auto xi = V::load(x + i);
+      V::store(x + i, V::sub(xi, V::mul(lr, V::fmadd(l2, xi, V::load(g + i)))));
+    }
+    for (; i < n; i++) { x[i] -= p.lr * (g[i] + p.l2 * x[i]); }
+    return;
+  }
+  for (; i + V::width <= n; i += V::width) {
+    const auto xi = V::load(x + i);
+    const auto vi = V::fmadd(mu, V::load(velocity + i), V::fmadd(l2, xi, V::load(g + i)));
+    V::store(velocity + i, vi);
+    V::store(x + i, V::sub(xi, V::mul(lr, vi)));
+  }
+  for (; i < n; i++) {
+    velocity[i] = p.momentum * velocity[i] + g[i] + p.l2 * x[i];
+    x[i] -= p.lr * velocity[i];
+  }
+}
+
+template<class V, class S = typename V::scalar>
+void adamT(const kernels::AdamStep<S> &p, const S *g, S *m, S *v, S *x, size_t n)
+{
+  const auto step = V::set1(p.step);
+  const auto b1 = V::set1(p.beta1);
+  const auto c1 = V::set1(1 - p.beta1);
+  const auto b2 = V::set1(p.beta2);
+  const auto c2 = V::set1(1 - p.beta2);
+  const auto vScale = V::set1(p.vScale);
+  const auto eps = V::set1(p.eps);
+  const auto l2 = V::set1(p.l2);
+  const auto keep = V::set1(1 - p.decay);
+  size_t i = 0;
+  for (; i + V::width <= n; i += V::width) {
+    const auto xi = V::load(x + i);
+    const auto gi = V::fmadd(l2, xi, V::load(g + i));
+    const auto mi = V::fmadd(b1, V::load(m + i), V::mul(c1, gi));
+    const auto vi = V::fmadd(b2, V::load(v + i), V::mul(c2, V::mul(gi, gi)));
+    V::store(m + i, mi);
+    V::store(v + i, vi);
+    const auto delta = V::div(V::mul(step, mi), V::add(V::sqrt(V::mul(vi, vScale)), eps));
+    V::store(x + i, V::sub(V::mul(keep, xi), delta));
+  }
+  for (; i < n; i++) {
+    const S gi = g[i] + p.l2 * x[i];
+    m[i] = p.beta1 * m[i] + (1 - p.beta1) * gi;
+    v[i] = p.beta2 * v[i] + (1 - p.beta2) * gi * gi;
+    x[i] = (1 - p.decay) * x[i] - p.step * m[i] / (squareRoot(v[i] * p.vScale) + p.eps);
+  }
+}
+
+template<class V> kernels::BasicTable<typename V::scalar> makeBasicTable()
+{
+  return { dotT<V>,
+    sumT<V>,
+    axpyT<V>,
+    addT<V>,
+    mulT<V>,
+    mulAccT<V>,
+    expT<V>,
+    tanhT<V>,
+    reluT<V>,
+    expBackwardT<V>,
+    tanhBackwardT<V>,
+    reluBackwardT<V>,
+    matmulTT<V>,
+    sgdT<V>,
+    adamT<V> };
+}
+
+// D and F are the lanes of an ISA for double and for float.
+template<class D, class F> kernels::Table makeTable() { return { makeBasicTable<D>(), makeBasicTable<F>() }; }
+} // namespace
@@ -0,0 +1,222 @@
+#include "binary_file.h"
+#include "nn.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+using namespace binary_file;
+
+// Binary model format, version 1.
+//
+//   FileHeader                     64 bytes
+//   LayerRecord[layers]            32 bytes each
+//   per layer: weights, bias       row-major doubles or floats as given by dtype, each array starting at a multiple
+//                                  of 64 bytes
+//
+// Offsets are from the start of the file. Aligning the arrays to cache lines lets a mapped file be used in place by
+// the vectorized kernels.
+namespace {
+constexpr std::array<char, 8> kMagic{ 'm', 'g', 'r', 'a', 'd', 'm', 'l', 'p' };
+constexpr std::uint32_t kVersion = 1;
+
+struct FileHeader
+{
+  std::array<char, 8> magic;
+  std::uint32_t version;
+  std::uint32_t byteOrder;
+  std::uint32_t dtype;
+  std::uint32_t layers;
+  std::uint64_t fileSize;
+  std::array<std::uint64_t, 4> reserved;
+};
+static_assert(sizeof(FileHeader) == 64);
+
+struct LayerRecord
+{
+  std::uint32_t nin;
+  std::uint32_t nout;
+  std::uint32_t activation;
+  std::uint32_t reserved;
+  std::uint64_t weights;
+  std::uint64_t bias;
+};
+static_assert(sizeof(LayerRecord) == 32);
+
+// The mapped file together with zeroed gradient buffers for its parameters. The model's ParameterBuffer holds a
+// reference, so both live as long as any layer of the model. With mmap the gradients are an anonymous mapping,
+// which costs nothing until backward first writes to it.
+template<class T> class ModelBuffers
+{
+private:
+  T *_grads{};
+  size_t _gradCount{};
+#ifndef MICROGRAD_MMAP
+  std::vector<T> _gradStorage;
+#endif
+
+public:
+  MappedFile file;
+
+  ModelBuffers() = default;
+  ModelBuffers(const ModelBuffers &) = delete;
+  ModelBuffers &operator=(const ModelBuffers &) = delete;
+  ~ModelBuffers()
+  {
+#ifdef MICROGRAD_MMAP
+    if (_grads != nullptr) { munmap(_grads, _gradCount * sizeof(T)); }
+#endif
+  }
+
+  bool allocateGrads(size_t count)
+  {
+    if (count == 0) { return true; }
+#ifdef MICROGRAD_MMAP
+    void *p = mmap(nullptr, count * sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) { return false; }
+    _grads = static_cast<T *>(p);
+#else
+    _gradStorage.resize(count);
+    _grads = _gradStorage.data();
+#endif
+    _gradCount = count;
+    return true;
+  }
+
+  [[nodiscard]] T *grads() const { return _grads; }
+};
+
+bool isSavable(Activation a) { return a == Activation::TANH || a == Activation::RELU || a == Activation::LINEAR; }
+
+std::nullopt_t loadError(const std::string &fileName, const char *what)
+{
+  std::cerr << "Error: " << fileName << ": " << what << std::endl;
+  return std::nullopt;
+}
+} // namespace
+
+template<class T> bool BasicMLP<T>::save(const std::string &fileName) const
+{
+  FileHeader header{};
+  header.magic = kMagic;
+  header.version = kVersion;
+  header.byteOrder = kByteOrder;
+  header.dtype = kDtype<T>;
+  header.layers = static_cast<std::uint32_t>(_layers.size());
+
+  std::vector<LayerRecord> records(_layers.size());
+  std::uint64_t offset = alignUp(sizeof(FileHeader) + records.size() * sizeof(LayerRecord));
+  for (size_t i = 0; i < _layers.size(); i++) {
+    const BasicLayer<T> &l = _layers[i];
+    if (!isSavable(l.activation())) {
+      std::cerr << "Error: layers with a custom activation cannot be saved" << std::endl;
+      return false;
+    }
+    auto &r = records[i];
+    r.nin = static_cast<std::uint32_t>(l.nin());
+    r.nout = static_cast<std::uint32_t>(l.nout());
+    r.activation = static_cast<std::uint32_t>(l.activation());
+    r.weights = offset;
+    offset = alignUp(offset + l.nin() * l.nout() * sizeof(T));
+    r.bias = offset;
+    offset = alignUp(offset + l.nout() * sizeof(T));
+  }
+  header.fileSize = offset;
+
+  std::ofstream out(fileName, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    std::cerr << "Error: Unable to open file!" << std::endl;
+    return false;
+  }
+  auto write = [&](const void *p, size_t bytes) {
+    out.write(static_cast<const char *>(p), static_cast<std::streamsize>(bytes));
+  };
+  auto pad = [&]() {
+    static constexpr std::array<char, kAlignment> zeros{};
+    write(zeros.data(), alignUp(out.tellp()) - static_cast<std::uint64_t>(out.tellp()));
+  };
+  write(&header, sizeof(header));
+  write(records.data(), records.size() * sizeof(LayerRecord));
+  pad();
+  for (const auto &l : _layers) {
+    for (const auto &p : l.parameters()) {
+      write(p->values().data(), p->size() * sizeof(T));
+      pad();
+    }
+  }
+  return static_cast<bool>(out);
+}
+
+template<class T> std::optional<BasicMLP<T>> BasicMLP<T>::load(const std::string &fileName)
+{
+  auto buffers = std::make_shared<ModelBuffers<T>>();
+  if (!buffers->file.open(fileName)) { return loadError(fileName, "unable to read file"); }
+  const std::byte *file = buffers->file.data();
+  const size_t fileSize = buffers->file.size();
+
+  FileHeader header{};
+  if (fileSize < sizeof(header)) { return loadError(fileName, "truncated header"); }
+  std::memcpy(&header, file, sizeof(header));
+  if (header.magic != kMagic) { return loadError(fileName, "not a model file"); }
+  if (header.byteOrder != kByteOrder) { return loadError(fileName, "written with another byte order"); }
+  if (header.version != kVersion) { return loadError(fileName, "unsupported version"); }
+  if (header.dtype != kDtype<T>) { return loadError(fileName, "element type does not match the model"); }
+  if (header.fileSize != fileSize) { return loadError(fileName, "size does not match the header"); }
+  if (header.layers == 0 || sizeof(header) + header.layers * sizeof(LayerRecord) > fileSize) {
+    return loadError(fileName, "truncated layer table");
+  }
+
+  std::vector<LayerRecord> records(header.layers);
+  std::memcpy(records.data(), file + sizeof(header), records.size() * sizeof(LayerRecord));
+  // The parameters are used in place as the values of a ParameterBuffer that runs from the first weights to the end
+  // of the file, padding included, which save() leaves zero.
+  const std::uint64_t base = records[0].weights;
+  if (base < sizeof(header) + records.size() * sizeof(LayerRecord)) {
+    return loadError(fileName, "parameters overlap the layer table");
+  }
+  // Every array has to lie in the file and be aligned for T, and start after the end of the one before it, so that
+  // no two share memory; consecutive layers have to fit each other.
+  auto inFile = [&](std::uint64_t offset, std::uint64_t count) {
+    return offset % alignof(T) == 0 && offset <= fileSize && count <= (fileSize - offset) / sizeof(T);
+  };
+  std::uint64_t end = base;
+  for (size_t i = 0; i < records.size(); i++) {
+    const auto &r = records[i];
+    if (r.nin == 0 || r.nout == 0 || (i > 0 && r.nin != records[i - 1].nout)) {
+      return loadError(fileName, "inconsistent layer sizes");
+    }
+    if (!isSavable(static_cast<Activation>(r.activation))) { return loadError(fileName, "unknown activation"); }
+    const std::uint64_t weights = std::uint64_t{ r.nin } * r.nout;
+    if (!inFile(r.weights, weights) || !inFile(r.bias, r.nout)) {
+      return loadError(fileName, "parameters outside of the file");
+    }
+    if (r.weights < end || r.bias < r.weights + weights * sizeof(T)) {
+      return loadError(fileName, "overlapping parameters");
+    }
+    end = r.bias + std::uint64_t{ r.nout } * sizeof(T);
+  }
+  const size_t params = (fileSize - base) / sizeof(T);
+  if (!buffers->allocateGrads(params)) { return loadError(fileName, "unable to allocate gradients"); }
+
+  auto *values = reinterpret_cast<T *>(buffers->file.data() + base);
+  auto parameters = std::make_shared<BasicParameterBuffer<T>>(
+    std::span(values, params), buffers, std::span(buffers->grads(), params));
+  std::vector<BasicLayer<T>> layers;
+  layers.reserve(records.size());
+  for (const auto &r : records) {
+    const std::array<size_t, 2> shape{ r.nout, r.nin };
+    ValuePtr weights = parameters->view((r.weights - base) / sizeof(T), shape);
+    ValuePtr bias = parameters->view((r.bias - base) / sizeof(T), std::span(shape).first(1));
+    layers.emplace_back(std::move(weights), std::move(bias), static_cast<Activation>(r.activation));
+  }
+  return BasicMLP(std::move(layers), std::move(parameters));
+}
+
+template bool BasicMLP<float>::save(const std::string &fileName) const;
+template bool BasicMLP<double>::save(const std::string &fileName) const;
+template std::optional<BasicMLP<float>> BasicMLP<float>::load(const std::string &fileName);
+template std::optional<BasicMLP<double>> BasicMLP<double>::load(const std::string &fileName);
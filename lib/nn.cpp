@@ -1,26 +1,56 @@
 #include "nn.h"
+#include "dataset.h"
 #include "engine.h"
+#include "kernels.h"
+#include "profiler.h"
+#include "thread_pool.h"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <format>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <ostream>
+#include <span>
 #include <utility>
 
 
-void Neuron::randomWeightsAndBias()
+template<class T> void BasicNeuron<T>::randomWeightsAndBias()
 {
   std::random_device r;
   std::mt19937 gen(r());
-  std::uniform_real_distribution<> dis(-1.0, 1.0);
-  auto g = [&dis, &gen]() { return std::make_shared<Value>(dis(gen)); };
+  std::uniform_real_distribution<T> dis(-1, 1);
+  auto g = [&dis, &gen]() { return std::make_shared<BasicValue<T>>(dis(gen)); };
   std::generate(_weights.begin(), _weights.end(), g);
-  _bias = std::make_shared<Value>(dis(gen));
+  _bias = std::make_shared<BasicValue<T>>(dis(gen));
 }
 
-Neuron::Neuron(size_t nin, ActFun act) : _weights(nin), act(std::move(act)) { randomWeightsAndBias(); }
+template<class T>
+BasicNeuron<T>::BasicNeuron(size_t nin, BasicActFun<T> act) : _weights(nin), act(std::move(act))
+{
+  randomWeightsAndBias();
+}
+
+template<class T> BasicValuePtr<T> BasicNeuron<T>::apply(const std::vector<ValuePtr> &xs) const
+{
+  ValuePtr d = dot(xs, _weights);
+  ValuePtr z = d + _bias;
+  ValuePtr y = act(z);
+  if (!_label.empty()) {
+    for (const auto &v : { d, z, y }) { v->setLabel(_label); }
+  }
+  return y;
+}
 
-std::ostream &operator<<(std::ostream &os, const Neuron &n)
+template<class T> std::ostream &operator<<(std::ostream &os, const BasicNeuron<T> &n)
 {
   os << "Neuron([";
-  for (int i = 0; i < n._weights.size(); i++) {
+  for (size_t i = 0; i < n._weights.size(); i++) {
     os << n._weights[i]->data();
     if (i < n._weights.size() - 1) { os << ", "; }
   }
@@ -28,31 +58,202 @@ std::ostream &operator<<(std::ostream &os, const Neuron &n)
   return os;
 }
 
-Layer::Layer(size_t nin, size_t nout, const ActFun &act)
+template<class T> void BasicLayer<T>::randomize(std::mt19937 &gen)
+{
+  std::uniform_real_distribution<T> dis(-1, 1);
+  auto g = [&dis, &gen]() { return dis(gen); };
+  std::ranges::generate(_weights->values(), g);
+  std::ranges::generate(_bias->values(), g);
+}
+
+template<class T> BasicActFun<T> activationFunction(Activation activation)
+{
+  switch (activation) {
+  case Activation::TANH:
+    return [](const BasicValuePtr<T> &x) { return tanh(x); };
+  case Activation::RELU:
+    return [](const BasicValuePtr<T> &x) { return relu(x); };
+  default:
+    return [](const BasicValuePtr<T> &x) { return x; };
+  }
+}
+
+template<class T>
+BasicLayer<T>::BasicLayer(size_t nin, size_t nout, Activation activation)
+  : _weights(BasicValue<T>::makeTensor({ nout, nin })), _bias(BasicValue<T>::makeTensor({ nout })),
+    act(activationFunction<T>(activation)), _activation(activation)
+{
+  std::random_device r;
+  std::mt19937 gen(r());
+  randomize(gen);
+}
+
+template<class T>
+BasicLayer<T>::BasicLayer(size_t nin, size_t nout, const BasicActFun<T> &act) : BasicLayer(nin, nout, Activation::CUSTOM)
+{
+  this->act = act;
+}
+
+template<class T>
+BasicLayer<T>::BasicLayer(ValuePtr weights, ValuePtr bias, Activation activation)
+  : _weights(std::move(weights)), _bias(std::move(bias)), act(activationFunction<T>(activation)),
+    _activation(activation)
 {
-  for (int i = 0; i < nout; i++) { _neurons.emplace_back(nin, act); }
+  assert(_weights->shape().size() == 2 && _bias->shape().size() == 1 && _bias->shape()[0] == nout());
 }
 
-std::ostream &operator<<(std::ostream &os, const Layer &l)
+template<class T>
+BasicLayer<T>::BasicLayer(ValuePtr weights, ValuePtr bias, const BasicActFun<T> &act)
+  : BasicLayer(std::move(weights), std::move(bias), Activation::CUSTOM)
 {
+  this->act = act;
+}
+
+template<class T> void BasicLayer<T>::predict(std::span<const T> x, std::span<T> out) const
+{
+  const size_t rows = x.size() / nin();
+  assert(x.size() == rows * nin() && out.size() == rows * nout());
+  kernels::matmulT(x.data(), _weights->values().data(), out.data(), rows, nout(), nin());
+  const T *b = _bias->values().data();
+  for (size_t r = 0; r < rows; r++) { kernels::add(out.data() + r * nout(), b, out.data() + r * nout(), nout()); }
+  switch (_activation) {
+  case Activation::TANH:
+    kernels::tanh(out.data(), out.data(), out.size());
+    break;
+  case Activation::RELU:
+    kernels::relu(out.data(), out.data(), out.size());
+    break;
+  case Activation::LINEAR:
+    break;
+  case Activation::CUSTOM: {
+    NoGradGuard guard;
+    for (size_t r = 0; r < rows; r++) {
+      auto row = out.subspan(r * nout(), nout());
+      auto y = act(BasicValue<T>::makeTensor({ nout() }, row));
+      std::ranges::copy(y->values(), row.begin());
+    }
+    break;
+  }
+  }
+}
+
+template<class T> std::ostream &operator<<(std::ostream &os, const BasicLayer<T> &l)
+{
+  auto w = l._weights->values();
+  auto b = l._bias->values();
   os << "Layer([";
-  for (int i = 0; i < l._neurons.size(); i++) {
-    os << l._neurons[i];
-    if (i < l._neurons.size() - 1) { os << ", "; }
+  for (size_t i = 0; i < l.nout(); i++) {
+    os << "Neuron([";
+    for (size_t j = 0; j < l.nin(); j++) {
+      os << w[i * l.nin() + j];
+      if (j < l.nin() - 1) { os << ", "; }
+    }
+    os << "], " << b[i] << ")";
+    if (i < l.nout() - 1) { os << ", "; }
   }
   os << "])";
   return os;
 }
 
-MLP::MLP(const std::vector<size_t> &sizes, const ActFun &act)
+template<class T>
+template<typename MakeLayer>
+void BasicMLP<T>::build(const std::vector<size_t> &sizes, MakeLayer makeLayer, std::mt19937 &gen)
+{
+  using Buffer = BasicParameterBuffer<T>;
+  std::vector<size_t> offsets;
+  size_t end = 0;
+  for (size_t i = 0; i + 1 < sizes.size(); i++) {
+    offsets.push_back(Buffer::align(end));
+    offsets.push_back(Buffer::align(offsets.back() + sizes[i] * sizes[i + 1]));
+    end = offsets.back() + sizes[i + 1];
+  }
+  _parameters = std::make_shared<Buffer>(end);
+  for (size_t i = 0; i + 1 < sizes.size(); i++) {
+    const std::array<size_t, 2> shape{ sizes[i + 1], sizes[i] };
+    auto weights = _parameters->view(offsets[2 * i], shape);
+    auto bias = _parameters->view(offsets[2 * i + 1], std::span(shape).first(1));
+    _layers.push_back(makeLayer(std::move(weights), std::move(bias)));
+  }
+  labelLayers();
+  randomize(gen);
+}
+
+template<class T> void BasicMLP<T>::labelLayers()
+{
+  for (size_t i = 0; i < _layers.size(); i++) { _layers[i].setLabel(std::format("layer {}", i)); }
+}
+
+template<class T> BasicMLP<T>::BasicMLP(const std::vector<size_t> &sizes, Activation activation)
+{
+  std::random_device r;
+  std::mt19937 gen(r());
+  build(sizes, [&](ValuePtr w, ValuePtr b) { return BasicLayer<T>(std::move(w), std::move(b), activation); }, gen);
+}
+
+template<class T> BasicMLP<T>::BasicMLP(const std::vector<size_t> &sizes, const BasicActFun<T> &act)
+{
+  std::random_device r;
+  std::mt19937 gen(r());
+  build(sizes, [&](ValuePtr w, ValuePtr b) { return BasicLayer<T>(std::move(w), std::move(b), act); }, gen);
+}
+
+template<class T> BasicMLP<T>::BasicMLP(const std::vector<size_t> &sizes, std::mt19937 &gen, Activation activation)
+{
+  build(sizes, [&](ValuePtr w, ValuePtr b) { return BasicLayer<T>(std::move(w), std::move(b), activation); }, gen);
+}
+
+template<class T>
+BasicMLP<T>::BasicMLP(const std::vector<size_t> &sizes, const BasicActFun<T> &act, std::mt19937 &gen)
 {
-  for (int i = 0; i < sizes.size() - 1; i++) { _layers.emplace_back(sizes[i], sizes[i + 1], act); }
+  build(sizes, [&](ValuePtr w, ValuePtr b) { return BasicLayer<T>(std::move(w), std::move(b), act); }, gen);
 }
 
-std::ostream &operator<<(std::ostream &os, const MLP &m)
+template<class T> std::vector<T> BasicMLP<T>::predict(std::span<const T> x) const
+{
+  std::vector<T> out(_layers.back().nout());
+  predictBatch(x, out);
+  return out;
+}
+
+template<class T>
+void BasicMLP<T>::predictBatch(std::span<const T> inputs, std::span<T> outputs, ThreadPool *pool) const
+{
+  // Rows per block: small enough for the activations of a block to stay in cache between layers.
+  constexpr size_t block = 64;
+  const size_t nin = _layers.front().nin();
+  const size_t nout = _layers.back().nout();
+  const size_t rows = inputs.size() / nin;
+  assert(inputs.size() == rows * nin && outputs.size() == rows * nout);
+  auto run = [&](size_t b) {
+    const size_t first = b * block;
+    const size_t count = std::min(block, rows - first);
+    // Hidden activations alternate between two per-thread buffers; the last layer writes straight into outputs.
+    thread_local std::vector<T> even;
+    thread_local std::vector<T> odd;
+    std::span<const T> src = inputs.subspan(first * nin, count * nin);
+    for (size_t i = 0; i < _layers.size(); i++) {
+      std::span<T> dst = outputs.subspan(first * nout, count * nout);
+      if (i + 1 < _layers.size()) {
+        auto &buffer = i % 2 == 0 ? even : odd;
+        buffer.resize(count * _layers[i].nout());
+        dst = buffer;
+      }
+      _layers[i].predict(src, dst);
+      src = dst;
+    }
+  };
+  const size_t blocks = (rows + block - 1) / block;
+  if (pool != nullptr && blocks > 1) {
+    pool->parallelFor(blocks, run);
+  } else {
+    for (size_t b = 0; b < blocks; b++) { run(b); }
+  }
+}
+
+template<class T> std::ostream &operator<<(std::ostream &os, const BasicMLP<T> &m)
 {
   os << "MLP([";
-  for (int i = 0; i < m._layers.size(); i++) {
+  for (size_t i = 0; i < m._layers.size(); i++) {
     os << m._layers[i];
     if (i < m._layers.size() - 1) { os << ", "; }
   }
@@ -60,24 +261,27 @@ std::ostream &operator<<(std::ostream &os, const MLP &m)
   return os;
 }
 
-std::vector<ValuePtr> Neuron::parameters() const
+template<class T> std::vector<BasicValuePtr<T>> BasicNeuron<T>::parameters() const
 {
   std::vector<ValuePtr> p = _weights;
   p.push_back(_bias);
   return p;
 }
 
-std::vector<ValuePtr> Layer::parameters() const
+template<class T> BasicValuePtr<T> BasicLayer<T>::operator()(const ValuePtr &x) const
 {
-  std::vector<ValuePtr> p;
-  for (const auto &n : _neurons) {
-    auto np = n.parameters();
-    p.insert(p.end(), np.begin(), np.end());
+  ValuePtr wx = matvec(_weights, x);
+  ValuePtr z = wx + _bias;
+  ValuePtr y = act(z);
+  if (!_label.empty()) {
+    for (const auto &v : { wx, z, y }) { v->setLabel(_label); }
   }
-  return p;
+  return y;
 }
 
-std::vector<ValuePtr> MLP::parameters() const
+template<class T> std::vector<BasicValuePtr<T>> BasicLayer<T>::parameters() const { return { _weights, _bias }; }
+
+template<class T> std::vector<BasicValuePtr<T>> BasicMLP<T>::parameters() const
 {
   std::vector<ValuePtr> p;
   for (const auto &l : _layers) {
@@ -87,32 +291,386 @@ std::vector<ValuePtr> MLP::parameters() const
   return p;
 }
 
-MLP gradientDescent(const std::vector<size_t> &hiddenLayerSizes,
+template<class T> BasicLayer<T> BasicLayer<T>::replica() const
+{
+  BasicLayer l = *this;
+  l._weights = BasicValue<T>::shareValues(_weights);
+  l._bias = BasicValue<T>::shareValues(_bias);
+  return l;
+}
+
+template<class T> BasicLayer<T> BasicLayer<T>::withParameters(ValuePtr weights, ValuePtr bias) const
+{
+  assert(std::ranges::equal(weights->shape(), _weights->shape()) && std::ranges::equal(bias->shape(), _bias->shape()));
+  BasicLayer l = *this;
+  l._weights = std::move(weights);
+  l._bias = std::move(bias);
+  return l;
+}
+
+namespace {
+// A run of layers as the function of a checkpoint node.
+template<class T> class LayerStack final : public CheckpointFunction<T>
+{
+private:
+  std::vector<BasicLayer<T>> _layers;
+
+public:
+  explicit LayerStack(std::vector<BasicLayer<T>> layers) : _layers(std::move(layers)) {}
+  BasicValuePtr<T> operator()(const BasicValuePtr<T> &x) const override
+  {
+    BasicValuePtr<T> y = x;
+    for (const auto &l : _layers) { y = l(y); }
+    return y;
+  }
+};
+} // namespace
+
+template<class T> void BasicMLP<T>::setCheckpointing(size_t layersPerSegment)
+{
+  _layersPerSegment = layersPerSegment;
+  _segments.clear();
+  if (layersPerSegment == 0) { return; }
+  for (size_t first = 0; first < _layers.size(); first += layersPerSegment) {
+    const size_t last = std::min(first + layersPerSegment, _layers.size());
+    std::vector<BasicLayer<T>> layers(_layers.begin() + first, _layers.begin() + last);
+    Segment s;
+    for (const auto &l : layers) {
+      auto p = l.parameters();
+      s.parameters.insert(s.parameters.end(), p.begin(), p.end());
+    }
+    s.function = std::make_shared<LayerStack<T>>(std::move(layers));
+    _segments.push_back(std::move(s));
+  }
+}
+
+template<class T> void BasicMLP<T>::randomize(std::mt19937 &gen)
+{
+  for (auto &l : _layers) { l.randomize(gen); }
+}
+
+template<class T> BasicMLP<T> BasicMLP<T>::replica() const
+{
+  // The replica's buffer shares the values and has gradients of its own, laid out like the original's.
+  auto buffer = std::make_shared<BasicParameterBuffer<T>>(_parameters->values(), _parameters);
+  const T *base = _parameters->values().data();
+  auto rebind = [&](const ValuePtr &p) {
+    return buffer->view(static_cast<size_t>(p->values().data() - base), p->shape());
+  };
+  std::vector<BasicLayer<T>> layers;
+  layers.reserve(_layers.size());
+  for (const auto &l : _layers) { layers.push_back(l.withParameters(rebind(l.weights()), rebind(l.bias()))); }
+  BasicMLP m(std::move(layers), std::move(buffer));
+  m.setCheckpointing(_layersPerSegment);
+  return m;
+}
+
+namespace {
+// Forward and backward over the samples returned by next() until it runs dry; the graph lives on tape and is
+// released before returning, the gradients of the samples are left in the parameters of mlp in place of the earlier
+// ones. Returns the loss of the samples, or nothing if there were none.
+template<class T, typename Next>
+std::optional<double> forwardBackward(BasicMLP<T> &mlp,
+  BasicTape<T> &tape,
   const std::vector<std::vector<double>> &inputs,
   const std::vector<double> &target,
-  double lr,
-  double tol,
-  int niter)
+  Next next)
+{
+  std::optional<double> l;
+  mlp.zeroGrad();
+  {
+    typename BasicTape<T>::Scope scope(tape);
+    std::vector<std::vector<BasicValuePtr<T>>> y;
+    for (auto idx = next(); idx.has_value(); idx = next()) { y.push_back(mlp(inputs[*idx])); }
+    if (!y.empty()) {
+      auto batchLoss = loss(target, y);
+      l = batchLoss->data();
+      tape.backward(batchLoss);
+    }
+  }
+  tape.clear();
+  return l;
+}
+
+// Yields the entries of samples in order.
+auto sequence(std::span<const size_t> samples)
+{
+  return [samples, i = size_t{ 0 }]() mutable -> std::optional<size_t> {
+    if (i == samples.size()) { return std::nullopt; }
+    return samples[i++];
+  };
+}
+
+// Layers per checkpointed segment that minimize the activations kept alive: depth / n boundaries plus n layers.
+size_t sqrtDepth(size_t depth) { return std::max<size_t>(1, std::lround(std::sqrt(static_cast<double>(depth)))); }
+
+template<class T> std::unique_ptr<BasicOptimizer<T>> makeOptimizer(const BasicMLP<T> &mlp, const TrainOptions &options)
+{
+  return makeOptimizer<T>(mlp.parameterBuffer(),
+    OptimizerOptions{
+      .type = options.optimizer, .lr = options.lr, .momentum = options.momentum, .weightDecay = options.weightDecay });
+}
+
+// The loss graph of a batch of fixed size, captured once and replayed for every batch of that size.
+template<class T> struct BatchPlan
+{
+  std::vector<BasicValuePtr<T>> inputs;
+  BasicPlan<T> plan;
+};
+
+template<class T>
+BatchPlan<T> captureBatch(BasicMLP<T> &mlp, size_t batchSize, size_t nin, const std::vector<double> &target)
+{
+  std::vector<BasicValuePtr<T>> inputs;
+  std::vector<std::vector<BasicValuePtr<T>>> y;
+  for (size_t i = 0; i < batchSize; i++) {
+    inputs.push_back(BasicValue<T>::makeTensor({ nin }));
+    inputs.back()->setRequiresGrad(false);
+    y.push_back(unstack(mlp(inputs.back())));
+  }
+  return { std::move(inputs), BasicPlan<T>(loss(target, y)) };
+}
+
+// Forward and backward over batch on a captured plan; the gradients are added to the parameters. Returns the loss.
+template<class T>
+double replay(BatchPlan<T> &b, const std::vector<std::vector<double>> &inputs, std::span<const size_t> batch)
+{
+  for (size_t i = 0; i < batch.size(); i++) { std::ranges::copy(inputs[batch[i]], b.inputs[i]->values().begin()); }
+  b.plan.forward();
+  b.plan.backward();
+  return b.plan.root()->data();
+}
+
+// The loss graph of a batch of rows with a target each, whose input and target leaves are refilled for every batch.
+template<class T> struct RowPlan
+{
+  std::vector<BasicValuePtr<T>> inputs;
+  std::vector<BasicValuePtr<T>> targets;
+  BasicPlan<T> plan;
+};
+
+template<class T> RowPlan<T> captureRows(BasicMLP<T> &mlp, size_t rows, size_t nin, size_t nout)
+{
+  std::vector<BasicValuePtr<T>> inputs;
+  std::vector<BasicValuePtr<T>> targets;
+  std::vector<std::vector<BasicValuePtr<T>>> t;
+  std::vector<std::vector<BasicValuePtr<T>>> y;
+  for (size_t i = 0; i < rows; i++) {
+    inputs.push_back(BasicValue<T>::makeTensor({ nin }));
+    targets.push_back(BasicValue<T>::makeTensor({ nout }));
+    inputs.back()->setRequiresGrad(false);
+    targets.back()->setRequiresGrad(false);
+    t.push_back(unstack(targets.back()));
+    y.push_back(unstack(mlp(inputs.back())));
+  }
+  return { std::move(inputs), std::move(targets), BasicPlan<T>(loss(t, y)) };
+}
+
+template<class T> double replay(RowPlan<T> &p, const Batch &batch)
+{
+  const size_t nin = p.inputs[0]->size();
+  const size_t nout = p.targets[0]->size();
+  for (size_t i = 0; i < batch.rows; i++) {
+    std::copy_n(batch.inputs.begin() + i * nin, nin, p.inputs[i]->values().begin());
+    std::copy_n(batch.targets.begin() + i * nout, nout, p.targets[i]->values().begin());
+  }
+  p.plan.forward();
+  p.plan.backward();
+  return p.plan.root()->data();
+}
+
+// Per-thread state of data-parallel training: a replica of the model with private gradients and a tape of its own.
+template<class T> struct Worker
+{
+  BasicMLP<T> model;
+  BasicTape<T> tape;
+  explicit Worker(const BasicMLP<T> &mlp) : model(mlp.replica()) {}
+};
+
+// Both buffers have the same layout, so the gradients of all parameters are summed in one pass.
+template<class T> void addGradients(const BasicParameterBuffer<T> &from, const BasicParameterBuffer<T> &to)
+{
+  kernels::axpy(T(1), from.grads().data(), to.grads().data(), to.size());
+}
+
+// Splits batch across the workers and adds the summed gradient to params. Returns the loss of the batch.
+template<class T>
+double parallelForwardBackward(ThreadPool &pool,
+  std::vector<std::unique_ptr<Worker<T>>> &workers,
+  const BasicParameterBuffer<T> &params,
+  const std::vector<std::vector<double>> &inputs,
+  std::span<const size_t> batch,
+  const std::vector<double> &target,
+  bool deterministic)
+{
+  const size_t n = workers.size();
+  double l = 0;
+  if (deterministic) {
+    std::vector<std::optional<double>> losses(n);
+    pool.parallelFor(n, [&](size_t w) {
+      auto chunk = batch.subspan(batch.size() * w / n, batch.size() * (w + 1) / n - batch.size() * w / n);
+      losses[w] = forwardBackward(workers[w]->model, workers[w]->tape, inputs, target, sequence(chunk));
+    });
+    for (size_t w = 0; w < n; w++) {
+      if (!losses[w].has_value()) { continue; }
+      l += *losses[w];
+      addGradients(*workers[w]->model.parameterBuffer(), params);
+    }
+  } else {
+    std::atomic<size_t> next{ 0 };
+    std::mutex reduce;
+    pool.parallelFor(n, [&](size_t w) {
+      auto take = [&]() -> std::optional<size_t> {
+        size_t i = next.fetch_add(1);
+        if (i >= batch.size()) { return std::nullopt; }
+        return batch[i];
+      };
+      auto wl = forwardBackward(workers[w]->model, workers[w]->tape, inputs, target, take);
+      if (!wl.has_value()) { return; }
+      std::lock_guard lock(reduce);
+      l += *wl;
+      addGradients(*workers[w]->model.parameterBuffer(), params);
+    });
+  }
+  return l;
+}
+} // namespace
+
+template<class T>
+BasicMLP<T> gradientDescent(const std::vector<size_t> &hiddenLayerSizes,
+  const std::vector<std::vector<double>> &inputs,
+  const std::vector<double> &target,
+  const TrainOptions &options)
 {
   std::vector<size_t> sizes = hiddenLayerSizes;
   sizes.insert(sizes.begin(), inputs[0].size());
   sizes.push_back(target.size());
-  MLP mlp(sizes);
-  auto params = mlp.parameters();
-
-  for (int i = 0; i < niter; i++) {
-    std::vector<std::vector<ValuePtr>> y;
-    y.reserve(inputs.size());
-    for (const auto &x : inputs) { y.push_back(mlp(x)); }
-    auto l = loss(target, y);
-    std::cout << "loss: " << l->data() << std::endl;
-    if (l->data() < tol) {
-      std::cout << "tolerance reached" << std::endl;
+  std::mt19937 gen(options.seed != 0 ? options.seed : std::random_device{}());
+  BasicMLP<T> mlp(sizes, gen);
+  if (options.checkpoint) { mlp.setCheckpointing(sqrtDepth(mlp.depth())); }
+  auto optimizer = makeOptimizer(mlp, options);
+  const auto &parameters = *mlp.parameterBuffer();
+
+  const size_t threads = options.threads == 0 ? std::thread::hardware_concurrency() : options.threads;
+  std::unique_ptr<ThreadPool> pool;
+  std::vector<std::unique_ptr<Worker<T>>> workers;
+  if (threads > 1) {
+    pool = std::make_unique<ThreadPool>(threads);
+    for (size_t w = 0; w < threads; w++) { workers.push_back(std::make_unique<Worker<T>>(mlp)); }
+  }
+
+  const size_t batchSize = options.batchSize == 0 ? inputs.size() : std::min(options.batchSize, inputs.size());
+  std::vector<size_t> order(inputs.size());
+  std::iota(order.begin(), order.end(), 0);
+  const size_t microBatchSize = options.microBatchSize == 0 ? batchSize : std::min(options.microBatchSize, batchSize);
+  // Serial training replays one captured graph per micro-batch size: the full one and those of shorter last
+  // micro-batches of a batch and of the last batch.
+  std::map<size_t, BatchPlan<T>> plans;
+
+  for (int i = 0; i < options.niter; i++) {
+    MICROGRAD_PROFILE_SCOPE("iteration");
+    if (batchSize < inputs.size()) { std::ranges::shuffle(order, gen); }
+    double l = 0;
+    for (size_t start = 0; start < order.size(); start += batchSize) {
+      MICROGRAD_PROFILE_SCOPE("batch");
+      std::span<const size_t> batch(order.begin() + start, std::min(batchSize, order.size() - start));
+      optimizer->zeroGrad();
+      if (pool) {
+        l += parallelForwardBackward(*pool, workers, parameters, inputs, batch, target, options.deterministic);
+      } else {
+        for (size_t m = 0; m < batch.size(); m += microBatchSize) {
+          auto micro = batch.subspan(m, std::min(microBatchSize, batch.size() - m));
+          auto plan = plans.find(micro.size());
+          if (plan == plans.end()) {
+            plan = plans.emplace(micro.size(), captureBatch(mlp, micro.size(), inputs[0].size(), target)).first;
+          }
+          l += replay(plan->second, inputs, micro);
+        }
+      }
+      optimizer->step();
+    }
+    if (options.verbose) { std::cout << "loss: " << l << std::endl; }
+    if (l < options.tol) {
+      if (options.verbose) { std::cout << "tolerance reached" << std::endl; }
       break;
     }
-    l->backward();
-    for (auto &p : params) { p->_data -= lr * p->grad(); }
   }
 
   return mlp;
-}
\ No newline at end of file
+}
+
+template<class T>
+BasicMLP<T> gradientDescent(const std::vector<size_t> &hiddenLayerSizes, Dataset &data, const TrainOptions &options)
+{
+  std::vector<size_t> sizes = hiddenLayerSizes;
+  sizes.insert(sizes.begin(), data.nin());
+  sizes.push_back(data.nout());
+  std::mt19937 gen(options.seed != 0 ? options.seed : std::random_device{}());
+  BasicMLP<T> mlp(sizes, gen);
+  if (options.checkpoint) { mlp.setCheckpointing(sqrtDepth(mlp.depth())); }
+  auto optimizer = makeOptimizer(mlp, options);
+
+  const size_t batchSize = options.batchSize == 0 ? 256 : options.batchSize;
+  std::optional<RowPlan<T>> fullBatch;
+  std::optional<RowPlan<T>> lastBatch;
+  Batch batch;
+  for (int i = 0; i < options.niter; i++) {
+    MICROGRAD_PROFILE_SCOPE("iteration");
+    double l = 0;
+    Prefetcher prefetch(data, batchSize);
+    while (prefetch.next(batch)) {
+      MICROGRAD_PROFILE_SCOPE("batch");
+      auto &plan = batch.rows == batchSize ? fullBatch : lastBatch;
+      if (!plan || plan->inputs.size() != batch.rows) { plan = captureRows(mlp, batch.rows, data.nin(), data.nout()); }
+      optimizer->zeroGrad();
+      l += replay(*plan, batch);
+      optimizer->step();
+    }
+    if (options.verbose) { std::cout << "loss: " << l << std::endl; }
+    if (l < options.tol) {
+      if (options.verbose) { std::cout << "tolerance reached" << std::endl; }
+      break;
+    }
+  }
+
+  return mlp;
+}
+
+MLP gradientDescent(const std::vector<size_t> &hiddenLayerSizes,
+  const std::vector<std::vector<double>> &inputs,
+  const std::vector<double> &target,
+  double lr,
+  double tol,
+  int niter)
+{
+  return gradientDescent(hiddenLayerSizes, inputs, target, TrainOptions{ .lr = lr, .tol = tol, .niter = niter });
+}
+
+template BasicActFun<float> activationFunction(Activation activation);
+template BasicActFun<double> activationFunction(Activation activation);
+template class BasicNeuron<float>;
+template class BasicNeuron<double>;
+template class BasicLayer<float>;
+template class BasicLayer<double>;
+template class BasicMLP<float>;
+template class BasicMLP<double>;
+template std::ostream &operator<<(std::ostream &os, const BasicNeuron<float> &n);
+template std::ostream &operator<<(std::ostream &os, const BasicNeuron<double> &n);
+template std::ostream &operator<<(std::ostream &os, const BasicLayer<float> &l);
+template std::ostream &operator<<(std::ostream &os, const BasicLayer<double> &l);
+template std::ostream &operator<<(std::ostream &os, const BasicMLP<float> &m);
+template std::ostream &operator<<(std::ostream &os, const BasicMLP<double> &m);
+template BasicMLP<float> gradientDescent(const std::vector<size_t> &hiddenLayerSizes,
+  const std::vector<std::vector<double>> &inputs,
+  const std::vector<double> &target,
+  const TrainOptions &options);
+template BasicMLP<double> gradientDescent(const std::vector<size_t> &hiddenLayerSizes,
+  const std::vector<std::vector<double>> &inputs,
+  const std::vector<double> &target,
+  const TrainOptions &options);
+template BasicMLP<float> gradientDescent(const std::vector<size_t> &hiddenLayerSizes,
+  Dataset &data,
+  const TrainOptions &options);
+template BasicMLP<double> gradientDescent(const std::vector<size_t> &hiddenLayerSizes,
+  Dataset &data,
+  const TrainOptions &options);
@@ -0,0 +1,109 @@
+#include "optim.h"
+#include "kernels.h"
+#include "profiler.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <new>
+
+template<class T> void BasicParameterBuffer<T>::Free::operator()(T *p) const
+{
+  ::operator delete[](p, std::align_val_t{ 64 });
+}
+
+template<class T> BasicParameterBuffer<T>::BasicParameterBuffer(size_t size)
+{
+  // Values and gradients share one allocation, the gradients starting at the next multiple of 64 bytes.
+  const size_t stride = align(size);
+  _storage.reset(static_cast<T *>(::operator new[](2 * stride * sizeof(T), std::align_val_t{ 64 })));
+  std::fill_n(_storage.get(), 2 * stride, T(0));
+  MICROGRAD_PROFILE_BYTES(2 * stride * sizeof(T));
+  _values = { _storage.get(), size };
+  _grads = { _storage.get() + stride, size };
+}
+
+template<class T>
+BasicParameterBuffer<T>::BasicParameterBuffer(std::span<T> values,
+  std::shared_ptr<const void> owner,
+  std::span<T> grads)
+  : _values(values), _grads(grads), _owner(std::move(owner))
+{
+  if (!_grads.empty()) {
+    assert(_grads.size() == _values.size());
+    return;
+  }
+  _storage.reset(static_cast<T *>(::operator new[](values.size() * sizeof(T), std::align_val_t{ 64 })));
+  std::fill_n(_storage.get(), values.size(), T(0));
+  MICROGRAD_PROFILE_BYTES(values.size() * sizeof(T));
+  _grads = { _storage.get(), values.size() };
+}
+
+template<class T> void BasicParameterBuffer<T>::zeroGrad() const { std::ranges::fill(_grads, T(0)); }
+
+template<class T> BasicValuePtr<T> BasicParameterBuffer<T>::view(size_t offset, std::span<const size_t> shape)
+{
+  auto out =
+    BasicValue<T>::makeTensorView(shape, _values.data() + offset, _grads.data() + offset, this->shared_from_this());
+  assert(offset + out->size() <= size());
+  return out;
+}
+
+template<class T>
+BasicSgd<T>::BasicSgd(std::shared_ptr<BasicParameterBuffer<T>> parameters, const OptimizerOptions &options)
+  : BasicOptimizer<T>(std::move(parameters), options),
+    _velocity(options.momentum != 0 ? this->_parameters->size() : 0)
+{}
+
+template<class T> void BasicSgd<T>::step()
+{
+  MICROGRAD_PROFILE_SCOPE("update");
+  const auto &o = this->_options;
+  const kernels::SgdStep<T> p{ static_cast<T>(o.lr), static_cast<T>(o.momentum), static_cast<T>(o.weightDecay) };
+  auto &b = *this->_parameters;
+  kernels::sgd(p, b.grads().data(), _velocity.empty() ? nullptr : _velocity.data(), b.values().data(), b.size());
+}
+
+template<class T>
+BasicAdam<T>::BasicAdam(std::shared_ptr<BasicParameterBuffer<T>> parameters, const OptimizerOptions &options)
+  : BasicOptimizer<T>(std::move(parameters), options), _m(this->_parameters->size()), _v(this->_parameters->size())
+{}
+
+template<class T> void BasicAdam<T>::step()
+{
+  MICROGRAD_PROFILE_SCOPE("update");
+  const auto &o = this->_options;
+  _t++;
+  // The bias corrections of both moments are folded into the step size and a scale of the second moment, so the
+  // pass over the arrays does not depend on t.
+  const double c1 = 1 - std::pow(o.beta1, static_cast<double>(_t));
+  const double c2 = 1 - std::pow(o.beta2, static_cast<double>(_t));
+  const bool decoupled = o.type == OptimizerType::ADAMW;
+  const kernels::AdamStep<T> p{ static_cast<T>(o.lr / c1),
+    static_cast<T>(o.beta1),
+    static_cast<T>(o.beta2),
+    static_cast<T>(1 / c2),
+    static_cast<T>(o.eps),
+    static_cast<T>(decoupled ? 0 : o.weightDecay),
+    static_cast<T>(decoupled ? o.lr * o.weightDecay : 0) };
+  auto &b = *this->_parameters;
+  kernels::adam(p, b.grads().data(), _m.data(), _v.data(), b.values().data(), b.size());
+}
+
+template<class T>
+std::unique_ptr<BasicOptimizer<T>> makeOptimizer(std::shared_ptr<BasicParameterBuffer<T>> parameters,
+  const OptimizerOptions &options)
+{
+  if (options.type == OptimizerType::SGD) { return std::make_unique<BasicSgd<T>>(std::move(parameters), options); }
+  return std::make_unique<BasicAdam<T>>(std::move(parameters), options);
+}
+
+template class BasicParameterBuffer<float>;
+template class BasicParameterBuffer<double>;
+template class BasicSgd<float>;
+template class BasicSgd<double>;
+template class BasicAdam<float>;
+template class BasicAdam<double>;
+template std::unique_ptr<BasicOptimizer<float>> makeOptimizer(std::shared_ptr<BasicParameterBuffer<float>> parameters,
+  const OptimizerOptions &options);
+template std::unique_ptr<BasicOptimizer<double>> makeOptimizer(std::shared_ptr<BasicParameterBuffer<double>> parameters,
+  const OptimizerOptions &options);
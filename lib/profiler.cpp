@@ -0,0 +1,135 @@
+#include "profiler.h"
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+namespace {
+struct AtomicOpCounters
+{
+  std::atomic<std::uint64_t> created{};
+  std::atomic<std::uint64_t> backwardSteps{};
+  std::atomic<std::uint64_t> backwardNs{};
+};
+
+std::array<AtomicOpCounters, OPTYPE_COUNT> opCounters;
+std::atomic<std::uint64_t> bytesAllocated{};
+std::atomic<std::uint64_t> topoSorts{};
+std::atomic<std::uint64_t> topoNs{};
+
+struct Span
+{
+  const char *name;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point end;
+  std::uint32_t thread;
+};
+
+std::mutex traceMutex;
+std::vector<Span> trace;
+// Trace timestamps are relative to the start of the program, when this is initialized.
+const auto origin = std::chrono::steady_clock::now();
+
+// Small sequential thread ids read better in trace viewers than hashed std::thread::ids.
+std::uint32_t threadId()
+{
+  static std::atomic<std::uint32_t> next{ 0 };
+  thread_local const std::uint32_t id = next++;
+  return id;
+}
+
+double micros(std::chrono::steady_clock::duration d) { return std::chrono::duration<double, std::micro>(d).count(); }
+} // namespace
+
+namespace profiler {
+Counters counters()
+{
+  Counters c;
+  for (size_t i = 0; i < OPTYPE_COUNT; i++) {
+    c.ops[i].created = opCounters[i].created.load(std::memory_order_relaxed);
+    c.ops[i].backwardSteps = opCounters[i].backwardSteps.load(std::memory_order_relaxed);
+    c.ops[i].backwardNs = opCounters[i].backwardNs.load(std::memory_order_relaxed);
+  }
+  c.bytesAllocated = bytesAllocated.load(std::memory_order_relaxed);
+  c.topoSorts = topoSorts.load(std::memory_order_relaxed);
+  c.topoNs = topoNs.load(std::memory_order_relaxed);
+  return c;
+}
+
+void reset()
+{
+  for (auto &op : opCounters) {
+    op.created = 0;
+    op.backwardSteps = 0;
+    op.backwardNs = 0;
+  }
+  bytesAllocated = 0;
+  topoSorts = 0;
+  topoNs = 0;
+  std::lock_guard lock(traceMutex);
+  trace.clear();
+}
+
+void print(std::ostream &os)
+{
+  const Counters c = counters();
+  os << std::format("{:<10} {:>12} {:>14} {:>14}\n", "op", "created", "backward", "backward ms");
+  for (size_t i = 0; i < OPTYPE_COUNT; i++) {
+    const auto &op = c.ops[i];
+    if (op.created == 0 && op.backwardSteps == 0) { continue; }
+    os << std::format("{:<10} {:>12} {:>14} {:>14.3f}\n",
+      opToString(static_cast<OpType>(i)),
+      op.created,
+      op.backwardSteps,
+      static_cast<double>(op.backwardNs) / 1e6);
+  }
+  os << std::format("bytes allocated: {}\ntopological sorts: {} in {:.3f} ms\n",
+    c.bytesAllocated,
+    c.topoSorts,
+    static_cast<double>(c.topoNs) / 1e6);
+}
+
+bool writeChromeTrace(const std::string &fileName)
+{
+  std::ofstream file(fileName);
+  if (!file) { return false; }
+  std::lock_guard lock(traceMutex);
+  // Complete events ("ph": "X") carry their duration, so nesting is recovered from the timestamps.
+  file << "{\"traceEvents\":[";
+  for (size_t i = 0; i < trace.size(); i++) {
+    const auto &s = trace[i];
+    file << std::format("{}\n{{\"name\":\"{}\",\"cat\":\"micrograd\",\"ph\":\"X\",\"ts\":{:.3f},\"dur\":{:.3f},"
+                        "\"pid\":1,\"tid\":{}}}",
+      i == 0 ? "" : ",",
+      s.name,
+      micros(s.start - origin),
+      micros(s.end - s.start),
+      s.thread);
+  }
+  file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  return static_cast<bool>(file);
+}
+
+void countNode(OpType op) { opCounters[op].created.fetch_add(1, std::memory_order_relaxed); }
+
+void countBytes(std::uint64_t bytes) { bytesAllocated.fetch_add(bytes, std::memory_order_relaxed); }
+
+void addTopo(std::uint64_t ns)
+{
+  topoSorts.fetch_add(1, std::memory_order_relaxed);
+  topoNs.fetch_add(ns, std::memory_order_relaxed);
+}
+
+void addBackward(OpType op, std::uint64_t ns)
+{
+  opCounters[op].backwardSteps.fetch_add(1, std::memory_order_relaxed);
+  opCounters[op].backwardNs.fetch_add(ns, std::memory_order_relaxed);
+}
+
+void addSpan(const char *name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+  const std::uint32_t thread = threadId();
+  std::lock_guard lock(traceMutex);
+  trace.push_back({ name, start, end, thread });
+}
+} // namespace profiler
@@ -0,0 +1,84 @@
+#include "thread_pool.h"
+#include <algorithm>
+#include <utility>
+
+namespace {
+thread_local const ThreadPool *insideJob = nullptr;
+}
+
+ThreadPool::ThreadPool(size_t threads)
+{
+  for (size_t i = 1; i < std::max<size_t>(threads, 1); i++) { _workers.emplace_back([this] { workerLoop(); }); }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard lock(_mutex);
+    _stop = true;
+  }
+  _wake.notify_all();
+  for (auto &w : _workers) { w.join(); }
+}
+
+void ThreadPool::runJob()
+{
+  const ThreadPool *outer = insideJob;
+  insideJob = this;
+  std::unique_lock lock(_mutex);
+  while (_next < _jobSize) {
+    size_t i = _next++;
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+      (*_job)(i);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    lock.lock();
+    if (error != nullptr) {
+      if (_error == nullptr) { _error = error; }
+      _next = _jobSize;
+    }
+  }
+  insideJob = outer;
+}
+
+void ThreadPool::workerLoop()
+{
+  std::uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock lock(_mutex);
+      _wake.wait(lock, [&] { return _stop || _generation != seen; });
+      if (_stop) { return; }
+      seen = _generation;
+    }
+    runJob();
+    std::lock_guard lock(_mutex);
+    if (--_running == 0) { _done.notify_one(); }
+  }
+}
+
+void ThreadPool::parallelFor(size_t n, const std::function<void(size_t)> &f)
+{
+  if (insideJob == this || _workers.empty() || n <= 1) {
+    for (size_t i = 0; i < n; i++) { f(i); }
+    return;
+  }
+  std::lock_guard turn(_callers);
+  {
+    std::lock_guard lock(_mutex);
+    _job = &f;
+    _jobSize = n;
+    _next = 0;
+    _running = _workers.size();
+    _generation++;
+  }
+  _wake.notify_all();
+  runJob();
+  std::unique_lock lock(_mutex);
+  _done.wait(lock, [&] { return _running == 0; });
+  _job = nullptr;
+  if (_error != nullptr) { std::rethrow_exception(std::exchange(_error, nullptr)); }
+}
@@ -11,8 +11,7 @@ int main()
   auto mlp = gradientDescent({ 4, 4 }, xs, ys, 0.1, 1e-6, 1000);
   for (auto &x : xs) {
     std::cout << "---\n";
-    auto out = mlp(x);
-    for (auto &v : out) { std::cout << v->data() << " "; }
+    for (auto v : mlp.predict(x)) { std::cout << v << " "; }
     std::cout << std::endl;
   }
   return 0;
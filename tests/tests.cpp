@@ -1,7 +1,22 @@
+#include "dataset.h"
+#include "dot.h"
 #include "engine.h"
+#include "expr.h"
+#include "kernels.h"
+#include "nn.h"
+#include "profiler.h"
+#include "thread_pool.h"
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_floating_point.hpp>
 #include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
 
 TEST_CASE("exp(a * b)")
 {
@@ -314,4 +329,1451 @@ TEST_CASE("relu(a) + relu(b)")
   REQUIRE(c->data() == 3);
   REQUIRE(a->grad() == 1);
   REQUIRE(b->grad() == 0);
-}
\ No newline at end of file
+}
+TEST_CASE("graph is released with its root")
+{
+  ValuePtr a = std::make_shared<Value>(3);
+  ValuePtr b = std::make_shared<Value>(4);
+  ValuePtr c = tanh(a * b + a);
+  std::weak_ptr<Value> inner = c;
+  c->backward();
+  c.reset();
+  REQUIRE(inner.expired());
+  REQUIRE(a.use_count() == 1);
+}
+
+TEST_CASE("tape backward")
+{
+  ValuePtr a = std::make_shared<Value>(3);
+  ValuePtr b = std::make_shared<Value>(4);
+  Tape tape;
+  for (int i = 0; i < 3; i++) {
+    a->zeroGrad();
+    b->zeroGrad();
+    {
+      Tape::Scope scope(tape);
+      ValuePtr c = exp(a * b) + pow(a, 2);
+      // The exponent is folded into its pow node.
+      REQUIRE(tape.size() == 4);
+      tape.backward(c);
+      REQUIRE(c->data() == std::exp(3 * 4) + 9);
+      REQUIRE(a->grad() == 4 * std::exp(3 * 4) + 6);
+      REQUIRE(b->grad() == 3 * std::exp(3 * 4));
+    }
+    tape.clear();
+    REQUIRE(tape.size() == 0);
+    REQUIRE(a.use_count() == 1);
+  }
+  REQUIRE(Tape::active() == nullptr);
+}
+
+TEST_CASE("deep chain")
+{
+  ValuePtr a = std::make_shared<Value>(1);
+  ValuePtr sum = std::make_shared<Value>(0);
+  for (int i = 0; i < 300000; i++) { sum += a; }
+  sum->backward();
+  REQUIRE(sum->data() == 300000);
+  REQUIRE(a->grad() == 300000);
+}
+
+TEST_CASE("cached topological order")
+{
+  ValuePtr a = std::make_shared<Value>(3);
+  ValuePtr b = std::make_shared<Value>(4);
+  ValuePtr c = a * b + a;
+  c->backward(true);
+  REQUIRE(a->grad() == 5);
+  REQUIRE(b->grad() == 3);
+  a->_data = 2;
+  a->zeroGrad();
+  b->zeroGrad();
+  c->backward(true);
+  REQUIRE(a->grad() == 5);
+  REQUIRE(b->grad() == 2);
+  a->zeroGrad();
+  b->zeroGrad();
+  c->backward();
+  REQUIRE(a->grad() == 5);
+  REQUIRE(b->grad() == 2);
+}
+
+TEST_CASE("matvec")
+{
+  ValuePtr W = Value::makeTensor({ 2, 3 }, std::vector<double>{ 1, 2, 3, 4, 5, 6 });
+  ValuePtr x = Value::makeTensor({ 3 }, std::vector<double>{ -1, 0.5, 2 });
+  ValuePtr y = matvec(W, x);
+  REQUIRE(y->shape().size() == 1);
+  REQUIRE(y->shape()[0] == 2);
+  REQUIRE(y->values()[0] == -1 + 1 + 6);
+  REQUIRE(y->values()[1] == -4 + 2.5 + 12);
+  ValuePtr l = element(y, 0) + 2 * element(y, 1);
+  l->backward();
+  REQUIRE(l->data() == 6 + 2 * 10.5);
+  REQUIRE(std::ranges::equal(W->grads(), std::vector<double>{ -1, 0.5, 2, -2, 1, 4 }));
+  REQUIRE(std::ranges::equal(x->grads(), std::vector<double>{ 9, 12, 15 }));
+}
+
+TEST_CASE("sum and dot")
+{
+  std::vector<ValuePtr> x = { std::make_shared<Value>(1.0), std::make_shared<Value>(-2.0), std::make_shared<Value>(3.0) };
+  std::vector<ValuePtr> w = { std::make_shared<Value>(0.5), std::make_shared<Value>(4.0), x[0] };
+  ValuePtr l = dot(x, w) * sum(x);
+  l->backward();
+  REQUIRE(l->data() == (0.5 - 8 + 3) * 2);
+  REQUIRE(x[0]->grad() == (0.5 + 3) * 2 + (0.5 - 8 + 3));
+  REQUIRE(x[1]->grad() == 4 * 2 + (0.5 - 8 + 3));
+  REQUIRE(x[2]->grad() == 1 * 2 + (0.5 - 8 + 3));
+  REQUIRE(w[1]->grad() == -2 * 2);
+}
+
+TEST_CASE("neuron is a single dot node")
+{
+  Neuron n(50);
+  Tape tape;
+  {
+    Tape::Scope scope(tape);
+    auto y = n(std::vector<double>(50, 0.5));
+    // 50 inputs, dot, bias add, tanh
+    REQUIRE(tape.size() == 50 + 3);
+  }
+  tape.clear();
+}
+
+TEST_CASE("tensor broadcast")
+{
+  ValuePtr t = Value::makeTensor({ 3 }, std::vector<double>{ 1, 2, 3 });
+  ValuePtr s = std::make_shared<Value>(2);
+  auto ys = unstack(tanh(t * s + t));
+  ValuePtr l = ys[0] + ys[1] + ys[2];
+  l->backward();
+  for (size_t i = 0; i < 3; i++) {
+    double y = std::tanh(3.0 * (i + 1));
+    REQUIRE_THAT(t->grads()[i], Catch::Matchers::WithinAbs(3 * (1 - y * y), 1e-12));
+  }
+  double sg = 0;
+  for (size_t i = 0; i < 3; i++) {
+    double y = std::tanh(3.0 * (i + 1));
+    sg += (i + 1) * (1 - y * y);
+  }
+  REQUIRE_THAT(s->grad(), Catch::Matchers::WithinAbs(sg, 1e-12));
+}
+
+TEST_CASE("tensor sub, div and neg match scalar graph")
+{
+  std::vector<double> a = { 1.5, -2, 3 };
+  std::vector<double> b = { 0.5, 4, -1.25 };
+  ValuePtr ta = Value::makeTensor({ 3 }, a);
+  ValuePtr tb = Value::makeTensor({ 3 }, b);
+  ValuePtr ts = std::make_shared<Value>(0.75);
+  ValuePtr tl = sum(unstack((ta - tb) / (tb - ts) + -ta / ts));
+  tl->backward();
+
+  std::vector<ValuePtr> sa;
+  std::vector<ValuePtr> sb;
+  std::vector<ValuePtr> terms;
+  ValuePtr ss = std::make_shared<Value>(0.75);
+  for (size_t i = 0; i < 3; i++) {
+    sa.push_back(std::make_shared<Value>(a[i]));
+    sb.push_back(std::make_shared<Value>(b[i]));
+    terms.push_back((sa[i] - sb[i]) / (sb[i] - ss) + -sa[i] / ss);
+  }
+  ValuePtr sl = sum(terms);
+  sl->backward();
+
+  REQUIRE_THAT(tl->data(), Catch::Matchers::WithinAbs(sl->data(), 1e-12));
+  for (size_t i = 0; i < 3; i++) {
+    REQUIRE_THAT(ta->grads()[i], Catch::Matchers::WithinAbs(sa[i]->grad(), 1e-12));
+    REQUIRE_THAT(tb->grads()[i], Catch::Matchers::WithinAbs(sb[i]->grad(), 1e-12));
+  }
+  REQUIRE_THAT(ts->grad(), Catch::Matchers::WithinAbs(ss->grad(), 1e-12));
+}
+
+TEST_CASE("sub, div and neg are single nodes")
+{
+  auto a = std::make_shared<Value>(3.0);
+  auto b = std::make_shared<Value>(4.0);
+  Tape tape;
+  {
+    Tape::Scope scope(tape);
+    auto c = -(a - b) / b;
+    REQUIRE(tape.size() == 3);
+    c->backward();
+    REQUIRE(c->data() == 0.25);
+    REQUIRE(a->grad() == -0.25);
+    REQUIRE(b->grad() == 0.25 - 0.25 / 4);
+  }
+  tape.clear();
+}
+
+TEST_CASE("scalar constants")
+{
+  SECTION("literals are stored in a single node")
+  {
+    // Each literal op against the same op on an ordinary leaf holding the literal.
+    using Op = std::function<ValuePtr(const ValuePtr &, const ValuePtr &)>;
+    const std::vector<std::pair<Op, Op>> ops = {
+      { [](auto &x, auto &) { return x + 2.5; }, [](auto &x, auto &c) { return x + c; } },
+      { [](auto &x, auto &) { return 2.5 + x; }, [](auto &x, auto &c) { return c + x; } },
+      { [](auto &x, auto &) { return x - 2.5; }, [](auto &x, auto &c) { return x - c; } },
+      { [](auto &x, auto &) { return 2.5 - x; }, [](auto &x, auto &c) { return c - x; } },
+      { [](auto &x, auto &) { return x * 2.5; }, [](auto &x, auto &c) { return x * c; } },
+      { [](auto &x, auto &) { return x / 2.5; }, [](auto &x, auto &c) { return x / c; } },
+      { [](auto &x, auto &) { return 2.5 / x; }, [](auto &x, auto &c) { return c / x; } },
+      { [](auto &x, auto &) { return pow(x, 2.5); }, [](auto &x, auto &c) { return pow(x, c); } },
+      { [](auto &x, auto &) { return pow(2.5, x); }, [](auto &x, auto &c) { return pow(c, x); } },
+    };
+    double maxError = 0;
+    for (const auto &[literal, general] : ops) {
+      auto x = std::make_shared<Value>(1.5);
+      auto y = std::make_shared<Value>(1.5);
+      auto c = std::make_shared<Value>(2.5);
+      Tape tape;
+      {
+        Tape::Scope scope(tape);
+        auto l = literal(x, nullptr);
+        REQUIRE(tape.size() == 1);
+        l->backward();
+        auto g = general(y, c);
+        g->backward();
+        maxError = std::max({ maxError, std::abs(l->data() - g->data()), std::abs(x->grad() - y->grad()) });
+      }
+      tape.clear();
+    }
+    REQUIRE(maxError < 1e-12);
+  }
+
+  SECTION("constant operands are folded")
+  {
+    auto x = std::make_shared<Value>(3.0);
+    auto c = Value::constant(2) * Value::constant(3) + 1;
+    REQUIRE(c->isConstant());
+    REQUIRE(c->data() == 7);
+    REQUIRE(exp(c)->isConstant());
+    auto y = x * c + Value::constant(1);
+    // Both constants are stored in the nodes using them, so only those two nodes and x are in the graph.
+    REQUIRE(Plan(y).size() == 3);
+    y->backward();
+    REQUIRE(y->data() == 22);
+    REQUIRE(x->grad() == 7);
+    REQUIRE(!y->isConstant());
+  }
+
+  SECTION("tensor literals match scalar graph")
+  {
+    std::vector<double> a = { 1.5, -2, 3 };
+    ValuePtr t = Value::makeTensor({ 3 }, a);
+    ValuePtr tl = sum(unstack((2 - t) * 0.5 + 1 / t - t / 4 + 3));
+    tl->backward();
+    std::vector<ValuePtr> s;
+    std::vector<ValuePtr> terms;
+    for (size_t i = 0; i < 3; i++) {
+      s.push_back(std::make_shared<Value>(a[i]));
+      terms.push_back((2 - s[i]) * 0.5 + 1 / s[i] - s[i] / 4 + 3);
+    }
+    ValuePtr sl = sum(terms);
+    sl->backward();
+    REQUIRE_THAT(tl->data(), Catch::Matchers::WithinAbs(sl->data(), 1e-12));
+    double maxError = 0;
+    for (size_t i = 0; i < 3; i++) { maxError = std::max(maxError, std::abs(t->grads()[i] - s[i]->grad())); }
+    REQUIRE(maxError < 1e-12);
+  }
+
+  SECTION("plan replay reads the stored constant")
+  {
+    auto x = std::make_shared<Value>(2.0);
+    Plan plan(pow(1 - x, 2) / 4);
+    x->_data = -1;
+    plan.forward();
+    plan.backward();
+    REQUIRE(plan.root()->data() == 1);
+    REQUIRE(x->grad() == -1);
+  }
+}
+
+TEST_CASE("requires grad")
+{
+  SECTION("propagates from operands")
+  {
+    auto w = std::make_shared<Value>(2.0);
+    auto x = std::make_shared<Value>(3.0);
+    x->setRequiresGrad(false);
+    REQUIRE(w->requiresGrad());
+    auto e = exp(x) * 2;
+    REQUIRE(!e->requiresGrad());
+    REQUIRE(!e->isConstant());
+    auto y = w * e + x;
+    REQUIRE(y->requiresGrad());
+    REQUIRE(!Value::constant(1)->requiresGrad());
+    const expr::Var<0> u;
+    const expr::Var<1> v;
+    REQUIRE(!expr::fuse(u * v + exp(u), std::array{ x, e })->requiresGrad());
+    REQUIRE(expr::fuse(u * v + exp(u), std::array{ x, w })->requiresGrad());
+    y->backward();
+    REQUIRE(w->grad() == 2 * std::exp(3.0));
+    // Neither x nor the nodes computed from it alone are reached by backward.
+    REQUIRE(x->grad() == 0);
+    REQUIRE(e->grad() == 0);
+  }
+
+  SECTION("parameter gradients match with inputs as data")
+  {
+    MLP mlp({ 3, 4, 2 });
+    std::mt19937 gen(3);
+    mlp.randomize(gen);
+    const std::vector<double> sample = { 0.5, -1, 2 };
+    const std::vector<double> target = { 1, -1 };
+    auto x = Value::makeTensor({ 3 }, sample);
+    loss(target, { unstack(mlp(x)) })->backward();
+    std::vector<double> expected;
+    for (const auto &p : mlp.parameters()) {
+      expected.insert(expected.end(), p->grads().begin(), p->grads().end());
+      std::ranges::fill(p->grads(), 0);
+    }
+    REQUIRE(std::ranges::any_of(x->grads(), [](double g) { return g != 0; }));
+
+    Tape tape;
+    {
+      Tape::Scope scope(tape);
+      tape.backward(loss(target, { mlp(sample) }));
+    }
+    tape.clear();
+    double maxError = 0;
+    size_t i = 0;
+    for (const auto &p : mlp.parameters()) {
+      for (double g : p->grads()) { maxError = std::max(maxError, std::abs(g - expected[i++])); }
+    }
+    REQUIRE(maxError < 1e-12);
+  }
+
+  SECTION("plan replays nodes computed from inputs")
+  {
+    auto w = Value::makeTensor({ 1, 2 }, std::vector<double>{ 1, 2 });
+    auto x = Value::makeTensor({ 2 });
+    x->setRequiresGrad(false);
+    Plan plan(sum(unstack(matvec(w, x * 2 + 1))));
+    std::ranges::copy(std::vector<double>{ 3, -1 }, x->values().begin());
+    plan.forward();
+    plan.backward();
+    REQUIRE(plan.root()->data() == 7 - 2);
+    REQUIRE(w->grads()[0] == 7);
+    REQUIRE(w->grads()[1] == -1);
+    REQUIRE(x->grads()[0] == 0);
+  }
+
+  SECTION("checkpoints over inputs and frozen parameters are pruned")
+  {
+    MLP mlp({ 3, 4, 4, 2 });
+    mlp.setCheckpointing(1);
+    for (const auto &p : mlp.parameters()) { p->setRequiresGrad(false); }
+    auto x = Value::makeTensor({ 3 }, std::vector<double>{ 0.5, -1, 2 });
+    x->setRequiresGrad(false);
+    REQUIRE(!mlp(x)->requiresGrad());
+    {
+      NoGradGuard guard;
+      REQUIRE(!mlp(x)->requiresGrad());
+    }
+
+    // Counts evaluations, of which backward adds one per checkpoint it visits.
+    struct Counting : CheckpointFunction<double>
+    {
+      ValuePtr w;
+      mutable int calls = 0;
+      ValuePtr operator()(const ValuePtr &v) const override
+      {
+        calls++;
+        return tanh(matvec(w, v));
+      }
+    };
+    auto f = std::make_shared<Counting>();
+    f->w = Value::makeTensor({ 2, 3 }, std::vector<double>{ 1, 2, 3, -1, 0.5, 0 });
+    auto z = std::make_shared<Value>(2.0);
+    for (bool frozen : { true, false }) {
+      f->w->setRequiresGrad(!frozen);
+      f->calls = 0;
+      Tape tape;
+      {
+        Tape::Scope scope(tape);
+        tape.backward(sum(unstack(checkpoint<double>(f, x, { f->w }))) * z);
+      }
+      tape.clear();
+      Plan plan(sum(unstack(checkpoint<double>(f, x, { f->w }))) * z);
+      plan.backward();
+      REQUIRE(f->calls == (frozen ? 2 : 4));
+    }
+  }
+}
+
+TEST_CASE("gradient accumulation")
+{
+  SECTION("leaves accumulate, nodes in between are recomputed")
+  {
+    auto a = std::make_shared<Value>(3.0);
+    auto b = std::make_shared<Value>(4.0);
+    auto ab = a * b;
+    auto c = ab * ab;
+    c->backward();
+    c->backward(true);
+    c->backward(true);
+    REQUIRE(a->grad() == 3 * 2 * 12 * 4);
+    REQUIRE(b->grad() == 3 * 2 * 12 * 3);
+    REQUIRE(ab->grad() == 2 * 12);
+    a->zeroGrad();
+    REQUIRE(a->grad() == 0);
+    Plan plan(c);
+    plan.backward();
+    REQUIRE(a->grad() == 2 * 12 * 4);
+  }
+
+  SECTION("micro-batches sum to the batch gradient")
+  {
+    MLP mlp({ 3, 5, 2 });
+    std::mt19937 gen(8);
+    mlp.randomize(gen);
+    const std::vector<std::vector<double>> inputs = { { 0.5, -1, 2 }, { 1, 0, -0.5 }, { -2, 0.25, 1 } };
+    const std::vector<double> target = { 1, -1 };
+    std::vector<std::vector<ValuePtr>> y;
+    for (const auto &x : inputs) { y.push_back(mlp(x)); }
+    loss(target, y)->backward();
+    const std::vector<double> batch(mlp.parameterBuffer()->grads().begin(), mlp.parameterBuffer()->grads().end());
+
+    auto optimizer = makeOptimizer(mlp.parameterBuffer(), OptimizerOptions{});
+    optimizer->zeroGrad();
+    REQUIRE(std::ranges::all_of(mlp.parameterBuffer()->grads(), [](double g) { return g == 0; }));
+    loss(target, { mlp(inputs[0]), mlp(inputs[1]) })->backward();
+    Tape tape;
+    {
+      Tape::Scope scope(tape);
+      tape.backward(loss(target, { mlp(inputs[2]) }));
+    }
+    tape.clear();
+    double maxError = 0;
+    const auto grads = mlp.parameterBuffer()->grads();
+    for (size_t i = 0; i < grads.size(); i++) { maxError = std::max(maxError, std::abs(grads[i] - batch[i])); }
+    REQUIRE(maxError < 1e-12);
+  }
+
+  SECTION("training on micro-batches")
+  {
+    std::vector<std::vector<double>> xs = { { 2, 3, -1 }, { 3, -1, 0.5 }, { 0.5, 1, 1 }, { 1, 1, -1 }, { 0, 2, 1 } };
+    std::vector<double> ys = { 1, -1 };
+    TrainOptions options{ .lr = 0.02, .niter = 20, .batchSize = 4, .seed = 6, .verbose = false };
+    auto whole = gradientDescent({ 4 }, xs, ys, options);
+    for (size_t micro : { 1, 3 }) {
+      options.microBatchSize = micro;
+      auto split = gradientDescent({ 4 }, xs, ys, options);
+      double maxError = 0;
+      const auto a = whole.parameterBuffer()->values();
+      const auto b = split.parameterBuffer()->values();
+      for (size_t i = 0; i < a.size(); i++) { maxError = std::max(maxError, std::abs(a[i] - b[i])); }
+      REQUIRE(maxError < 1e-9);
+    }
+  }
+}
+
+TEST_CASE("layer matches scalar graph")
+{
+  Layer layer(3, 4);
+  std::vector<double> x = { 0.5, -1, 2 };
+  auto params = layer.parameters();
+  std::vector<double> w(params[0]->values().begin(), params[0]->values().end());
+  std::vector<double> b(params[1]->values().begin(), params[1]->values().end());
+  ValuePtr l = std::make_shared<Value>(0.0);
+  for (auto &y : layer(x)) { l += pow(y, 2); }
+  l->backward();
+
+  std::vector<ValuePtr> ws;
+  std::vector<ValuePtr> bs;
+  ValuePtr ref = std::make_shared<Value>(0.0);
+  for (size_t i = 0; i < 4; i++) {
+    ValuePtr sum = bs.emplace_back(std::make_shared<Value>(b[i]));
+    for (size_t j = 0; j < 3; j++) { sum += x[j] * ws.emplace_back(std::make_shared<Value>(w[i * 3 + j])); }
+    ref += pow(tanh(sum), 2);
+  }
+  ref->backward();
+  REQUIRE_THAT(l->data(), Catch::Matchers::WithinAbs(ref->data(), 1e-12));
+  for (size_t i = 0; i < ws.size(); i++) {
+    REQUIRE_THAT(params[0]->grads()[i], Catch::Matchers::WithinAbs(ws[i]->grad(), 1e-12));
+  }
+  for (size_t i = 0; i < bs.size(); i++) {
+    REQUIRE_THAT(params[1]->grads()[i], Catch::Matchers::WithinAbs(bs[i]->grad(), 1e-12));
+  }
+}
+
+TEST_CASE("layer node count does not depend on width")
+{
+  Tape tape;
+  for (size_t width : { 2, 64 }) {
+    MLP mlp({ width, width, 1 });
+    {
+      Tape::Scope scope(tape);
+      auto y = mlp(std::vector<double>(width, 1.0));
+      REQUIRE(tape.size() == 1 + 2 * 3 + 1);
+    }
+    tape.clear();
+  }
+}
+
+TEST_CASE("vectorized kernels")
+{
+  std::vector<double> x;
+  for (int i = -7000; i <= 7000; i++) { x.push_back(i * 0.1 + 1e-3); }
+  for (int i = -300; i <= 300; i++) { x.push_back(i * 1e-9); }
+  for (auto isa : { kernels::Isa::SCALAR, kernels::Isa::AVX2, kernels::Isa::AVX512 }) {
+    kernels::setIsa(isa);
+    std::vector<double> e(x.size());
+    std::vector<double> t(x.size());
+    kernels::exp(x.data(), e.data(), x.size());
+    kernels::tanh(x.data(), t.data(), x.size());
+    double dot = 0;
+    double expErr = 0;
+    double tanhErr = 0;
+    for (size_t i = 0; i < x.size(); i++) {
+      expErr = std::max(expErr, std::abs(e[i] - std::exp(x[i])) / std::exp(x[i]));
+      tanhErr = std::max(tanhErr, std::abs(t[i] - std::tanh(x[i])) / std::abs(std::tanh(x[i])));
+      dot += x[i] * x[i];
+    }
+    REQUIRE(expErr < 5e-16);
+    REQUIRE(tanhErr < 1.2e-15);
+    REQUIRE_THAT(kernels::dot(x.data(), x.data(), x.size()), Catch::Matchers::WithinRel(dot, 1e-12));
+
+    // 7 x 13 rows of 11: both the four-row blocks and the remainder, vector loops and tails.
+    std::vector<double> out(7 * 13);
+    kernels::matmulT(x.data(), x.data() + 500, out.data(), 7, 13, 11);
+    double matErr = 0;
+    for (size_t r = 0; r < 7; r++) {
+      for (size_t j = 0; j < 13; j++) {
+        double expected = 0;
+        for (size_t i = 0; i < 11; i++) { expected += x[r * 11 + i] * x[500 + j * 11 + i]; }
+        matErr = std::max(matErr, std::abs(out[r * 13 + j] - expected) / std::abs(expected));
+      }
+    }
+    REQUIRE(matErr < 1e-13);
+
+    // Past the range of normal results exp rounds to denormals, 0 and infinity where std::exp does, and passes NaN.
+    const double inf = std::numeric_limits<double>::infinity();
+    std::vector<double> edges{
+      709.5, 709.78, 709.79, 710, 1e6, inf, -708.5, -720, -740, -745, -745.2, -746, -1e6, -inf
+    };
+    edges.insert(edges.end(), edges.begin(), edges.end());
+    edges.push_back(std::numeric_limits<double>::quiet_NaN());
+    std::vector<double> edgeExp(edges.size());
+    kernels::exp(edges.data(), edgeExp.data(), edges.size());
+    for (size_t i = 0; i + 1 < edges.size(); i++) {
+      const double expected = std::exp(edges[i]);
+      if (std::isinf(expected) || expected == 0) {
+        REQUIRE(edgeExp[i] == expected);
+      } else {
+        const double tolerance = std::max(4e-16 * expected, std::numeric_limits<double>::denorm_min());
+        REQUIRE(std::abs(edgeExp[i] - expected) <= tolerance);
+      }
+    }
+    REQUIRE(std::isnan(edgeExp.back()));
+  }
+  kernels::setIsa(kernels::detectIsa());
+}
+
+TEST_CASE("float kernels")
+{
+  std::vector<float> x;
+  for (int i = -8000; i <= 8000; i++) { x.push_back(static_cast<float>(i * 0.01 + 1e-3)); }
+  for (int i = -300; i <= 300; i++) { x.push_back(static_cast<float>(i * 1e-9)); }
+  for (auto isa : { kernels::Isa::SCALAR, kernels::Isa::AVX2, kernels::Isa::AVX512 }) {
+    kernels::setIsa(isa);
+    std::vector<float> e(x.size());
+    std::vector<float> t(x.size());
+    kernels::exp(x.data(), e.data(), x.size());
+    kernels::tanh(x.data(), t.data(), x.size());
+    double dot = 0;
+    double expErr = 0;
+    double tanhErr = 0;
+    for (size_t i = 0; i < x.size(); i++) {
+      const double xi = x[i];
+      expErr = std::max(expErr, std::abs(e[i] - std::exp(xi)) / std::exp(xi));
+      tanhErr = std::max(tanhErr, std::abs(t[i] - std::tanh(xi)) / std::abs(std::tanh(xi)));
+      dot += xi * xi;
+    }
+    REQUIRE(expErr < 4e-7);
+    REQUIRE(tanhErr < 6e-7);
+    REQUIRE_THAT(kernels::dot(x.data(), x.data(), x.size()), Catch::Matchers::WithinRel(dot, 1e-5));
+
+    const float inf = std::numeric_limits<float>::infinity();
+    std::vector<float> edges{ 88.5f, 88.72f, 88.73f, 89, 1e6f, inf, -87.5f, -95, -103, -103.9f, -104, -1e6f, -inf };
+    edges.insert(edges.end(), edges.begin(), edges.end());
+    edges.push_back(std::numeric_limits<float>::quiet_NaN());
+    std::vector<float> edgeExp(edges.size());
+    kernels::exp(edges.data(), edgeExp.data(), edges.size());
+    for (size_t i = 0; i + 1 < edges.size(); i++) {
+      const float expected = std::exp(edges[i]);
+      if (std::isinf(expected) || expected == 0) {
+        REQUIRE(edgeExp[i] == expected);
+      } else {
+        const float tolerance = std::max(4e-7f * expected, std::numeric_limits<float>::denorm_min());
+        REQUIRE(std::abs(edgeExp[i] - expected) <= tolerance);
+      }
+    }
+    REQUIRE(std::isnan(edgeExp.back()));
+  }
+  kernels::setIsa(kernels::detectIsa());
+}
+
+TEST_CASE("float graphs match double")
+{
+  // The same expression over every scalar op, and an MLP with the same weights, in both precisions.
+  auto graph = []<class T>(std::span<const double> x, std::vector<BasicValuePtr<T>> &leaves) {
+    for (double xi : x) { leaves.push_back(std::make_shared<BasicValue<T>>(static_cast<T>(xi))); }
+    const auto &a = leaves[0];
+    const auto &b = leaves[1];
+    const auto &c = leaves[2];
+    auto y = tanh(a * b + c) / exp(-a) - pow(b, 2) * relu(c) + sum(std::vector{ a, b, c }) / 3;
+    y->backward();
+    return y;
+  };
+  const std::array<double, 3> x{ 0.3, -1.2, 0.8 };
+  std::vector<BasicValuePtr<float>> lf;
+  std::vector<ValuePtr> ld;
+  auto yf = graph(x, lf);
+  auto yd = graph(x, ld);
+  REQUIRE_THAT(yf->data(), Catch::Matchers::WithinRel(yd->data(), 1e-5));
+  for (size_t i = 0; i < x.size(); i++) {
+    REQUIRE_THAT(lf[i]->grad(), Catch::Matchers::WithinRel(ld[i]->grad(), 1e-5));
+  }
+
+  MLP md({ 8, 16, 16, 2 });
+  BasicMLP<float> mf({ 8, 16, 16, 2 });
+  auto pd = md.parameters();
+  auto pf = mf.parameters();
+  for (size_t i = 0; i < pd.size(); i++) { std::ranges::copy(pd[i]->values(), pf[i]->values().begin()); }
+  std::vector<double> input{ 0.5, -0.25, 1, 0.75, -1, 0.1, 0.2, -0.6 };
+  auto ld2 = loss(std::vector<double>{ 1, -1 }, std::vector<std::vector<ValuePtr>>{ md(input) });
+  auto lf2 = loss(std::vector<double>{ 1, -1 }, std::vector<std::vector<BasicValuePtr<float>>>{ mf(input) });
+  ld2->backward();
+  lf2->backward();
+  // The weights are random, so the loss, the gradients or the outputs can come out near zero; the tolerances are
+  // absolute plus relative to keep that from failing on rounding alone.
+  REQUIRE_THAT(lf2->data(),
+    Catch::Matchers::WithinRel(ld2->data(), 1e-5) || Catch::Matchers::WithinAbs(ld2->data(), 1e-5));
+  double maxErr = 0;
+  double maxGrad = 0;
+  for (size_t i = 0; i < pd.size(); i++) {
+    for (size_t j = 0; j < pd[i]->size(); j++) {
+      maxErr = std::max(maxErr, std::abs(pf[i]->grads()[j] - pd[i]->grads()[j]));
+      maxGrad = std::max(maxGrad, std::abs(pd[i]->grads()[j]));
+    }
+  }
+  REQUIRE(maxErr < 1e-5 * (maxGrad + 1));
+
+  std::vector<float> inputF(input.begin(), input.end());
+  auto predicted = mf.predict(inputF);
+  auto expected = md.predict(input);
+  for (size_t i = 0; i < expected.size(); i++) {
+    REQUIRE_THAT(predicted[i],
+      Catch::Matchers::WithinRel(expected[i], 1e-5) || Catch::Matchers::WithinAbs(expected[i], 1e-5));
+  }
+}
+
+TEST_CASE("float training and model files")
+{
+  std::vector<std::vector<double>> xs = { { 2, 3, -1 }, { 3, -1, 0.5 }, { 0.5, 1, 1 }, { 1, 1, -1 } };
+  std::vector<double> ys = { 1, -1, -1, 1 };
+  TrainOptions options{ .lr = 0.05, .niter = 200, .batchSize = 1, .seed = 7, .verbose = false };
+  auto mlp = gradientDescent<float>({ 4, 4 }, xs, ys, options);
+  std::vector<std::vector<BasicValuePtr<float>>> out;
+  for (const auto &x : xs) { out.push_back(mlp(x)); }
+  REQUIRE(loss(ys, out)->data() < 1.0);
+
+  auto file = (std::filesystem::temp_directory_path() / "micrograd_float.mlp").string();
+  REQUIRE(mlp.save(file));
+  REQUIRE(std::filesystem::file_size(file) < 1024);
+  auto loaded = BasicMLP<float>::load(file);
+  REQUIRE(loaded.has_value());
+  std::vector<float> x0(xs[0].begin(), xs[0].end());
+  REQUIRE(loaded->predict(x0) == mlp.predict(x0));
+  // The element type is part of the format, so a float model does not load as a double one.
+  REQUIRE_FALSE(MLP::load(file).has_value());
+  std::filesystem::remove(file);
+}
+
+TEST_CASE("mini-batch gradient descent")
+{
+  std::vector<std::vector<double>> xs = { { 2, 3, -1 }, { 3, -1, 0.5 }, { 0.5, 1, 1 }, { 1, 1, -1 } };
+  std::vector<double> ys = { 1, -1, -1, 1 };
+  TrainOptions options{ .lr = 0.05, .niter = 200, .batchSize = 1, .seed = 7, .verbose = false };
+  auto mlp = gradientDescent({ 4, 4 }, xs, ys, options);
+  std::vector<std::vector<ValuePtr>> out;
+  for (const auto &x : xs) { out.push_back(mlp(x)); }
+  REQUIRE(loss(ys, out)->data() < 1.0);
+}
+
+TEST_CASE("seeded initial parameters")
+{
+  auto values = [](const MLP &m) {
+    auto v = m.parameterBuffer()->values();
+    return std::vector<double>(v.begin(), v.end());
+  };
+  std::mt19937 gen(12);
+  MLP seeded({ 3, 4, 4, 2 }, gen);
+  std::mt19937 same(12);
+  MLP randomized({ 3, 4, 4, 2 });
+  randomized.randomize(same);
+  REQUIRE(values(seeded) == values(randomized));
+
+  // gradientDescent draws its initial parameters from the seed the same way.
+  std::vector<std::vector<double>> xs = { { 2, 3, -1 }, { 3, -1, 0.5 } };
+  std::vector<double> ys = { 1, -1 };
+  TrainOptions options{ .niter = 0, .seed = 12, .verbose = false };
+  REQUIRE(values(gradientDescent({ 4, 4 }, xs, ys, options)) == values(seeded));
+}
+
+TEST_CASE("thread pool")
+{
+  ThreadPool pool(4);
+  std::vector<int> hits(1000);
+  pool.parallelFor(hits.size(), [&](size_t i) {
+    hits[i]++;
+    pool.parallelFor(2, [&](size_t) {});
+  });
+  REQUIRE(std::ranges::all_of(hits, [](int h) { return h == 1; }));
+
+  // Outside threads sharing the pool take turns, and each job sees every one of its own indices once.
+  std::vector<std::vector<int>> perCaller(4, std::vector<int>(500));
+  {
+    std::vector<std::jthread> callers;
+    for (auto &h : perCaller) {
+      callers.emplace_back([&pool, &h] {
+        for (int round = 0; round < 20; round++) {
+          pool.parallelFor(h.size(), [&](size_t i) { h[i]++; });
+        }
+      });
+    }
+  }
+  for (const auto &h : perCaller) { REQUIRE(std::ranges::all_of(h, [](int n) { return n == 20; })); }
+
+  // An exception thrown by the job on any thread reaches the caller, and the pool stays usable.
+  REQUIRE_THROWS_AS(pool.parallelFor(100,
+                      [](size_t i) {
+                        if (i == 37) { throw std::runtime_error("job failed"); }
+                      }),
+    std::runtime_error);
+  std::atomic<size_t> count{ 0 };
+  pool.parallelFor(100, [&](size_t) { count++; });
+  REQUIRE(count == 100);
+}
+
+TEST_CASE("data-parallel gradient descent")
+{
+  std::vector<std::vector<double>> xs;
+  for (int i = 0; i < 32; i++) { xs.push_back({ std::sin(i), std::cos(i), 0.1 * i }); }
+  std::vector<double> ys = { 1, -1 };
+  auto train = [&](size_t threads, bool deterministic, int niter = 5) {
+    TrainOptions options{ .lr = 0.01,
+      .tol = 0,
+      .niter = niter,
+      .batchSize = 8,
+      .seed = 3,
+      .threads = threads,
+      .deterministic = deterministic,
+      .verbose = false };
+    auto mlp = gradientDescent({ 8 }, xs, ys, options);
+    std::vector<double> p;
+    for (const auto &t : mlp.parameters()) { p.insert(p.end(), t->values().begin(), t->values().end()); }
+    return p;
+  };
+  auto maxDiff = [](const std::vector<double> &x, const std::vector<double> &y) {
+    REQUIRE(x.size() == y.size());
+    double d = 0;
+    for (size_t i = 0; i < x.size(); i++) { d = std::max(d, std::abs(x[i] - y[i])); }
+    return d;
+  };
+  auto a = train(4, true);
+  auto b = train(4, true);
+  REQUIRE(a == b);
+
+  // Both modes follow the serial run up to the order in which the per-thread gradients are summed.
+  auto initial = train(1, true, 0);
+  auto serial = train(1, true);
+  REQUIRE(maxDiff(serial, initial) > 1e-3);
+  REQUIRE(maxDiff(a, serial) < 1e-12);
+  auto c = train(3, false);
+  REQUIRE(maxDiff(c, initial) > 1e-3);
+  REQUIRE(maxDiff(c, serial) < 1e-12);
+}
+
+TEST_CASE("parameters are views into one buffer")
+{
+  MLP mlp({ 3, 5, 2 });
+  const auto &buffer = mlp.parameterBuffer();
+  const double *base = buffer->values().data();
+  REQUIRE(reinterpret_cast<std::uintptr_t>(base) % 64 == 0);
+  REQUIRE(reinterpret_cast<std::uintptr_t>(buffer->grads().data()) % 64 == 0);
+  size_t end = 0;
+  for (const auto &p : mlp.parameters()) {
+    const size_t offset = p->values().data() - base;
+    REQUIRE(offset % ParameterBuffer::kAlignment == 0);
+    REQUIRE(offset >= end);
+    REQUIRE(p->grads().data() == buffer->grads().data() + offset);
+    end = offset + p->size();
+  }
+  REQUIRE(end == buffer->size());
+
+  auto y = mlp(std::vector<double>{ 1, -1, 0.5 });
+  sum(y)->backward();
+  double total = 0;
+  for (const auto &p : mlp.parameters()) {
+    for (double g : p->grads()) { total += std::abs(g); }
+  }
+  double flat = 0;
+  for (double g : buffer->grads()) { flat += std::abs(g); }
+  REQUIRE(total > 0);
+  REQUIRE(flat == total);
+
+  // A replica shares the values and has gradients of its own in the same layout.
+  auto r = mlp.replica();
+  REQUIRE(r.parameterBuffer()->values().data() == base);
+  REQUIRE(r.parameterBuffer()->grads().data() != buffer->grads().data());
+  REQUIRE(r.parameters()[2]->values().data() == mlp.parameters()[2]->values().data());
+  REQUIRE(std::ranges::all_of(r.parameterBuffer()->grads(), [](double g) { return g == 0; }));
+}
+
+TEST_CASE("optimizer kernels")
+{
+  const size_t n = 1003;
+  std::vector<double> g(n);
+  std::vector<double> x0(n);
+  for (size_t i = 0; i < n; i++) {
+    g[i] = std::sin(0.1 * static_cast<double>(i));
+    x0[i] = std::cos(0.3 * static_cast<double>(i));
+  }
+  const kernels::SgdStep<double> sp{ 0.1, 0.9, 0.01 };
+  const kernels::AdamStep<double> ap{ 0.01, 0.9, 0.999, 2.0, 1e-8, 0.01, 0.001 };
+  for (auto isa : { kernels::Isa::SCALAR, kernels::Isa::AVX2, kernels::Isa::AVX512 }) {
+    kernels::setIsa(isa);
+    std::vector<double> x = x0;
+    std::vector<double> vel(n, 0.5);
+    kernels::sgd(sp, g.data(), vel.data(), x.data(), n);
+    std::vector<double> xp = x0;
+    kernels::sgd(sp, g.data(), nullptr, xp.data(), n);
+    std::vector<double> xa = x0;
+    std::vector<double> m(n, 0.1);
+    std::vector<double> v(n, 0.2);
+    kernels::adam(ap, g.data(), m.data(), v.data(), xa.data(), n);
+    double sgdErr = 0;
+    double adamErr = 0;
+    for (size_t i = 0; i < n; i++) {
+      const double ve = 0.9 * 0.5 + g[i] + 0.01 * x0[i];
+      const double xp0 = x0[i] - 0.1 * (g[i] + 0.01 * x0[i]);
+      sgdErr = std::max({ sgdErr, std::abs(vel[i] - ve), std::abs(x[i] - (x0[i] - 0.1 * ve)), std::abs(xp[i] - xp0) });
+      const double gi = g[i] + 0.01 * x0[i];
+      const double me = 0.9 * 0.1 + 0.1 * gi;
+      const double ve2 = 0.999 * 0.2 + 0.001 * gi * gi;
+      const double xe = (1 - 0.001) * x0[i] - 0.01 * me / (std::sqrt(ve2 * 2.0) + 1e-8);
+      adamErr = std::max({ adamErr, std::abs(m[i] - me), std::abs(v[i] - ve2), std::abs(xa[i] - xe) });
+    }
+    REQUIRE(sgdErr < 1e-12);
+    REQUIRE(adamErr < 1e-12);
+    std::vector<float> xf(x0.begin(), x0.end());
+    std::vector<float> gf(g.begin(), g.end());
+    std::vector<float> mf(n, 0.1F);
+    std::vector<float> vf(n, 0.2F);
+    const kernels::AdamStep<float> apf{ 0.01F, 0.9F, 0.999F, 2.0F, 1e-8F, 0.01F, 0.001F };
+    kernels::adam(apf, gf.data(), mf.data(), vf.data(), xf.data(), n);
+    double floatErr = 0;
+    for (size_t i = 0; i < n; i++) { floatErr = std::max(floatErr, std::abs(xf[i] - xa[i])); }
+    REQUIRE(floatErr < 1e-5);
+  }
+  kernels::setIsa(kernels::detectIsa());
+}
+
+TEST_CASE("optimizers")
+{
+  std::vector<std::vector<double>> xs;
+  std::vector<double> ys;
+  for (int i = 0; i < 16; i++) {
+    xs.push_back({ std::sin(i), std::cos(i) });
+    ys.push_back(std::sin(2.0 * i) > 0 ? 0.5 : -0.5);
+  }
+  auto train = [&](OptimizerType type, double lr, double momentum, double weightDecay) {
+    TrainOptions options{ .lr = lr,
+      .optimizer = type,
+      .momentum = momentum,
+      .weightDecay = weightDecay,
+      .niter = 100,
+      .batchSize = 4,
+      .seed = 5,
+      .verbose = false };
+    auto mlp = gradientDescent({ 8 }, xs, ys, options);
+    double l = 0;
+    for (size_t i = 0; i < xs.size(); i++) {
+      const double y = mlp.predict(xs[i])[0];
+      l += (y - ys[i]) * (y - ys[i]);
+    }
+    return l;
+  };
+  const double sgd = train(OptimizerType::SGD, 0.005, 0, 0);
+  REQUIRE(train(OptimizerType::SGD, 0.005, 0.9, 0) < sgd);
+  REQUIRE(train(OptimizerType::ADAM, 0.005, 0, 0) < sgd);
+  REQUIRE(train(OptimizerType::ADAMW, 0.005, 0, 0.01) < sgd);
+
+  // Bias correction makes the first Adam step lr * sign(g) wherever the gradient is well above eps.
+  MLP mlp({ 2, 3, 1 });
+  auto before = std::vector<double>(mlp.parameterBuffer()->values().begin(), mlp.parameterBuffer()->values().end());
+  auto y = mlp(std::vector<double>{ 0.5, -0.5 });
+  y[0]->backward();
+  auto adam = makeOptimizer<double>(mlp.parameterBuffer(), OptimizerOptions{ .type = OptimizerType::ADAM, .lr = 0.1 });
+  adam->step();
+  const auto v = mlp.parameterBuffer()->values();
+  const auto gr = mlp.parameterBuffer()->grads();
+  for (size_t i = 0; i < v.size(); i++) {
+    if (std::abs(gr[i]) > 1e-2) {
+      REQUIRE_THAT(v[i], Catch::Matchers::WithinAbs(before[i] - std::copysign(0.1, gr[i]), 1e-6));
+    }
+  }
+}
+
+TEST_CASE("parallel backward matches serial backward")
+{
+  ThreadPool pool(4);
+  auto compare = [&](const ValuePtr &root, const std::vector<ValuePtr> &leaves) {
+    root->backward();
+    std::vector<double> serial;
+    for (const auto &l : leaves) {
+      serial.insert(serial.end(), l->grads().begin(), l->grads().end());
+      l->zeroGrad();
+    }
+    root->backward(pool);
+    std::vector<double> parallel;
+    for (const auto &l : leaves) { parallel.insert(parallel.end(), l->grads().begin(), l->grads().end()); }
+    REQUIRE(parallel.size() == serial.size());
+    for (size_t i = 0; i < serial.size(); i++) { REQUIRE_THAT(parallel[i], Catch::Matchers::WithinAbs(serial[i], 1e-12)); }
+  };
+
+  SECTION("wide scalar graph")
+  {
+    std::vector<ValuePtr> x;
+    for (int i = 0; i < 40; i++) { x.push_back(std::make_shared<Value>(0.05 * (i - 20))); }
+    std::vector<ValuePtr> terms;
+    for (size_t i = 0; i < 1000; i++) { terms.push_back(tanh(x[i % 40] * x[(i * 7) % 40] + pow(x[(i * 3) % 40], 2))); }
+    // Pairwise sum, so that every level of the graph is wide.
+    while (terms.size() > 1) {
+      std::vector<ValuePtr> next;
+      for (size_t i = 0; i + 1 < terms.size(); i += 2) { next.push_back(terms[i] + terms[i + 1]); }
+      if (terms.size() % 2 == 1) { next.push_back(terms.back()); }
+      terms = std::move(next);
+    }
+    compare(terms[0], x);
+  }
+
+  SECTION("samples sharing tensor parameters")
+  {
+    MLP mlp({ 6, 8, 3 });
+    std::mt19937 gen(11);
+    mlp.randomize(gen);
+    std::vector<ValuePtr> outputs;
+    for (int s = 0; s < 300; s++) {
+      for (const auto &o : mlp(std::vector<double>{ std::sin(s), std::cos(s), 0.1, -0.2, 0.01 * s, 1.0 })) {
+        outputs.push_back(o * o);
+      }
+    }
+    compare(stack(outputs) * 1.0, mlp.parameters());
+  }
+}
+
+TEST_CASE("plan replays a captured graph")
+{
+  SECTION("scalar graph")
+  {
+    auto a = std::make_shared<Value>(2.0);
+    auto b = std::make_shared<Value>(-3.0);
+    Plan plan(tanh(a * b + pow(a, 2)) + exp(b) + relu(a - b));
+    a->_data = 0.5;
+    b->_data = 0.25;
+    plan.forward();
+    plan.backward();
+    auto c = std::make_shared<Value>(0.5);
+    auto d = std::make_shared<Value>(0.25);
+    auto fresh = tanh(c * d + pow(c, 2)) + exp(d) + relu(c - d);
+    fresh->backward();
+    REQUIRE(plan.root()->data() == fresh->data());
+    REQUIRE(a->grad() == c->grad());
+    REQUIRE(b->grad() == d->grad());
+  }
+
+  SECTION("model with new inputs and parameters")
+  {
+    MLP mlp({ 3, 5, 2 });
+    std::mt19937 gen(5);
+    mlp.randomize(gen);
+    auto x = Value::makeTensor({ 3 });
+    Plan plan(loss(std::vector<double>{ 1, -1 }, { unstack(mlp(x)) }));
+    const size_t nodes = plan.size();
+    for (int step = 0; step < 3; step++) {
+      std::vector<double> input = { 0.1 * step, -0.2, 0.3 + step };
+      std::ranges::copy(input, x->values().begin());
+      for (const auto &p : mlp.parameters()) {
+        for (auto &v : p->values()) { v += 0.01; }
+      }
+      plan.forward();
+      mlp.zeroGrad();
+      plan.backward();
+      std::vector<double> expected;
+      std::vector<double> grads;
+      for (const auto &p : mlp.parameters()) { grads.insert(grads.end(), p->grads().begin(), p->grads().end()); }
+      auto fresh = loss(std::vector<double>{ 1, -1 }, { mlp(input) });
+      mlp.zeroGrad();
+      fresh->backward();
+      for (const auto &p : mlp.parameters()) { expected.insert(expected.end(), p->grads().begin(), p->grads().end()); }
+      REQUIRE(plan.root()->data() == fresh->data());
+      REQUIRE(grads == expected);
+    }
+    REQUIRE(plan.size() == nodes);
+  }
+}
+
+TEST_CASE("gradient checkpointing")
+{
+  MLP mlp({ 3, 6, 6, 6, 6, 6, 6, 6, 2 });
+  std::mt19937 gen(9);
+  mlp.randomize(gen);
+  const std::vector<std::vector<double>> inputs = { { 0.5, -1, 0.25 }, { -0.3, 0.8, 1.2 } };
+  const std::vector<double> target = { 1, -1 };
+  // Loss over both inputs, then the parameter gradients followed by those of the input tensors.
+  auto run = [&](auto backward) {
+    mlp.zeroGrad();
+    std::vector<ValuePtr> xs;
+    std::vector<std::vector<ValuePtr>> y;
+    for (const auto &in : inputs) {
+      xs.push_back(Value::makeTensor({ 3 }, in));
+      y.push_back(unstack(mlp(xs.back())));
+    }
+    auto l = loss(target, y);
+    backward(l);
+    std::vector<double> g{ l->data() };
+    for (const auto &p : mlp.parameters()) { g.insert(g.end(), p->grads().begin(), p->grads().end()); }
+    for (const auto &x : xs) { g.insert(g.end(), x->grads().begin(), x->grads().end()); }
+    return std::pair{ g, Plan(l).size() };
+  };
+  auto maxErr = [](const std::vector<double> &a, const std::vector<double> &b) {
+    double e = a.size() == b.size() ? 0 : 1;
+    for (size_t i = 0; i < std::min(a.size(), b.size()); i++) { e = std::max(e, std::abs(a[i] - b[i])); }
+    return e;
+  };
+  auto serial = [](const ValuePtr &l) { l->backward(); };
+  const auto [expected, nodes] = run(serial);
+  ThreadPool pool(4);
+  for (size_t segment : { 1, 3, 8 }) {
+    mlp.setCheckpointing(segment);
+    const auto [g, checkpointed] = run(serial);
+    REQUIRE(checkpointed < nodes);
+    REQUIRE(maxErr(g, expected) < 1e-12);
+    REQUIRE(maxErr(run([&](const ValuePtr &l) { l->backward(pool); }).first, expected) < 1e-12);
+  }
+
+  // Replayed by a plan, and recorded on a tape, which the checkpointed segments stay off.
+  auto x = Value::makeTensor({ 3 }, inputs[0]);
+  Plan plan(loss(target, { unstack(mlp(x)) }));
+  std::ranges::copy(inputs[1], x->values().begin());
+  plan.forward();
+  mlp.zeroGrad();
+  plan.backward();
+  auto grads = [&] {
+    std::vector<double> g;
+    for (const auto &p : mlp.parameters()) { g.insert(g.end(), p->grads().begin(), p->grads().end()); }
+    return g;
+  };
+  const auto replayed = grads();
+  mlp.setCheckpointing(0);
+  auto fresh = loss(target, { mlp(inputs[1]) });
+  mlp.zeroGrad();
+  fresh->backward();
+  REQUIRE_THAT(plan.root()->data(), Catch::Matchers::WithinAbs(fresh->data(), 1e-12));
+  REQUIRE(maxErr(replayed, grads()) < 1e-12);
+  mlp.setCheckpointing(3);
+  Tape tape;
+  {
+    Tape::Scope scope(tape);
+    auto l = loss(target, { mlp(inputs[1]) });
+    mlp.zeroGrad();
+    tape.backward(l);
+    REQUIRE_THAT(l->data(), Catch::Matchers::WithinAbs(fresh->data(), 1e-12));
+    REQUIRE(maxErr(replayed, grads()) < 1e-12);
+  }
+  tape.clear();
+
+  TrainOptions options{ .lr = 0.05, .niter = 20, .batchSize = 2, .seed = 4, .verbose = false };
+  std::vector<std::vector<double>> xs = { { 2, 3, -1 }, { 3, -1, 0.5 }, { 0.5, 1, 1 }, { 1, 1, -1 } };
+  std::vector<double> ys = { 1, -1 };
+  auto plain = gradientDescent({ 8, 8, 8, 8 }, xs, ys, options);
+  options.checkpoint = true;
+  auto trained = gradientDescent({ 8, 8, 8, 8 }, xs, ys, options);
+  REQUIRE(trained.layersPerSegment() == 2);
+  auto a = plain.predict(xs[0]);
+  auto b = trained.predict(xs[0]);
+  REQUIRE_THAT(b[0], Catch::Matchers::WithinAbs(a[0], 1e-9));
+}
+
+TEST_CASE("no-grad guard records no operands")
+{
+  auto a = std::make_shared<Value>(2.0);
+  auto b = std::make_shared<Value>(3.0);
+  std::weak_ptr<Value> weak = a;
+  ValuePtr c;
+  {
+    NoGradGuard guard;
+    REQUIRE(NoGradGuard::enabled());
+    c = tanh(a * b - a / b);
+  }
+  REQUIRE_FALSE(NoGradGuard::enabled());
+  REQUIRE(c->data() == std::tanh(2.0 * 3.0 - 2.0 / 3.0));
+  a.reset();
+  REQUIRE(weak.expired());
+  c->backward();
+  REQUIRE(b->grad() == 0);
+
+  // Nothing made under the guard is placed on the active tape.
+  Tape tape;
+  Tape::Scope scope(tape);
+  {
+    NoGradGuard guard;
+    auto t = Value::makeTensor({ 3 }, std::vector<double>{ 1, 2, 3 });
+    c = sum(unstack(exp(t))) * b;
+  }
+  REQUIRE(tape.size() == 0);
+  REQUIRE_THAT(c->data(), Catch::Matchers::WithinRel(3 * (std::exp(1.0) + std::exp(2.0) + std::exp(3.0)), 1e-12));
+}
+
+TEST_CASE("predict matches the graph")
+{
+  for (auto activation : { Activation::TANH, Activation::RELU, Activation::LINEAR }) {
+    MLP mlp({ 4, 6, 3 }, activation);
+    std::mt19937 gen(3);
+    mlp.randomize(gen);
+    std::vector<double> x = { 0.3, -1.2, 0.8, 0.05 };
+    auto graph = mlp(x);
+    auto plain = mlp.predict(x);
+    REQUIRE(plain.size() == graph.size());
+    for (size_t i = 0; i < plain.size(); i++) { REQUIRE(plain[i] == graph[i]->data()); }
+  }
+  MLP custom({ 2, 3 }, [](const ValuePtr &v) { return exp(v); });
+  std::vector<double> x = { 0.5, -0.5 };
+  auto graph = custom(x);
+  auto plain = custom.predict(x);
+  for (size_t i = 0; i < plain.size(); i++) { REQUIRE(plain[i] == graph[i]->data()); }
+
+  // The nodes a custom activation makes during predict stay off a tape that is recording around it.
+  Tape tape;
+  Tape::Scope scope(tape);
+  auto recorded = custom(x);
+  const size_t size = tape.size();
+  REQUIRE(custom.predict(x) == plain);
+  REQUIRE(tape.size() == size);
+}
+
+TEST_CASE("batched prediction")
+{
+  MLP mlp({ 5, 16, 7, 3 });
+  std::mt19937 gen(9);
+  mlp.randomize(gen);
+  const size_t rows = 203;
+  std::vector<double> inputs(rows * 5);
+  std::uniform_real_distribution<> dis(-2.0, 2.0);
+  std::ranges::generate(inputs, [&] { return dis(gen); });
+  std::vector<double> serial(rows * 3);
+  std::vector<double> parallel(rows * 3);
+  mlp.predictBatch(inputs, serial);
+  ThreadPool pool(3);
+  mlp.predictBatch(inputs, parallel, &pool);
+  REQUIRE(serial == parallel);
+  double maxErr = 0;
+  for (size_t r = 0; r < rows; r++) {
+    auto y = mlp.predict(std::span<const double>(inputs).subspan(r * 5, 5));
+    for (size_t j = 0; j < 3; j++) { maxErr = std::max(maxErr, std::abs(serial[r * 3 + j] - y[j])); }
+  }
+  REQUIRE(maxErr < 1e-12);
+}
+
+TEST_CASE("model file round trip")
+{
+  MLP mlp({ 4, 9, 3 }, Activation::TANH);
+  std::mt19937 gen(5);
+  mlp.randomize(gen);
+  auto path = (std::filesystem::temp_directory_path() / "micrograd_model.bin").string();
+  REQUIRE(mlp.save(path));
+  REQUIRE(std::filesystem::file_size(path) % 64 == 0);
+
+  auto loaded = MLP::load(path);
+  REQUIRE(loaded.has_value());
+  std::vector<double> x = { 0.3, -1.2, 0.8, 2.0 };
+  REQUIRE(loaded->predict(x) == mlp.predict(x));
+  auto p = mlp.parameters();
+  auto q = loaded->parameters();
+  REQUIRE(p.size() == q.size());
+  for (size_t i = 0; i < p.size(); i++) {
+    REQUIRE(std::ranges::equal(p[i]->shape(), q[i]->shape()));
+    REQUIRE(std::ranges::equal(p[i]->values(), q[i]->values()));
+  }
+
+  // The loaded parameters are ordinary leaves: they train, and the file is left as it was.
+  auto l = loss(std::vector<double>{ 1, 0, 1 }, { (*loaded)(x) });
+  l->backward();
+  REQUIRE(std::ranges::any_of(q[0]->grads(), [](double g) { return g != 0; }));
+  q[0]->values()[0] += 1;
+  REQUIRE(MLP::load(path)->parameters()[0]->values()[0] == p[0]->values()[0]);
+
+  // Layer records pointing into the header, at each other's parameters or out of order are rejected. The record of
+  // layer i starts at 64 + 32 * i, with the offsets of its weights and bias at 16 and 24 into it.
+  auto offset = [&](std::uint64_t at) {
+    std::uint64_t value = 0;
+    std::ifstream f(path, std::ios::binary);
+    f.seekg(static_cast<std::streamoff>(at));
+    f.read(reinterpret_cast<char *>(&value), sizeof(value));
+    return value;
+  };
+  auto patch = [&](std::uint64_t at, std::uint64_t value) {
+    std::fstream f(path, std::ios::binary | std::ios::in | std::ios::out);
+    f.seekp(static_cast<std::streamoff>(at));
+    f.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  const std::uint64_t weights0 = offset(64 + 16);
+  const std::uint64_t bias0 = offset(64 + 24);
+  const std::array<std::array<std::uint64_t, 2>, 4> corruptions{
+    { { 64 + 16, 0 }, { 64 + 24, weights0 }, { 96 + 16, bias0 }, { 96 + 16, weights0 } }
+  };
+  for (auto [at, value] : corruptions) {
+    const std::uint64_t saved = offset(at);
+    patch(at, value);
+    REQUIRE_FALSE(MLP::load(path).has_value());
+    patch(at, saved);
+  }
+  REQUIRE(MLP::load(path).has_value());
+
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 64);
+  REQUIRE_FALSE(MLP::load(path).has_value());
+  std::filesystem::remove(path);
+  REQUIRE_FALSE(MLP::load(path).has_value());
+  REQUIRE_FALSE(MLP({ 2, 2 }, [](const ValuePtr &v) { return v; }).save(path));
+}
+
+TEST_CASE("streamed datasets")
+{
+  auto dir = std::filesystem::temp_directory_path();
+  auto csv = (dir / "micrograd_data.csv").string();
+  auto bin = (dir / "micrograd_data.bin").string();
+  // y = 0.5 x0 - x1 on a grid, after a header and with a blank line in between.
+  {
+    std::ofstream out(csv);
+    out << "x0, x1, y\n";
+    for (int i = 0; i < 10; i++) {
+      for (int j = 0; j < 7; j++) {
+        const double x0 = 0.1 * i - 0.5;
+        const double x1 = 0.1 * j - 0.3;
+        out << x0 << ", " << x1 << "," << 0.5 * x0 - x1 << (i == 3 && j == 0 ? "\n\n" : "\n");
+      }
+    }
+  }
+  auto data = openCsvDataset(csv, 1);
+  REQUIRE(data != nullptr);
+  REQUIRE(data->nin() == 2);
+  REQUIRE(data->nout() == 1);
+  REQUIRE(writeBinaryDataset(bin, *data));
+  auto packed = openBinaryDataset(bin);
+  REQUIRE(packed != nullptr);
+
+  // Both read the same rows, in batches of 16 with a short last batch, through the prefetcher too.
+  std::vector<size_t> sizes;
+  Batch a;
+  Batch b;
+  {
+    Prefetcher prefetch(*data, 16);
+    packed->rewind();
+    while (prefetch.next(a)) {
+      sizes.push_back(a.rows);
+      REQUIRE(packed->read(b, 16) == a.rows);
+      REQUIRE(a.inputs == b.inputs);
+      REQUIRE(a.targets == b.targets);
+      for (size_t r = 0; r < a.rows; r++) {
+        REQUIRE_THAT(a.targets[r], Catch::Matchers::WithinAbs(0.5 * a.inputs[2 * r] - a.inputs[2 * r + 1], 1e-12));
+      }
+    }
+  }
+  REQUIRE(sizes == std::vector<size_t>{ 16, 16, 16, 16, 6 });
+  REQUIRE(packed->read(b, 16) == 0);
+
+  TrainOptions options{ .lr = 0.02, .tol = 0, .niter = 200, .batchSize = 8, .seed = 3, .verbose = false };
+  MLP mlp = gradientDescent({ 8 }, *packed, options);
+  double err = 0;
+  packed->rewind();
+  while (packed->read(b, 64) > 0) {
+    for (size_t r = 0; r < b.rows; r++) {
+      err = std::max(err, std::abs(mlp.predict(std::span(b.inputs).subspan(2 * r, 2))[0] - b.targets[r]));
+    }
+  }
+  REQUIRE(err < 0.1);
+
+  // A row in the middle with a missing column or a number that does not parse fails at open, instead of the data
+  // ending there.
+  for (const char *bad : { "0.5, 1\n", "0.5, x, 1\n" }) {
+    {
+      std::ofstream out(csv);
+      out << "x0, x1, y\n1, 2, 3\n" << bad << "4, 5, 6\n";
+    }
+    REQUIRE(openCsvDataset(csv, 1) == nullptr);
+  }
+
+  std::filesystem::remove(csv);
+  std::filesystem::remove(bin);
+  REQUIRE(openCsvDataset(csv, 1) == nullptr);
+  REQUIRE(openBinaryDataset(bin) == nullptr);
+}
+
+TEST_CASE("dot export")
+{
+  auto path = (std::filesystem::temp_directory_path() / "micrograd_graph.dot").string();
+  auto read = [&](const DotOptions &options, Value &root) {
+    REQUIRE(writeDot(path, root, options));
+    std::stringstream text;
+    text << std::ifstream(path).rdbuf();
+    return text.str();
+  };
+  auto count = [](const std::string &text, const std::string &what) {
+    size_t n = 0;
+    for (size_t at = text.find(what); at != std::string::npos; at = text.find(what, at + 1)) { n++; }
+    return n;
+  };
+
+  // a is used by five nodes but written once; twelve nodes in all.
+  ValuePtr a = Value::make(2.0);
+  a->setLabel("input");
+  std::vector<ValuePtr> terms;
+  for (int i = 0; i < 4; i++) { terms.push_back(a * Value::make(i)); }
+  ValuePtr y = tanh(sum(terms) + a);
+  std::string full = read({}, *y);
+  REQUIRE(full.starts_with("digraph G {"));
+  REQUIRE(count(full, "shape=\"record\"") == 12);
+  REQUIRE(count(full, "-> o") == 4 * 2 + 4 + 2 + 1);
+  REQUIRE(count(full, "|input}") == 1);
+
+  // The root, its op's operand and the sum's operands at depth 2, with the sum's own operands cut.
+  std::string shallow = read({ .maxDepth = 2 }, *y);
+  REQUIRE(count(shallow, "shape=\"record\"") == 4);
+  REQUIRE(count(shallow, "style=\"dashed\"") == 1);
+  std::string narrow = read({ .maxOperands = 2 }, *y);
+  REQUIRE(count(narrow, "2 more") == 1);
+  REQUIRE(count(narrow, "shape=\"record\"") == 8);
+
+  for (auto &t : terms) { t->setLabel("term"); }
+  REQUIRE(count(read({}, *y), "subgraph cluster_") == 1);
+  REQUIRE(count(read({ .clusterLabels = false }, *y), "subgraph cluster_") == 0);
+
+  // An MLP labels the nodes of each layer, and a labeled neuron its own.
+  MLP mlp({ 3, 4, 4, 2 });
+  Neuron neuron(2);
+  neuron.setLabel("neuron");
+  auto out = mlp(std::vector<double>{ 0.5, -1, 2 });
+  ValuePtr l = neuron(std::vector<ValuePtr>{ out[0], out[1] });
+  std::string model = read({}, *l);
+  REQUIRE(count(model, "subgraph cluster_") == 4);
+  REQUIRE(count(model, "label=\"layer 2\"") == 1);
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("expression templates")
+{
+  expr::Var<0> a;
+  expr::Var<1> b;
+  expr::Var<2> c;
+  auto f = tanh(a * b + exp(c)) / (2.0 - pow(b, 3)) + relu(-a) * c;
+  std::array<double, 3> at = { -0.4, 0.7, 1.3 };
+
+  auto va = std::make_shared<Value>(at[0]);
+  auto vb = std::make_shared<Value>(at[1]);
+  auto vc = std::make_shared<Value>(at[2]);
+  auto graph = tanh(va * vb + exp(vc)) / (2.0 - pow(vb, 3)) + relu(-va) * vc;
+  graph->backward();
+
+  REQUIRE_THAT(expr::value(f, at), Catch::Matchers::WithinAbs(graph->data(), 1e-14));
+  auto [v, d] = expr::derivatives(f, at);
+  REQUIRE(v == expr::value(f, at));
+  REQUIRE_THAT(d[0], Catch::Matchers::WithinAbs(va->grad(), 1e-14));
+  REQUIRE_THAT(d[1], Catch::Matchers::WithinAbs(vb->grad(), 1e-14));
+  REQUIRE_THAT(d[2], Catch::Matchers::WithinAbs(vc->grad(), 1e-14));
+  REQUIRE(expr::derivatives(log(c * 2), at).d[2] == 1 / at[2]);
+
+  SECTION("fused into a graph")
+  {
+    auto xa = std::make_shared<Value>(at[0]);
+    auto xb = std::make_shared<Value>(at[1]);
+    auto xc = std::make_shared<Value>(at[2]);
+    auto node = expr::fuse(f, std::array{ xa, xb, xc });
+    auto out = node * xa;
+    Plan plan(out);
+    plan.forward();
+    plan.backward();
+    REQUIRE(node->data() == v);
+    REQUIRE_THAT(xa->grad(), Catch::Matchers::WithinAbs(d[0] * at[0] + v, 1e-14));
+    REQUIRE_THAT(xb->grad(), Catch::Matchers::WithinAbs(d[1] * at[0], 1e-14));
+
+    // Replaying picks up new leaf values.
+    xc->_data = 2.0;
+    plan.forward();
+    REQUIRE(node->data() == expr::value(f, std::array{ at[0], at[1], 2.0 }));
+  }
+}
+
+TEST_CASE("profiler counters and trace")
+{
+  profiler::reset();
+  ValuePtr a = Value::make(1.0);
+  ValuePtr b = Value::make(2.0);
+  ValuePtr c = a * b + a;
+  c->backward();
+  const auto counters = profiler::counters();
+  if constexpr (profiler::enabled()) {
+    REQUIRE(counters.ops[MUL].created == 1);
+    REQUIRE(counters.ops[ADD].created == 1);
+    REQUIRE(counters.ops[MUL].backwardSteps == 1);
+    REQUIRE(counters.topoSorts == 1);
+    REQUIRE(counters.bytesAllocated >= 4 * sizeof(Value));
+    auto path = std::filesystem::temp_directory_path() / "micrograd_trace.json";
+    REQUIRE(profiler::writeChromeTrace(path.string()));
+    std::stringstream trace;
+    trace << std::ifstream(path).rdbuf();
+    std::filesystem::remove(path);
+    // One complete event per line between the opening and closing lines, all but the last followed by a comma.
+    const std::regex event(R"re(\{"name":"(\w+)","cat":"micrograd","ph":"X","ts":-?\d+\.\d+,"dur":\d+\.\d+,)re"
+                           R"re("pid":1,"tid":\d+\}(,?))re");
+    std::string line;
+    std::getline(trace, line);
+    REQUIRE(line == R"({"traceEvents":[)");
+    std::vector<std::string> names;
+    bool comma = true;
+    while (std::getline(trace, line) && line.starts_with('{')) {
+      std::smatch match;
+      REQUIRE(comma);
+      REQUIRE(std::regex_match(line, match, event));
+      names.push_back(match[1]);
+      comma = match[2].length() == 1;
+    }
+    REQUIRE(!comma);
+    REQUIRE(line == R"(],"displayTimeUnit":"ms"})");
+    REQUIRE(!std::getline(trace, line));
+    REQUIRE(std::ranges::count(names, "backward") == 1);
+    REQUIRE(std::ranges::count(names, "topo") == 1);
+
+    // A checkpoint replays its segment within its own backward step, which is all that is timed.
+    struct Segment : CheckpointFunction<double>
+    {
+      ValuePtr operator()(const ValuePtr &v) const override { return tanh(v * v); }
+    };
+    profiler::reset();
+    auto x = Value::makeTensor({ 3 }, std::vector<double>{ 0.5, -1, 2 });
+    sum(unstack(checkpoint<double>(std::make_shared<Segment>(), x, {})))->backward();
+    const auto nested = profiler::counters();
+    REQUIRE(nested.ops[CHECKPOINT].backwardSteps == 1);
+    REQUIRE(nested.ops[CHECKPOINT].backwardNs > 0);
+    REQUIRE(nested.ops[TANH].backwardSteps == 0);
+    REQUIRE(nested.ops[MUL].backwardSteps == 0);
+  } else {
+    REQUIRE(counters.ops[MUL].created == 0);
+    REQUIRE(counters.bytesAllocated == 0);
+  }
+}